@@ -0,0 +1,43 @@
+#!/bin/sh
+# Reports the resident memory that h264encrypt/h264decrypt instances add to a
+# process, with and without compact=true.
+#
+# Usage: measure_rss.sh [INSTANCES] [SETTLE_SECONDS]
+# Set GST_PLUGIN_PATH to the build directory to measure an uninstalled build.
+
+set -e
+
+N=${1:-200}
+SETTLE=${2:-5}
+KEY=01234567012345670123456701234567
+
+# Prints the VmRSS in kB of a gst-launch-1.0 running N copies of the branch
+rss() {
+    branch=$1
+    # shellcheck disable=SC2046
+    gst-launch-1.0 -q $(for i in $(seq "$N"); do
+        echo "videotestsrc is-live=true pattern=ball !" \
+            "video/x-raw,width=320,height=240,framerate=30/1 !" \
+            "x264enc tune=zerolatency key-int-max=30 ! $branch fakesink"
+    done) > /dev/null 2>&1 &
+    pid=$!
+    sleep "$SETTLE"
+    if ! kill -0 "$pid" 2> /dev/null; then
+        echo "gst-launch-1.0 exited early, is the plugin in GST_PLUGIN_PATH?" >&2
+        exit 1
+    fi
+    kb=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status")
+    kill "$pid"
+    wait "$pid" 2> /dev/null || true
+    echo "$kb"
+}
+
+base=$(rss "")
+full=$(rss "h264encrypt compact=false key=$KEY ! h264decrypt compact=false key=$KEY !")
+compact=$(rss "h264encrypt compact=true key=$KEY ! h264decrypt compact=true key=$KEY !")
+
+# Every branch holds one encryptor and one decryptor
+echo "instances:            $N encryptors, $N decryptors"
+echo "without elements:     $base kB"
+echo "compact=false:        $full kB ($(((full - base) * 1024 / (2 * N))) bytes per element)"
+echo "compact=true:         $compact kB ($(((compact - base) * 1024 / (2 * N))) bytes per element)"
@@ -53,11 +53,15 @@ GST_DEBUG_CATEGORY_STATIC(gst_h264_decrypt_debug);
 
 static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
     "sink", GST_PAD_SINK, GST_PAD_ALWAYS,
-    GST_STATIC_CAPS("video/x-h264,alignment=au,stream-format=byte-stream"));
+    GST_STATIC_CAPS("video/x-h264,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,avc,avc3};"
+                    "video/x-h264,alignment=(string)none,"
+                    "stream-format=(string)byte-stream"));
 
 static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
     "src", GST_PAD_SRC, GST_PAD_ALWAYS,
-    GST_STATIC_CAPS("video/x-h264,alignment=au,stream-format=byte-stream"));
+    GST_STATIC_CAPS("video/x-h264,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,avc,avc3}"));
 
 #define gst_h264_decrypt_parent_class parent_class
 G_DEFINE_TYPE(GstH264Decrypt, gst_h264_decrypt, GST_TYPE_H264_ENCRYPTION_BASE);
@@ -66,6 +70,39 @@ GST_ELEMENT_REGISTER_DEFINE(h264decrypt, "h264decrypt", GST_RANK_NONE,
 
 static GstFlowReturn gst_h264_decrypt_prepare_output_buffer(
     GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf);
+static GstFlowReturn gst_h264_decrypt_transform_ip(GstBaseTransform *trans,
+                                                   GstBuffer *buf);
+
+/**
+ * Drops buffers nothing is left of, such as alignment=nal buffers of an IV
+ * SEI.
+ */
+static GstFlowReturn gst_h264_decrypt_transform(GstBaseTransform *trans,
+                                                GstBuffer *inbuf,
+                                                GstBuffer *outbuf) {
+  GstFlowReturn ret =
+      GST_BASE_TRANSFORM_CLASS(parent_class)->transform(trans, inbuf, outbuf);
+  if (ret == GST_FLOW_OK && gst_buffer_get_size(outbuf) == 0) {
+    return GST_BASE_TRANSFORM_FLOW_DROPPED;
+  }
+  return ret;
+}
+
+static GstFlowReturn gst_h264_decrypt_transform_ip(GstBaseTransform *trans,
+                                                   GstBuffer *buf) {
+  GstH264Decrypt *h264decrypt = GST_H264_DECRYPT(trans);
+  if (h264decrypt->clear_au) {
+    // The buffer is the untouched input and may not be writable
+    h264decrypt->clear_au = FALSE;
+    return GST_FLOW_OK;
+  }
+  if (h264decrypt->drop_au) {
+    h264decrypt->drop_au = FALSE;
+    return GST_BASE_TRANSFORM_FLOW_DROPPED;
+  }
+  return GST_BASE_TRANSFORM_CLASS(parent_class)->transform_ip(trans, buf);
+}
+
 static void gst_h264_decrypt_enter_base_transform(
     GstH264EncryptionBase *encryption_base);
 static gboolean gst_h264_decrypt_before_nalu_copy(
@@ -108,6 +145,10 @@ static void gst_h264_decrypt_class_init(GstH264DecryptClass *klass) {
 
   GST_BASE_TRANSFORM_CLASS(klass)->prepare_output_buffer =
       GST_DEBUG_FUNCPTR(gst_h264_decrypt_prepare_output_buffer);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform =
+      GST_DEBUG_FUNCPTR(gst_h264_decrypt_transform);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform_ip =
+      GST_DEBUG_FUNCPTR(gst_h264_decrypt_transform_ip);
 
   GST_DEBUG_CATEGORY_INIT(gst_h264_decrypt_debug, "h264decrypt", 0,
                           "h264decrypt general logs");
@@ -120,22 +161,317 @@ static void gst_h264_decrypt_init(GstH264Decrypt *h264decrypt) {
   // FIXME Do I need to call this or is it already called?
   // G_OBJECT_CLASS(parent_class)->init(h264decrypt);
   h264decrypt->found_iv_sei = FALSE;
+  h264decrypt->iv_sei_pending = FALSE;
+  h264decrypt->in_picture = FALSE;
+  h264decrypt->picture_iv = FALSE;
+  h264decrypt->clear_au = FALSE;
+  h264decrypt->drop_au = FALSE;
+}
+
+// Parameter sets kept aside while looking for the IV SEI
+#define MAX_CLEAR_PARAMETER_SETS 32
+
+typedef enum {
+  IV_SEI_UNKNOWN,
+  IV_SEI_PRESENT,
+  IV_SEI_ABSENT,
+  // No IV SEI, but the picture derives its IV from the one of its GOP
+  IV_SEI_DERIVED,
+  // No IV SEI, and the GOP or picture the slices may belong to was forgotten
+  IV_SEI_LOST,
+} GstH264DecryptIvSeiPresence;
+
+/**
+ * Returns the offset of the next 3 byte start code at or after from, or size
+ * if there is none.
+ */
+static gsize _find_start_code(const guint8 *data, gsize from, gsize size) {
+  while (from + 3 <= size) {
+    const guint8 *one = memchr(&data[from + 2], 0x01, size - from - 2);
+    if (one == NULL) {
+      break;
+    }
+    gsize pos = one - data;
+    if (data[pos - 1] == 0 && data[pos - 2] == 0) {
+      return pos - 2;
+    }
+    from = pos - 1;
+  }
+  return size;
+}
+
+/**
+ * Looks for the IV SEI among the NAL units before the first slice of the
+ * access unit in data, which may be only the head of the access unit. NAL
+ * units are preceded by start codes or, for avc/avc3, by their length.
+ *
+ * When there is no IV SEI, the parameter sets before the first slice are
+ * parsed so that later encrypted access units can refer to them. Returns
+ * IV_SEI_UNKNOWN if data ends before the first slice.
+ *
+ * With slice IVs, the IV SEI only precedes slices starting a picture, so
+ * other slices are encrypted if their picture is. Within a GOP whose IV SEI
+ * has GOP flags, pictures without IV SEI are encrypted too. Once that GOP,
+ * or the picture slices continue, is forgotten, they are IV_SEI_LOST until
+ * the next IV SEI.
+ */
+static GstH264DecryptIvSeiPresence gst_h264_decrypt_find_iv_sei(
+    GstH264Decrypt *h264decrypt, const guint8 *data, gsize size) {
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(h264decrypt));
+  GstH264EncryptionCodec codec = utils->codec;
+  guint nal_length_size = utils->nal_length_size;
+  gsize parameter_sets[MAX_CLEAR_PARAMETER_SETS][2];
+  guint n_parameter_sets = 0;
+  gsize sc_offset = nal_length_size > 0 ? 0 : _find_start_code(data, 0, size);
+  while (sc_offset < size) {
+    // Byte-stream NAL units end at the next start code, which is only looked
+    // for after NAL units other than slices, as the first slice ends the
+    // search and scanning it would cost as much as the slice is large
+    gsize offset, end = size, next = size;
+    if (nal_length_size > 0) {
+      offset = sc_offset + nal_length_size;
+      if (offset >= size) {
+        return IV_SEI_UNKNOWN;
+      }
+      gsize length = 0;
+      for (guint i = 0; i < nal_length_size; i++) {
+        length = (length << 8) | data[sc_offset + i];
+      }
+      if (length == 0 || length > size - offset) {
+        return IV_SEI_UNKNOWN;
+      }
+      end = next = offset + length;
+    } else {
+      offset = sc_offset + 3;
+      if (offset >= size) {
+        return IV_SEI_UNKNOWN;
+      }
+    }
+    if (end - offset < NAL_HEADER_SIZE(codec)) {
+      return IV_SEI_UNKNOWN;
+    }
+    guint8 type = _nal_type(codec, &data[offset]);
+    if (_is_slice_type(codec, type)) {
+      if (end - offset < NAL_HEADER_SIZE(codec) + 1) {
+        return IV_SEI_UNKNOWN;
+      }
+      if (utils->slice_iv && !_slice_starts_picture(codec, &data[offset])) {
+        return h264decrypt->picture_iv ? IV_SEI_PRESENT : IV_SEI_LOST;
+      }
+      // Encryptors write an IV SEI on every keyframe, so a keyframe without
+      // one is clear and ends the GOP
+      gboolean keyframe = _is_keyframe_type(codec, type);
+      if (utils->gop_flags != 0 && !keyframe) {
+        return IV_SEI_DERIVED;
+      }
+      if (utils->gop_lost && !keyframe) {
+        return IV_SEI_LOST;
+      }
+      utils->gop_flags = 0;
+      utils->gop_lost = FALSE;
+      // Picture is clear, so are the slices that continue it
+      utils->slice_iv = FALSE;
+      for (guint i = 0; i < n_parameter_sets; i++) {
+        gst_h264_encryption_base_parse_parameter_set(
+            GST_H264_ENCRYPTION_BASE(h264decrypt), &data[parameter_sets[i][0]],
+            parameter_sets[i][1] - parameter_sets[i][0]);
+      }
+      return IV_SEI_ABSENT;
+    }
+    if (nal_length_size == 0) {
+      next = end = _find_start_code(data, offset, size);
+      while (end > offset && data[end - 1] == 0) {
+        end--;
+      }
+    }
+    if (_is_sei_type(codec, type)) {
+      guint extra_size;
+      if (_is_iv_sei(codec, &data[offset], end - offset, &extra_size)) {
+        return IV_SEI_PRESENT;
+      }
+    } else if (_is_parameter_set_type(codec, type)) {
+      if (n_parameter_sets == MAX_CLEAR_PARAMETER_SETS) {
+        return IV_SEI_UNKNOWN;
+      }
+      parameter_sets[n_parameter_sets][0] = sc_offset;
+      parameter_sets[n_parameter_sets][1] = end;
+      n_parameter_sets++;
+    }
+    sc_offset = next;
+  }
+  return IV_SEI_UNKNOWN;
 }
 
 /* GstBaseTransform vmethod implementations */
 
 static GstFlowReturn gst_h264_decrypt_prepare_output_buffer(
     GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf) {
-  UNUSED(trans);
+  GstH264Decrypt *h264decrypt = GST_H264_DECRYPT(trans);
+  if (GST_BUFFER_FLAG_IS_SET(input, GST_BUFFER_FLAG_DISCONT)) {
+    // The IV SEI of the picture going on may be lost
+    h264decrypt->in_picture = FALSE;
+    h264decrypt->iv_sei_pending = FALSE;
+    h264decrypt->picture_iv = FALSE;
+  }
+  // Clear access units of mixed streams go out as they came in. The IV SEI
+  // precedes the slices, so the first memory is enough to tell in practice.
+  GstMapInfo map_info;
+  if (gst_buffer_n_memory(input) > 0 &&
+      gst_memory_map(gst_buffer_peek_memory(input, 0), &map_info,
+                     GST_MAP_READ)) {
+    GstH264DecryptIvSeiPresence presence =
+        gst_h264_decrypt_find_iv_sei(h264decrypt, map_info.data, map_info.size);
+    gst_memory_unmap(gst_buffer_peek_memory(input, 0), &map_info);
+    if (presence == IV_SEI_ABSENT) {
+      GST_LOG_OBJECT(trans, "No IV SEI, passing access unit through");
+      h264decrypt->clear_au = TRUE;
+      *outbuf = input;
+      return GST_FLOW_OK;
+    }
+    if (presence == IV_SEI_LOST) {
+      GST_WARNING_OBJECT(trans,
+                         "IV of the picture was lost on a discontinuity, "
+                         "dropping until the next IV SEI");
+      h264decrypt->drop_au = TRUE;
+      *outbuf = input;
+      return GST_FLOW_OK;
+    }
+  }
+  // Decryption never grows the access unit, so it can happen in place if
+  // nobody else uses the input and mapping it does not merge memories
+  if (gst_buffer_is_writable(input) && gst_buffer_n_memory(input) == 1 &&
+      gst_buffer_is_all_memory_writable(input)) {
+    GST_LOG_OBJECT(trans, "Decrypting in place");
+    *outbuf = input;
+    return GST_FLOW_OK;
+  }
   gsize input_size = gst_buffer_get_size(input);
-  *outbuf = gst_buffer_new_and_alloc(input_size);
-  return GST_FLOW_OK;
+  return gst_h264_encryption_base_allocate_output_buffer(
+      GST_H264_ENCRYPTION_BASE(trans), input, input_size, outbuf);
 }
 
 static void gst_h264_decrypt_enter_base_transform(
     GstH264EncryptionBase *encryption_base) {
   GstH264Decrypt *h264decrypt = GST_H264_DECRYPT(encryption_base);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
   h264decrypt->found_iv_sei = FALSE;
+  // With slice IVs, pictures span buffers and start at their first slice
+  if (!utils->slice_iv) {
+    h264decrypt->in_picture = FALSE;
+    h264decrypt->iv_sei_pending = FALSE;
+  }
+}
+
+/**
+ * Decides whether the SEI is the one the encryptor inserts by looking at its
+ * raw bytes, without allocating or parsing, and reads its IV, flags and key
+ * ID.
+ *
+ * Without emulation prevention bytes, the IV SEI is exactly the signature,
+ * the IV, the flags and key ID if any and the trailing bits. Returns FALSE
+ * when raw bytes are not enough to decide, ie. the IV contains emulation
+ * prevention bytes or the SEI carries other messages.
+ */
+static gboolean _identify_iv_sei_fast(GstH264EncryptionCodec codec,
+                                      GstH264NalUnit *nalu, gboolean *is_iv_sei,
+                                      guint8 *iv, guint8 *flags,
+                                      guint8 *key_id) {
+  const guint8 *sei = &nalu->data[nalu->offset];
+  guint header_size = NAL_HEADER_SIZE(codec);
+  guint extra_size;
+  if (nalu->size <= header_size ||
+      sei[header_size] != GST_H264_SEI_USER_DATA_UNREGISTERED) {
+    // First message is not user data unregistered, so this SEI cannot be
+    // made of the IV message only
+    *is_iv_sei = FALSE;
+    return TRUE;
+  }
+  if (_is_iv_sei(codec, sei, nalu->size, &extra_size) &&
+      nalu->size == IV_SEI_NALU_SIZE(codec) + extra_size &&
+      sei[nalu->size - 1] == 0x80) {
+    *is_iv_sei = TRUE;
+    _read_iv_sei_payload(codec, sei, extra_size, iv, flags, key_id);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/**
+ * Takes the IV, flags and key of an IV SEI for the slices that follow it.
+ */
+static gboolean gst_h264_decrypt_use_iv(GstH264Decrypt *h264decrypt,
+                                        const guint8 *iv, guint8 flags,
+                                        guint8 key_id) {
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(h264decrypt));
+  if (G_UNLIKELY(!gst_h264_encryption_base_select_key(
+          GST_H264_ENCRYPTION_BASE(h264decrypt), key_id))) {
+    GST_ERROR_OBJECT(h264decrypt, "Key %u is not in the keyring!", key_id);
+    return FALSE;
+  }
+  memcpy(utils->iv, iv, AES_BLOCKLEN);
+  memcpy(utils->ctx.Iv, iv, AES_BLOCKLEN);
+  utils->slice_iv = (flags & GST_H264_ENCRYPT_IV_SEI_FLAG_SLICE_IV) != 0;
+  gst_h264_encryption_base_start_gop(GST_H264_ENCRYPTION_BASE(h264decrypt),
+                                     flags);
+  h264decrypt->found_iv_sei = TRUE;
+  h264decrypt->iv_sei_pending = TRUE;
+  GST_DEBUG_OBJECT(h264decrypt, "IV is found, flags 0x%02x, key %u", flags,
+                   key_id);
+  return TRUE;
+}
+
+/**
+ * Derives the IV of the picture the slice in nalu starts, unless an IV SEI
+ * preceded it. Pictures start at the first slice of the access unit, or with
+ * slice IVs at slices whose picture starts with them, as for the encryptor.
+ */
+static gboolean gst_h264_decrypt_start_picture(GstH264Decrypt *h264decrypt,
+                                               GstH264NalUnit *nalu) {
+  GstH264EncryptionBase *encryption_base =
+      GST_H264_ENCRYPTION_BASE(h264decrypt);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  gboolean starts_picture =
+      utils->slice_iv
+          ? _slice_starts_picture(utils->codec, &nalu->data[nalu->offset])
+          : !h264decrypt->in_picture;
+  h264decrypt->in_picture = TRUE;
+  if (!starts_picture) {
+    return TRUE;
+  }
+  h264decrypt->picture_iv = FALSE;
+  if (h264decrypt->iv_sei_pending) {
+    h264decrypt->iv_sei_pending = FALSE;
+    h264decrypt->picture_iv = TRUE;
+    return TRUE;
+  }
+  if (utils->gop_flags == 0) {
+    if (G_UNLIKELY(utils->gop_lost)) {
+      GST_ERROR_OBJECT(h264decrypt,
+                       "GOP of the picture was lost on a discontinuity and "
+                       "it has no IV SEI!");
+      return FALSE;
+    }
+    // Reported when the slice is decrypted
+    return TRUE;
+  }
+  if (G_UNLIKELY(!utils->keyed)) {
+    GST_ERROR_OBJECT(h264decrypt, "Key %u of the GOP left the keyring!",
+                     utils->key_id);
+    return FALSE;
+  }
+  if (!gst_h264_encryption_base_next_frame_iv(encryption_base)) {
+    GST_ERROR_OBJECT(h264decrypt,
+                     "Unable to derive the IV of the picture from its GOP, "
+                     "is its PTS known?");
+    return FALSE;
+  }
+  h264decrypt->found_iv_sei = TRUE;
+  h264decrypt->picture_iv = TRUE;
+  return TRUE;
 }
 
 static gboolean gst_h264_decrypt_before_nalu_copy(
@@ -145,45 +481,37 @@ static gboolean gst_h264_decrypt_before_nalu_copy(
   UNUSED(dest_offset);
   *copy = TRUE;
   GstH264Decrypt *h264decrypt = GST_H264_DECRYPT(encryption_base);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  if (_is_slice_type(utils->codec, src_nalu->type)) {
+    return gst_h264_decrypt_start_picture(h264decrypt, src_nalu);
+  }
   if (h264decrypt->found_iv_sei) {
     return TRUE;
   }
-  // Remove the first h264 encryption SEI
-  if (src_nalu->type == GST_H264_NAL_SEI) {
+  // Remove the first IV SEI
+  if (_is_sei_type(utils->codec, src_nalu->type)) {
     GST_DEBUG_OBJECT(encryption_base, "found SEI");
-    GstH264EncryptionUtils *utils =
-        gst_h264_encryption_base_get_encryption_utils(encryption_base);
-    GArray *sei_messages = g_array_new(FALSE, FALSE, sizeof(GstH264SEIMessage));
-    gst_h264_parser_parse_sei(utils->nalparser, src_nalu, &sei_messages);
-    // SEI that encryptor inserts has only one message
-    if (sei_messages->len == 1) {
-      GstH264SEIMessage *msg =
-          &g_array_index(sei_messages, GstH264SEIMessage, 0);
-      if (msg->payloadType == GST_H264_SEI_USER_DATA_UNREGISTERED) {
-        GST_DEBUG_OBJECT(encryption_base,
-                         "found the User Data Unregistered SEI");
-        if (memcmp(msg->payload.user_data_unregistered.uuid,
-                   GST_H264_ENCRYPT_IV_SEI_UUID,
-                   sizeof(GST_H264_ENCRYPT_IV_SEI_UUID) - 1) == 0) {
-          // Found encryptor SEI
-          // Read IV
-          if (G_UNLIKELY(msg->payload.user_data_unregistered.size !=
-                         AES_BLOCKLEN)) {
-            GST_ERROR_OBJECT(
-                encryption_base, "Expected IV size to be %d but found %d",
-                AES_BLOCKLEN, msg->payload.user_data_unregistered.size);
-            g_array_free(sei_messages, TRUE);
-            return FALSE;
-          }
-          memcpy(utils->ctx.Iv, msg->payload.user_data_unregistered.data,
-                 sizeof(utils->ctx.Iv));
-          GST_DEBUG_OBJECT(encryption_base, "IV is found");
-          *copy = FALSE;
-          h264decrypt->found_iv_sei = TRUE;
-        }
+    const guint8 *sei = &src_nalu->data[src_nalu->offset];
+    guint header_size = NAL_HEADER_SIZE(utils->codec);
+    gboolean is_iv_sei;
+    guint8 iv[AES_BLOCKLEN];
+    guint8 flags, key_id;
+    if (_identify_iv_sei_fast(utils->codec, src_nalu, &is_iv_sei, iv, &flags,
+                              &key_id)) {
+      if (is_iv_sei) {
+        *copy = FALSE;
+        return gst_h264_decrypt_use_iv(h264decrypt, iv, flags, key_id);
       }
+      return TRUE;
+    }
+    // SEI that encryptor inserts has only one message, whose IV may have
+    // emulation prevention bytes
+    if (_read_iv_sei(utils->codec, sei, &sei[header_size],
+                     src_nalu->size - header_size, iv, &flags, &key_id)) {
+      *copy = FALSE;
+      return gst_h264_decrypt_use_iv(h264decrypt, iv, flags, key_id);
     }
-    g_array_free(sei_messages, TRUE);
   }
   return TRUE;
 }
@@ -193,7 +521,11 @@ static gboolean gst_h264_decrypt_process_slice_nalu(
     GstMapInfo *dest_map_info, size_t *dest_offset) {
   UNUSED(dest_map_info);
   GstH264Decrypt *h264decrypt = GST_H264_DECRYPT(encryption_base);
-  if (G_UNLIKELY(!h264decrypt->found_iv_sei)) {
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  // With slice IVs, the IV SEI of the picture may be in an earlier buffer
+  if (G_UNLIKELY(utils->slice_iv ? !h264decrypt->picture_iv
+                                 : !h264decrypt->found_iv_sei)) {
     GST_ERROR_OBJECT(
         encryption_base,
         "Attempt to decrypt slice nalu but IV SEI is not observed yet!");
@@ -207,30 +539,6 @@ static gboolean gst_h264_decrypt_process_slice_nalu(
   return TRUE;
 }
 
-/**
- * Removes the padding if exists and returns padding byte count.
- *
- * Assumes data is padded at byte level, so it does not check individual bits.
- */
-inline static gint _remove_padding(uint8_t *data, size_t size) {
-  for (int i = size - 1; i >= 0; i--) {
-    switch (data[i]) {
-      case 0:
-        continue;
-      case 0x80: {
-        data[i] = 0;
-        return size - i;
-      }
-      default: {
-        GST_ERROR("Padding is not removed! Invalid byte found: %d", data[i]);
-        return 0;
-      }
-    }
-  }
-  // All zeros, not found
-  return 0;
-}
-
 /**
  * Decrypts padded nal unit and updates dest_offset.
  *
@@ -245,11 +553,15 @@ static gboolean gst_h264_decrypt_decrypt_slice_nalu(GstH264Decrypt *h264decrypt,
       gst_h264_encryption_base_get_encryption_utils(encryption_base);
   // Calculate payload offset and size
   gsize payload_offset, payload_size;
+  guint slice_address;
   if (!gst_h264_encryption_base_calculate_payload_offset_and_size(
-          encryption_base, utils->nalparser, nalu, &payload_offset,
-          &payload_size)) {
+          encryption_base, nalu, &payload_offset, &payload_size,
+          &slice_address)) {
     return FALSE;
   }
+  if (utils->slice_iv) {
+    gst_h264_encryption_base_set_slice_iv(encryption_base, slice_address);
+  }
   // Check end marker
   if (nalu->data[payload_offset + payload_size - 1] != CIPHERTEXT_END_MARKER) {
     GST_ERROR_OBJECT(h264decrypt,
@@ -296,28 +608,17 @@ static gboolean gst_h264_decrypt_decrypt_slice_nalu(GstH264Decrypt *h264decrypt,
   GST_DEBUG_OBJECT(encryption_base,
                    "Decrypting nal unit of type %d offset %ld size %ld",
                    nalu->type, payload_offset, payload_size);
-  // Decrypt
-  switch (utils->encryption_mode) {
-    case GST_H264_ENCRYPTION_MODE_AES_CTR:
-      AES_CTR_xcrypt_buffer(&utils->ctx, &nalu->data[payload_offset],
-                            payload_size);
-      break;
-    case GST_H264_ENCRYPTION_MODE_AES_ECB: {
-      for (size_t i = 0; i < payload_size; i += AES_BLOCKLEN) {
-        AES_ECB_decrypt(&utils->ctx, &nalu->data[payload_offset + i]);
-      }
-      break;
-    }
-    case GST_H264_ENCRYPTION_MODE_AES_CBC: {
-      AES_CBC_decrypt_buffer(&utils->ctx, &nalu->data[payload_offset],
-                             payload_size);
-      break;
-    }
-  }
+  // Decrypt, the blocks before the last one possibly on other threads later
+  gst_h264_encryption_base_decrypt_blocks(
+      encryption_base, &nalu->data[payload_offset], payload_size);
   // Remove padding
   // Only last AES_BLOCKLEN many bytes can be padding bytes
   int padding_byte_count =
-      _remove_padding(&nalu->data[payload_offset], payload_size);
+      payload_size > 0
+          ? _remove_padding(
+                &nalu->data[payload_offset + payload_size - AES_BLOCKLEN],
+                AES_BLOCKLEN)
+          : 0;
   if (G_UNLIKELY(padding_byte_count == 0)) {
     GST_WARNING_OBJECT(encryption_base,
                        "Padding is not found, data is invalid.");
@@ -36,8 +36,8 @@ G_BEGIN_DECLS
 
 GST_ELEMENT_REGISTER_DECLARE(h264decrypt)
 #define GST_TYPE_H264_DECRYPT (gst_h264_decrypt_get_type())
-G_DECLARE_FINAL_TYPE(GstH264Decrypt, gst_h264_decrypt, GST, H264_DECRYPT,
-                     GstH264EncryptionBase)
+G_DECLARE_TYPE_STRUCTURES(GstH264Decrypt, gst_h264_decrypt, GST, H264_DECRYPT,
+                          GstH264EncryptionBase)
 // #define GST_H264_SRC(obj)
 // (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_BASE_SRC,GstBaseSrc)) #define
 // GST_BASE_SRC_CLASS(klass)
@@ -49,10 +49,28 @@ G_DECLARE_FINAL_TYPE(GstH264Decrypt, gst_h264_decrypt, GST, H264_DECRYPT,
 // (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_BASE_SRC)) #define
 // GST_BASE_SRC_CAST(obj)          ((GstBaseSrc *)(obj))
 
+struct _GstH264DecryptClass {
+  GstH264EncryptionBaseClass parent_class;
+
+  gpointer padding[12];
+};
+
 struct _GstH264Decrypt {
   GstH264EncryptionBase encryption_base;
 
+  // IV of the access unit is known, from its IV SEI or derived
   gboolean found_iv_sei;
+  // IV SEI was read and the picture it precedes has not started yet
+  gboolean iv_sei_pending;
+  // A slice of the access unit was seen
+  gboolean in_picture;
+  // With slice IVs, the IV of the picture being decrypted is known. Cleared
+  // by pictures without IV SEI and by discontinuities.
+  gboolean picture_iv;
+  // Set by prepare_output_buffer when the access unit carries no IV SEI
+  gboolean clear_au;
+  // Set by prepare_output_buffer when the GOP of the access unit was lost
+  gboolean drop_au;
 };
 
 G_END_DECLS
@@ -52,10 +52,13 @@
 #include "h264_encryption_mode.h"
 #include "h264_encryption_plugin.h"
 #include "h264_encryption_types.h"
+#include "h264_iv_mode.h"
 
-enum { SIGNAL_IV, SIGNAL_LAST };
+enum { SIGNAL_IV, SIGNAL_SET_CALLBACKS, SIGNAL_LAST };
 enum {
   PROP_IV_SEED = PROP_LAST,  // Extend encryption base props
+  PROP_IV_MODE,
+  PROP_KEY_ID,
   ENCRYPT_PROP_LAST
 };
 
@@ -64,19 +67,94 @@ GST_DEBUG_CATEGORY_STATIC(gst_h264_encrypt_debug);
 
 static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
     "sink", GST_PAD_SINK, GST_PAD_ALWAYS,
-    GST_STATIC_CAPS("video/x-h264,alignment=au,stream-format=byte-stream"));
+    GST_STATIC_CAPS("video/x-h264,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,avc,avc3};"
+                    "video/x-h264,alignment=(string)none,"
+                    "stream-format=(string)byte-stream"));
 
 static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
     "src", GST_PAD_SRC, GST_PAD_ALWAYS,
-    GST_STATIC_CAPS("video/x-h264,alignment=au,stream-format=byte-stream"));
+    GST_STATIC_CAPS("video/x-h264,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,avc,avc3}"));
+
+/**
+ * IV SEI up to the IV, preceded by the longest start code, for every codec.
+ * Only the IV changes between access units, so the SEI is written by copying
+ * the tail of the template that matches the start code length and appending
+ * the IV. For avc/avc3 and hvc1/hev1, the start code bytes are then
+ * overwritten with the length.
+ */
+static const guint8 iv_sei_template[] =
+    "\x00\x00\x00\x01" GST_H264_ENCRYPT_IV_SEI_SIGNATURE;
+static const guint8 h265_iv_sei_template[] =
+    "\x00\x00\x00\x01" GST_H265_ENCRYPT_IV_SEI_SIGNATURE;
+
+// Room asked from upstream around access units for encrypting in place. Head
+// room fits the IV SEI, tail room the growth of several slices.
+#define ENCRYPT_HEADROOM 64
+#define ENCRYPT_TAILROOM 512
+
+// Refills of the IV generator between seeds from the system random source,
+// about a million IVs
+#define DRBG_RESEED_INTERVAL 4096
+
+/**
+ * NAL unit from the IV SEI position on, as recorded by the forward pass of
+ * in place encryption.
+ */
+typedef struct GstH264EncryptInPlaceNal {
+  guint sc_offset;       // Offset of the start code or length prefix
+  guint span;            // Bytes until the next start code, zeros included
+  guint payload_offset;  // Offset of the payload, 0 if not a slice
+  guint full_size;       // Payload bytes encrypted where they are
+  guint trailing_size;   // Bytes after the payload until the next start code
+  guint epb_index;       // First of the emulation prevention byte positions
+  guint epb_count;
+  guint growth;  // Padding, emulation prevention bytes and end marker
+  // Rest of the payload, padded to a block and encrypted
+  guint8 last_block[AES_BLOCKLEN];
+} GstH264EncryptInPlaceNal;
+
+/**
+ * Part of the payload of a slice of the access unit at au, encrypted by one
+ * of the threads of the element from the cipher state at its first block.
+ * The last part of the slice also encrypts its last block.
+ */
+typedef struct GstH264EncryptSliceTask {
+  struct AES_ctx ctx;
+  uint8_t *au;
+  guint nal_index;
+  guint offset;  // Offset of the part in the payload
+  guint size;
+  gboolean last;
+  // Emulation prevention byte positions of the part, found as if no zero
+  // bytes preceded it, and the zero bytes it ends with. Both are stitched to
+  // the part before it when merged.
+  GArray *positions;
+  guint zero_count;
+} GstH264EncryptSliceTask;
 
 #define gst_h264_encrypt_parent_class parent_class
 G_DEFINE_TYPE(GstH264Encrypt, gst_h264_encrypt, GST_TYPE_H264_ENCRYPTION_BASE);
 GST_ELEMENT_REGISTER_DEFINE(h264encrypt, "h264encrypt", GST_RANK_NONE,
                             GST_TYPE_H264_ENCRYPT);
 
-static GstMemory *gst_h264_encrypt_create_iv_sei_memory(
-    guint start_code_prefix_length, const guint8 *iv, guint iv_size);
+static void gst_h264_encrypt_finalize(GObject *object);
+static gboolean gst_h264_encrypt_propose_allocation(GstBaseTransform *trans,
+                                                    GstQuery *decide_query,
+                                                    GstQuery *query);
+static GstFlowReturn gst_h264_encrypt_transform(GstBaseTransform *trans,
+                                                GstBuffer *inbuf,
+                                                GstBuffer *outbuf);
+static GstFlowReturn gst_h264_encrypt_transform_ip(GstBaseTransform *trans,
+                                                   GstBuffer *buf);
+static gboolean gst_h264_encrypt_set_caps(GstBaseTransform *trans,
+                                          GstCaps *incaps, GstCaps *outcaps);
+static gboolean gst_h264_encrypt_write_iv_sei(
+    GstMapInfo *dest_map_info, size_t *dest_offset,
+    GstH264EncryptionCodec codec, const guint8 *next_header,
+    guint start_code_prefix_length, guint nal_length_size, const guint8 *iv,
+    guint8 flags, guint8 key_id);
 static GstFlowReturn gst_h264_encrypt_prepare_output_buffer(
     GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf);
 static gboolean gst_h264_encrypt_encrypt_slice_nalu(GstH264Encrypt *h264encrypt,
@@ -97,10 +175,9 @@ static void gst_h264_encrypt_set_property(GObject *object, guint prop_id,
                                           GParamSpec *pspec);
 static void gst_h264_encrypt_get_property(GObject *object, guint prop_id,
                                           GValue *value, GParamSpec *pspec);
-gboolean gst_h264_encrypt_get_random_iv(GstH264Encrypt *h264encrypt,
-                                        uint8_t *iv, guint block_len);
 void gst_h264_encrypt_set_random_iv_seed(GstH264Encrypt *h264encrypt,
                                          guint seed);
+static gboolean gst_h264_encrypt_refill_drbg(GstH264Encrypt *h264encrypt);
 /* GObject vmethod implementations */
 
 /* initialize the h264encrypt's class */
@@ -121,6 +198,7 @@ static void gst_h264_encrypt_class_init(GstH264EncryptClass *klass) {
       gst_h264_encrypt_process_slice_nalu;
   gobject_class->set_property = gst_h264_encrypt_set_property;
   gobject_class->get_property = gst_h264_encrypt_get_property;
+  gobject_class->finalize = gst_h264_encrypt_finalize;
 
   gst_element_class_set_details_simple(
       gstelement_class, "h264encrypt", "Codec/Encryption/Video",
@@ -131,17 +209,55 @@ static void gst_h264_encrypt_class_init(GstH264EncryptClass *klass) {
       gobject_class, PROP_IV_SEED,
       g_param_spec_uint(
           "iv-seed", "Encryption IV seed",
-          "32 bit seed value. Required for CTR/CBC modes. Setting "
-          "this takes effect immediately. Make sure to set it to random for "
-          "security.",
+          "32 bit seed of the IV generator, 0 to seed it from the system "
+          "random source. Other values give the same IVs every time and are "
+          "meant for development only. Setting this takes effect "
+          "immediately.",
           0, (guint)-1, RANDOM_IV_SEED_DEFAULT,
           G_PARAM_READWRITE | GST_PARAM_MUTABLE_PAUSED));
 
+  g_object_class_install_property(
+      gobject_class, PROP_IV_MODE,
+      g_param_spec_enum(
+          "iv-mode", "IV mode",
+          "Pictures that carry an IV SEI. With GOP modes, only keyframes do "
+          "and other pictures derive their IV from the one of the keyframe, "
+          "which h264decrypt reproduces from the flags of the SEI.",
+          GST_TYPE_H264_IV_MODE, GST_H264_IV_MODE_ACCESS_UNIT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+              GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property(
+      gobject_class, PROP_KEY_ID,
+      g_param_spec_uint(
+          "key-id", "Key ID",
+          "Keyring entry to encrypt with, see the add-key signal, 0 for the "
+          "key property. Changes apply from the next IV SEI on, which names "
+          "the key for h264decrypt.",
+          0, G_MAXUINT8, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+              GST_PARAM_MUTABLE_PLAYING));
+
   gst_h264_encrypt_signals[SIGNAL_IV] =
       g_signal_new("iv", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST,
                    G_STRUCT_OFFSET(GstH264EncryptClass, iv), NULL, NULL, NULL,
                    G_TYPE_BOOLEAN, 2, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_NONE);
 
+  /**
+   * Sets the IV provider of the application: a pointer to its
+   * GstH264EncryptCallbacks, which are copied, or NULL to remove them, the
+   * size of that struct, the user_data they are called with and the
+   * GDestroyNotify of user_data, which may be NULL. See
+   * gst_h264_encrypt_set_callbacks.
+   */
+  klass->set_callbacks = gst_h264_encrypt_set_callbacks;
+  gst_h264_encrypt_signals[SIGNAL_SET_CALLBACKS] = g_signal_new(
+      "set-callbacks", G_TYPE_FROM_CLASS(klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET(GstH264EncryptClass, set_callbacks), NULL, NULL, NULL,
+      G_TYPE_NONE, 4, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_POINTER,
+      G_TYPE_POINTER);
+
   gst_element_class_add_pad_template(
       gstelement_class, gst_static_pad_template_get(&src_template));
   gst_element_class_add_pad_template(
@@ -149,6 +265,14 @@ static void gst_h264_encrypt_class_init(GstH264EncryptClass *klass) {
 
   GST_BASE_TRANSFORM_CLASS(klass)->prepare_output_buffer =
       GST_DEBUG_FUNCPTR(gst_h264_encrypt_prepare_output_buffer);
+  GST_BASE_TRANSFORM_CLASS(klass)->propose_allocation =
+      GST_DEBUG_FUNCPTR(gst_h264_encrypt_propose_allocation);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform =
+      GST_DEBUG_FUNCPTR(gst_h264_encrypt_transform);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform_ip =
+      GST_DEBUG_FUNCPTR(gst_h264_encrypt_transform_ip);
+  GST_BASE_TRANSFORM_CLASS(klass)->set_caps =
+      GST_DEBUG_FUNCPTR(gst_h264_encrypt_set_caps);
 
   GST_DEBUG_CATEGORY_INIT(gst_h264_encrypt_debug, "h264encrypt", 0,
                           "h264encrypt general logs");
@@ -163,6 +287,12 @@ static void gst_h264_encrypt_set_property(GObject *object, guint prop_id,
       guint seed = g_value_get_uint(value);
       gst_h264_encrypt_set_random_iv_seed(h264encrypt, seed);
     } break;
+    case PROP_IV_MODE:
+      h264encrypt->iv_mode = g_value_get_enum(value);
+      break;
+    case PROP_KEY_ID:
+      g_atomic_int_set(&h264encrypt->key_id, g_value_get_uint(value));
+      break;
     default:
       G_OBJECT_CLASS(gst_h264_encrypt_parent_class)
           ->set_property(object, prop_id, value, pspec);
@@ -177,6 +307,12 @@ static void gst_h264_encrypt_get_property(GObject *object, guint prop_id,
     case PROP_IV_SEED:
       g_value_set_uint(value, h264encrypt->iv_random_seed);
       break;
+    case PROP_IV_MODE:
+      g_value_set_enum(value, h264encrypt->iv_mode);
+      break;
+    case PROP_KEY_ID:
+      g_value_set_uint(value, g_atomic_int_get(&h264encrypt->key_id));
+      break;
     default:
       G_OBJECT_CLASS(gst_h264_encrypt_parent_class)
           ->get_property(object, prop_id, value, pspec);
@@ -184,23 +320,159 @@ static void gst_h264_encrypt_get_property(GObject *object, guint prop_id,
   }
 }
 
+/**
+ * Encrypts slice by slice, with an IV for every slice, when NAL units come
+ * one by one instead of as access units, or when slices are encrypted by
+ * several threads.
+ */
+static gboolean gst_h264_encrypt_set_caps(GstBaseTransform *trans,
+                                          GstCaps *incaps, GstCaps *outcaps) {
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(trans);
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(trans));
+  if (!GST_BASE_TRANSFORM_CLASS(parent_class)
+           ->set_caps(trans, incaps, outcaps)) {
+    return FALSE;
+  }
+  h264encrypt->nal_aligned =
+      g_strcmp0(gst_structure_get_string(gst_caps_get_structure(incaps, 0),
+                                         "alignment"),
+                "nal") == 0;
+  utils->slice_iv =
+      h264encrypt->nal_aligned ||
+      gst_h264_encryption_base_get_threads(GST_H264_ENCRYPTION_BASE(trans)) > 1;
+  GST_DEBUG_OBJECT(trans, "Slices %s their own IV",
+                   utils->slice_iv ? "have" : "do not have");
+  // The first picture carries an IV SEI whatever the IV mode
+  utils->gop_flags = 0;
+  return TRUE;
+}
+
 void gst_h264_encrypt_enter_base_transform(
     GstH264EncryptionBase *encryption_base) {
   GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(encryption_base);
-  h264encrypt->inserted_sei = FALSE;
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  h264encrypt->slice_count = 0;
+  // With slice IVs, the IV SEI is tracked across buffers, one per picture
+  if (!utils->slice_iv) {
+    h264encrypt->inserted_sei = FALSE;
+  }
 }
 
 /**
  * Quickly check if this is our SEI
+ */
+static inline gboolean is_iv_sei(GstH264EncryptionCodec codec,
+                                 void *sei_payload, size_t payload_size) {
+  guint extra_size;
+  return _is_iv_sei(codec, sei_payload, payload_size, &extra_size);
+}
+
+/**
+ * Whether the IV SEI goes right before nalu: the first slice of the access
+ * unit, or the IV SEI of a previous encryptor. With slice IVs, access units
+ * are not seen whole, so it goes before slices starting a picture instead.
+ */
+static gboolean gst_h264_encrypt_needs_iv_sei(GstH264Encrypt *h264encrypt,
+                                              GstH264NalUnit *nalu) {
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(h264encrypt));
+  if (h264encrypt->inserted_sei) {
+    return FALSE;
+  }
+  if (_is_slice_type(utils->codec, nalu->type)) {
+    return !utils->slice_iv ||
+           _slice_starts_picture(utils->codec, &nalu->data[nalu->offset]);
+  }
+  return is_iv_sei(utils->codec, &nalu->data[nalu->offset], nalu->size);
+}
+
+/**
+ * Selects the keyring entry of the key-id property for the IV SEI about to
+ * be written.
+ */
+gboolean gst_h264_encrypt_select_key(GstH264Encrypt *h264encrypt) {
+  guint key_id = g_atomic_int_get(&h264encrypt->key_id);
+  if (G_UNLIKELY(!gst_h264_encryption_base_select_key(
+          GST_H264_ENCRYPTION_BASE(h264encrypt), key_id))) {
+    GST_ERROR_OBJECT(h264encrypt, "Key %u is not in the keyring!", key_id);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * Picks the IV of the picture nalu starts, or of the IV SEI of a previous
+ * encryptor nalu is, and returns in sei_flags the flags of its IV SEI.
  *
- * NOTE: If IV SEI content size changes, third byte of the signature needs to be
- * changed too
+ * With GOP IV modes, pictures other than keyframes derive their IV instead,
+ * and write_sei is set to FALSE, unless the key changes. IV SEI of previous
+ * encryptors still get an IV SEI before them, as decryptors take the first
+ * one of the access unit.
  */
-static inline gboolean is_iv_sei(void *sei_payload, size_t payload_size) {
-  size_t signature_size = sizeof(GST_H264_ENCRYPT_IV_SEI_SIGNATURE) - 1;
-  return payload_size >= signature_size &&
-         memcmp(sei_payload, GST_H264_ENCRYPT_IV_SEI_SIGNATURE,
-                signature_size) == 0;
+static gboolean gst_h264_encrypt_next_iv(GstH264Encrypt *h264encrypt,
+                                         GstH264NalUnit *nalu,
+                                         gboolean *write_sei,
+                                         guint8 *sei_flags) {
+  GstH264EncryptionBase *encryption_base =
+      GST_H264_ENCRYPTION_BASE(h264encrypt);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  guint8 gop_flags = 0;
+  switch (h264encrypt->iv_mode) {
+    case GST_H264_IV_MODE_GOP_COUNTER:
+      gop_flags = GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_COUNTER;
+      break;
+    case GST_H264_IV_MODE_GOP_PTS:
+      gop_flags = GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_PTS;
+      break;
+    case GST_H264_IV_MODE_ACCESS_UNIT:
+    default:
+      break;
+  }
+  if (gop_flags != 0 && utils->gop_flags == gop_flags && utils->keyed &&
+      utils->key_id == g_atomic_int_get(&h264encrypt->key_id) &&
+      _is_slice_type(utils->codec, nalu->type) &&
+      !_is_keyframe_type(utils->codec, nalu->type) &&
+      utils->gop_frame < G_MAXUINT32 &&
+      gst_h264_encryption_base_next_frame_iv(encryption_base)) {
+    *write_sei = FALSE;
+    return TRUE;
+  }
+  // Keyframe, first picture, picture without PTS or key change starts a new
+  // GOP
+  if (!gst_h264_encrypt_select_key(h264encrypt) ||
+      !gst_h264_encrypt_get_random_iv(h264encrypt, utils->iv, AES_BLOCKLEN)) {
+    return FALSE;
+  }
+  memcpy(utils->ctx.Iv, utils->iv, AES_BLOCKLEN);
+  gst_h264_encryption_base_start_gop(encryption_base, gop_flags);
+  *write_sei = TRUE;
+  *sei_flags =
+      (utils->slice_iv ? GST_H264_ENCRYPT_IV_SEI_FLAG_SLICE_IV : 0) | gop_flags;
+  return TRUE;
+}
+
+/**
+ * Pushes the IV SEI as a buffer of its own, before the output of the input
+ * buffer, as alignment=nal output has one NAL unit per buffer.
+ */
+static gboolean gst_h264_encrypt_push_iv_sei(GstH264Encrypt *h264encrypt,
+                                             const guint8 *sei,
+                                             gsize sei_size) {
+  GstBuffer *buffer = gst_buffer_new_allocate(NULL, sei_size, NULL);
+  if (h264encrypt->input != NULL) {
+    gst_buffer_copy_into(buffer, h264encrypt->input, GST_BUFFER_COPY_METADATA,
+                         0, -1);
+  }
+  // The picture goes on in the next buffer
+  GST_BUFFER_FLAG_UNSET(buffer, GST_BUFFER_FLAG_MARKER);
+  gst_buffer_fill(buffer, 0, sei, sei_size);
+  GST_LOG_OBJECT(h264encrypt, "Pushing IV SEI of %ld bytes", sei_size);
+  h264encrypt->push_ret = gst_h264_encryption_base_push(
+      GST_H264_ENCRYPTION_BASE(h264encrypt), buffer);
+  return h264encrypt->push_ret == GST_FLOW_OK;
 }
 
 gboolean gst_h264_encrypt_before_nalu_copy(
@@ -208,35 +480,34 @@ gboolean gst_h264_encrypt_before_nalu_copy(
     GstMapInfo *dest_map_info, size_t *dest_offset, gboolean *copy) {
   *copy = TRUE;
   GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(encryption_base);
-  if (h264encrypt->inserted_sei == FALSE &&
-      (IS_SLICE_NALU(src_nalu->type) ||
-       is_iv_sei(&src_nalu->data[src_nalu->offset], src_nalu->size))) {
+  if (gst_h264_encrypt_needs_iv_sei(h264encrypt, src_nalu)) {
     // Insert SEI right before the first slice
-    // TODO Check if we need emulation three byte insertion
-    GstMapInfo memory_map_info;
-    GstMemory *sei_memory;
     // Update IV and put it in the SEI
     GstH264EncryptionUtils *utils =
         gst_h264_encryption_base_get_encryption_utils(encryption_base);
-    if (!gst_h264_encrypt_get_random_iv(h264encrypt, utils->ctx.Iv,
-                                        AES_BLOCKLEN)) {
-      return FALSE;
-    }
-    sei_memory = gst_h264_encrypt_create_iv_sei_memory(
-        src_nalu->offset - src_nalu->sc_offset, utils->ctx.Iv, AES_BLOCKLEN);
-    if (!gst_memory_map(sei_memory, &memory_map_info, GST_MAP_READ)) {
-      GST_ERROR("Unable to map sei memory for read!");
-      gst_mini_object_unref(GST_MINI_OBJECT(sei_memory));
+    gboolean write_sei;
+    guint8 sei_flags;
+    if (!gst_h264_encrypt_next_iv(h264encrypt, src_nalu, &write_sei,
+                                  &sei_flags)) {
       return FALSE;
     }
-    if (_copy_memory_bytes(dest_map_info, &memory_map_info, dest_offset, 0,
-                           memory_map_info.size) == 0) {
-      gst_memory_unmap(sei_memory, &memory_map_info);
-      gst_mini_object_unref(GST_MINI_OBJECT(sei_memory));
+    if (write_sei && h264encrypt->nal_aligned) {
+      guint8 sei[IV_SEI_MAX_SIZE];
+      size_t sei_size = gst_h264_encrypt_fill_iv_sei(
+          sei, utils->codec, &src_nalu->data[src_nalu->offset],
+          src_nalu->offset - src_nalu->sc_offset, utils->nal_length_size,
+          utils->iv, sei_flags, utils->key_id);
+      if (!gst_h264_encrypt_push_iv_sei(h264encrypt, sei, sei_size)) {
+        return FALSE;
+      }
+    } else if (write_sei &&
+               !gst_h264_encrypt_write_iv_sei(
+            dest_map_info, dest_offset, utils->codec,
+            &src_nalu->data[src_nalu->offset],
+            src_nalu->offset - src_nalu->sc_offset, utils->nal_length_size,
+            utils->iv, sei_flags, utils->key_id)) {
       return FALSE;
     }
-    gst_memory_unmap(sei_memory, &memory_map_info);
-    gst_mini_object_unref(GST_MINI_OBJECT(sei_memory));
     h264encrypt->inserted_sei = TRUE;
   }
   return TRUE;
@@ -246,11 +517,17 @@ gboolean gst_h264_encrypt_process_slice_nalu(
     GstH264EncryptionBase *encryption_base, GstH264NalUnit *dest_nalu,
     GstMapInfo *dest_map_info, size_t *dest_offset) {
   GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(encryption_base);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  h264encrypt->slice_count++;
   if (!gst_h264_encrypt_encrypt_slice_nalu(h264encrypt, dest_nalu,
                                            dest_map_info, dest_offset)) {
     GST_ERROR_OBJECT(h264encrypt, "Failed to encrypt slice nal unit");
     return FALSE;
   }
+  if (utils->slice_iv) {
+    h264encrypt->inserted_sei = FALSE;
+  }
   return TRUE;
 }
 
@@ -259,41 +536,184 @@ gboolean gst_h264_encrypt_process_slice_nalu(
  */
 static void gst_h264_encrypt_init(GstH264Encrypt *h264encrypt) {
   h264encrypt->inserted_sei = FALSE;
+  h264encrypt->slice_count = 0;
+  h264encrypt->nal_aligned = FALSE;
+  h264encrypt->input = NULL;
+  h264encrypt->push_ret = GST_FLOW_OK;
+  h264encrypt->iv_mode = GST_H264_IV_MODE_ACCESS_UNIT;
+  h264encrypt->key_id = 0;
+  g_mutex_init(&h264encrypt->callbacks_lock);
+  g_cond_init(&h264encrypt->callbacks_cond);
+  memset(&h264encrypt->callbacks, 0, sizeof(h264encrypt->callbacks));
+  h264encrypt->callbacks_user_data = NULL;
+  h264encrypt->callbacks_notify = NULL;
+  h264encrypt->callbacks_calls = 0;
+  h264encrypt->callbacks_generation = 0;
+  h264encrypt->iv_batch_size = 0;
+  h264encrypt->iv_batch_index = 0;
+  h264encrypt->in_place_nals =
+      g_array_new(FALSE, FALSE, sizeof(GstH264EncryptInPlaceNal));
+  h264encrypt->epb_positions = g_array_new(FALSE, FALSE, sizeof(guint));
+  h264encrypt->slice_tasks =
+      g_array_new(FALSE, FALSE, sizeof(GstH264EncryptSliceTask));
+  h264encrypt->slice_positions =
+      g_ptr_array_new_with_free_func((GDestroyNotify)g_array_unref);
   gst_h264_encrypt_set_random_iv_seed(h264encrypt, RANDOM_IV_SEED_DEFAULT);
 }
 
+static void gst_h264_encrypt_finalize(GObject *object) {
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(object);
+  g_array_free(h264encrypt->in_place_nals, TRUE);
+  h264encrypt->in_place_nals = NULL;
+  g_array_free(h264encrypt->epb_positions, TRUE);
+  h264encrypt->epb_positions = NULL;
+  g_array_free(h264encrypt->slice_tasks, TRUE);
+  h264encrypt->slice_tasks = NULL;
+  g_ptr_array_free(h264encrypt->slice_positions, TRUE);
+  h264encrypt->slice_positions = NULL;
+  gst_h264_encrypt_set_callbacks(h264encrypt, NULL, 0, NULL, NULL);
+  g_cond_clear(&h264encrypt->callbacks_cond);
+  g_mutex_clear(&h264encrypt->callbacks_lock);
+  memset(&h264encrypt->drbg_ctx, 0, sizeof(h264encrypt->drbg_ctx));
+  memset(h264encrypt->drbg_pool, 0, sizeof(h264encrypt->drbg_pool));
+  G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
 /* GstBaseTransform vmethod implementations */
 
+/**
+ * Asks upstream for buffers with room around the access unit, so that the
+ * IV SEI and slice growth fit without copying the access unit.
+ */
+static gboolean gst_h264_encrypt_propose_allocation(GstBaseTransform *trans,
+                                                    GstQuery *decide_query,
+                                                    GstQuery *query) {
+  GstAllocationParams params;
+  if (!GST_BASE_TRANSFORM_CLASS(parent_class)
+           ->propose_allocation(trans, decide_query, query)) {
+    return FALSE;
+  }
+  gst_allocation_params_init(&params);
+  params.prefix = ENCRYPT_HEADROOM;
+  params.padding = ENCRYPT_TAILROOM;
+  gst_query_add_allocation_param(query, NULL, &params);
+  return TRUE;
+}
+
+/**
+ * Whether input can be encrypted in place: nobody else uses it, it is a
+ * single memory and there is room for the IV SEI and for the padding and end
+ * marker of as many slices as the previous buffer had. Emulation prevention
+ * bytes are rare in ciphertext, the in place path allocates if they do not
+ * fit.
+ */
+static gboolean gst_h264_encrypt_can_encrypt_in_place(
+    GstH264Encrypt *h264encrypt, GstBuffer *input) {
+  gsize headroom, maxsize, size;
+  if (!gst_buffer_is_writable(input) || gst_buffer_n_memory(input) != 1 ||
+      !gst_buffer_is_all_memory_writable(input)) {
+    return FALSE;
+  }
+  size = gst_buffer_get_sizes(input, &headroom, &maxsize);
+  return headroom >= IV_SEI_MAX_SIZE &&
+         maxsize - headroom - size >=
+             MAX(h264encrypt->slice_count, 1) * (AES_BLOCKLEN + 1);
+}
+
 /* this function does the actual processing
  */
 static GstFlowReturn gst_h264_encrypt_prepare_output_buffer(
     GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf) {
-  UNUSED(trans);
+  if (gst_h264_encrypt_can_encrypt_in_place(GST_H264_ENCRYPT(trans),
+                                            input)) {
+    GST_LOG_OBJECT(trans, "Encrypting in place");
+    *outbuf = input;
+    return GST_FLOW_OK;
+  }
   // TODO Calculate buffer size better
   gsize input_size = gst_buffer_get_size(input);
   // Also account for SEI, changable AES_BLOCKLEN and emulation bytes
-  *outbuf = gst_buffer_new_and_alloc(input_size + 40 + AES_BLOCKLEN + 210);
-  return GST_FLOW_OK;
+  return gst_h264_encryption_base_allocate_output_buffer(
+      GST_H264_ENCRYPTION_BASE(trans), input,
+      input_size + 40 + AES_BLOCKLEN + 210, outbuf);
 }
 
-static GstMemory *gst_h264_encrypt_create_iv_sei_memory(
-    guint start_code_prefix_length, const guint8 *iv, guint iv_size) {
-  GArray *messages =
-      g_array_sized_new(FALSE, FALSE, sizeof(GstH264SEIMessage), 1);
-  messages->len = 1;
-  GstH264SEIMessage *sei_message =
-      &g_array_index(messages, GstH264SEIMessage, 0);
-  sei_message->payloadType = GST_H264_SEI_USER_DATA_UNREGISTERED;
-  GstH264UserDataUnregistered *udu =
-      &sei_message->payload.user_data_unregistered;
-  memcpy(udu->uuid, GST_H264_ENCRYPT_IV_SEI_UUID, sizeof(udu->uuid));
-  udu->data = iv;
-  udu->size = iv_size;
-  // TODO avc/byte-stream
-  GstMemory *sei_memory =
-      gst_h264_create_sei_memory(start_code_prefix_length, messages);
-  g_array_free(messages, TRUE);
-  return sei_memory;
+/**
+ * Writes the IV SEI of codec with the given start code length to target,
+ * which has room for IV_SEI_MAX_SIZE bytes, and returns its size. If
+ * nal_length_size is not 0, the SEI is preceded by its length instead of a
+ * start code. If flags is not 0, the SEI carries it after the IV, and if
+ * key_id is not 0, flags and key_id. H.265 SEI take the layer and temporal ids
+ * of the NAL unit header at next_header, if not NULL.
+ */
+size_t gst_h264_encrypt_fill_iv_sei(uint8_t *target,
+                                    GstH264EncryptionCodec codec,
+                                    const guint8 *next_header,
+                                    guint start_code_prefix_length,
+                                    guint nal_length_size, const guint8 *iv,
+                                    guint8 flags, guint8 key_id) {
+  const guint8 *sei_template = codec == GST_H264_ENCRYPTION_CODEC_H265
+                                   ? h265_iv_sei_template
+                                   : iv_sei_template;
+  guint nal_header_size = NAL_HEADER_SIZE(codec);
+  size_t header_size = start_code_prefix_length + IV_SEI_SIGNATURE_SIZE(codec);
+  guint8 payload[AES_BLOCKLEN + IV_SEI_MAX_EXTRA_SIZE];
+  guint payload_size = AES_BLOCKLEN;
+  memcpy(target, &sei_template[4 - start_code_prefix_length], header_size);
+  memcpy(payload, iv, AES_BLOCKLEN);
+  if (nal_header_size > 1 && next_header != NULL) {
+    target[start_code_prefix_length + 1] = next_header[1];
+  }
+  if (flags != 0 || key_id != 0) {
+    payload[payload_size++] = flags;
+  }
+  if (key_id != 0) {
+    payload[payload_size++] = key_id;
+  }
+  // SEI payload size follows the NAL unit header and payload type
+  const guint8 *signature =
+      _iv_sei_signature(codec, payload_size - AES_BLOCKLEN);
+  target[start_code_prefix_length + nal_header_size + 1] =
+      signature[nal_header_size + 1];
+  size_t j = header_size;
+  // Last byte of the UUID is not zero, so escaping starts from scratch
+  guint zero_count = 0;
+  for (guint i = 0; i < payload_size; i++) {
+    if (zero_count >= 2 && payload[i] <= 0x03) {
+      target[j++] = 0x03;
+      zero_count = 0;
+    }
+    target[j++] = payload[i];
+    zero_count = payload[i] == 0 ? zero_count + 1 : 0;
+  }
+  // rbsp trailing bits, never needs escaping
+  target[j++] = 0x80;
+  if (nal_length_size > 0) {
+    // The SEI is shorter than 256 bytes, so its length always fits
+    gst_h264_encryption_base_write_nal_length(target, nal_length_size,
+                                              j - nal_length_size);
+  }
+  return j;
+}
+
+/**
+ * Writes the IV SEI with the given start code or length prefix to dest and
+ * advances dest_offset. Same as gst_h264_create_sei_memory, without
+ * allocations.
+ */
+static gboolean gst_h264_encrypt_write_iv_sei(
+    GstMapInfo *dest_map_info, size_t *dest_offset,
+    GstH264EncryptionCodec codec, const guint8 *next_header,
+    guint start_code_prefix_length, guint nal_length_size, const guint8 *iv,
+    guint8 flags, guint8 key_id) {
+  if (G_UNLIKELY(dest_map_info->maxsize < *dest_offset + IV_SEI_MAX_SIZE)) {
+    GST_ERROR("Unable to write IV SEI as destination is too small");
+    return FALSE;
+  }
+  *dest_offset += gst_h264_encrypt_fill_iv_sei(
+      &dest_map_info->data[*dest_offset], codec, next_header,
+      start_code_prefix_length, nal_length_size, iv, flags, key_id);
+  return TRUE;
 }
 
 /**
@@ -315,6 +735,25 @@ inline static size_t _apply_padding(uint8_t *data, size_t size,
   return i;
 }
 
+/**
+ * Appends the indices of data bytes that need an emulation prevention byte
+ * before them to positions, offset by base. zero_count carries the number of
+ * preceding zero bytes between calls.
+ */
+static void _find_emulation_prevention_positions(const uint8_t *data,
+                                                 size_t size, guint base,
+                                                 guint *zero_count,
+                                                 GArray *positions) {
+  for (size_t i = 0; i < size; i++) {
+    if (*zero_count >= 2 && data[i] <= 0x03) {
+      guint position = base + i;
+      g_array_append_val(positions, position);
+      *zero_count = 0;
+    }
+    *zero_count = data[i] == 0 ? *zero_count + 1 : 0;
+  }
+}
+
 static gboolean gst_h264_encrypt_encrypt_slice_nalu(GstH264Encrypt *h264encrypt,
                                                     GstH264NalUnit *nalu,
                                                     GstMapInfo *map_info,
@@ -325,11 +764,15 @@ static gboolean gst_h264_encrypt_encrypt_slice_nalu(GstH264Encrypt *h264encrypt,
       gst_h264_encryption_base_get_encryption_utils(encryption_base);
   // Calculate payload offset and size
   gsize payload_offset, payload_size;
+  guint slice_address;
   if (!gst_h264_encryption_base_calculate_payload_offset_and_size(
-          encryption_base, utils->nalparser, nalu, &payload_offset,
-          &payload_size)) {
+          encryption_base, nalu, &payload_offset, &payload_size,
+          &slice_address)) {
     return FALSE;
   }
+  if (utils->slice_iv) {
+    gst_h264_encryption_base_set_slice_iv(encryption_base, slice_address);
+  }
   GST_DEBUG_OBJECT(encryption_base,
                    "Encrypting nal unit of type %d offset %ld size %ld",
                    nalu->type, payload_offset, payload_size);
@@ -344,21 +787,7 @@ static gboolean gst_h264_encrypt_encrypt_slice_nalu(GstH264Encrypt *h264encrypt,
   *dest_offset += padding_byte_count;
   payload_size += padding_byte_count;
   // Encrypt
-  switch (utils->encryption_mode) {
-    case GST_H264_ENCRYPTION_MODE_AES_CTR:
-      AES_CTR_xcrypt_buffer(&utils->ctx, &nalu->data[payload_offset],
-                            payload_size);
-      break;
-    case GST_H264_ENCRYPTION_MODE_AES_CBC:
-      AES_CBC_encrypt_buffer(&utils->ctx, &nalu->data[payload_offset],
-                             payload_size);
-      break;
-    case GST_H264_ENCRYPTION_MODE_AES_ECB:
-      for (size_t i = 0; i < payload_size; i += AES_BLOCKLEN) {
-        AES_ECB_encrypt(&utils->ctx, &nalu->data[payload_offset + i]);
-      }
-      break;
-  }
+  _encrypt_blocks(utils, &nalu->data[payload_offset], payload_size);
   // Insert emulation prevention bytes
   uint8_t *target = &nalu->data[payload_offset];
   uint8_t *read_copy = (uint8_t *)g_slice_copy(payload_size, target);
@@ -408,43 +837,667 @@ static gboolean gst_h264_encrypt_encrypt_slice_nalu(GstH264Encrypt *h264encrypt,
   return TRUE;
 }
 
-gboolean gst_h264_encrypt_get_random_iv(GstH264Encrypt *h264encrypt,
-                                        uint8_t *iv, guint block_len) {
-  gboolean ret;
-  // Try to get application provided IV
-  g_signal_emit(h264encrypt, gst_h264_encrypt_signals[SIGNAL_IV], 0, iv,
-                AES_BLOCKLEN, &ret);
-  if (!ret) {
-    GST_LOG_OBJECT(h264encrypt, "No IV is provided, using random IV.");
-
-    // Generate random IV using random_r
-    for (guint i = 0; i < block_len;) {
-      int32_t rand_value;
-      if (random_r(&h264encrypt->iv_random_data, &rand_value) != 0) {
-        GST_ERROR_OBJECT(h264encrypt, "Failed generate random IV: %s",
-                         strerror(errno));
-        return FALSE;
+/**
+ * Records where the payload of the slice in nalu is and what writing it out
+ * needs in nal, before the payload is encrypted by
+ * gst_h264_encrypt_encrypt_in_place_nal: the padded last block and the
+ * growth of the slice without emulation prevention bytes. Sets the IV of the
+ * slice if slices have their own IV.
+ */
+static gboolean gst_h264_encrypt_prepare_slice_in_place(
+    GstH264Encrypt *h264encrypt, GstH264NalUnit *nalu,
+    GstH264EncryptInPlaceNal *nal) {
+  GstH264EncryptionBase *encryption_base =
+      GST_H264_ENCRYPTION_BASE(h264encrypt);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  gsize payload_offset, payload_size;
+  guint slice_address;
+  if (!gst_h264_encryption_base_calculate_payload_offset_and_size(
+          encryption_base, nalu, &payload_offset, &payload_size,
+          &slice_address)) {
+    return FALSE;
+  }
+  if (utils->slice_iv) {
+    gst_h264_encryption_base_set_slice_iv(encryption_base, slice_address);
+  }
+  GST_DEBUG_OBJECT(encryption_base,
+                   "Encrypting nal unit of type %d offset %ld size %ld in "
+                   "place",
+                   nalu->type, payload_offset, payload_size);
+  gsize rest_size = payload_size % AES_BLOCKLEN;
+  nal->payload_offset = payload_offset;
+  nal->full_size = payload_size - rest_size;
+  nal->trailing_size = nal->sc_offset + nal->span - payload_offset -
+                       payload_size;
+  // Padding goes to the last block, the slice itself has no room for it
+  memcpy(nal->last_block, &nalu->data[payload_offset + nal->full_size],
+         rest_size);
+  _apply_padding(nal->last_block, rest_size, AES_BLOCKLEN + 1);
+  nal->growth = AES_BLOCKLEN - rest_size + 1;
+  return TRUE;
+}
+
+/**
+ * Encrypts the payload of the slice nal records, in the access unit at au,
+ * where it is, continuing the cipher state in ctx. Emulation prevention
+ * bytes are only located into positions, they are inserted while writing
+ * the slice out.
+ */
+static void gst_h264_encrypt_encrypt_in_place_nal(
+    GstH264EncryptionMode encryption_mode, struct AES_ctx *ctx, uint8_t *au,
+    GstH264EncryptInPlaceNal *nal, GArray *positions) {
+  uint8_t *payload = &au[nal->payload_offset];
+  guint zero_count = 0;
+  _encrypt_ctx_blocks(encryption_mode, ctx, payload, nal->full_size);
+  _encrypt_ctx_blocks(encryption_mode, ctx, nal->last_block, AES_BLOCKLEN);
+  nal->epb_index = positions->len;
+  _find_emulation_prevention_positions(payload, nal->full_size, 0, &zero_count,
+                                       positions);
+  _find_emulation_prevention_positions(nal->last_block, AES_BLOCKLEN,
+                                       nal->full_size, &zero_count, positions);
+  nal->epb_count = positions->len - nal->epb_index;
+  nal->growth += nal->epb_count;
+}
+
+/**
+ * Adds the tasks encrypting the slice nal records at nal_index from the
+ * current cipher state. Payloads larger than CIPHER_CHUNK_SIZE are split
+ * into parts in CTR mode, whose parts start from the counter advanced by the
+ * blocks before them, and in ECB mode. CBC chains every block to the one
+ * before it, so its slices are encrypted whole.
+ */
+static void gst_h264_encrypt_add_slice_tasks(
+    GstH264Encrypt *h264encrypt, uint8_t *au, guint nal_index,
+    const GstH264EncryptInPlaceNal *nal) {
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(h264encrypt));
+  GArray *tasks = h264encrypt->slice_tasks;
+  gsize chunk_size =
+      utils->encryption_mode == GST_H264_ENCRYPTION_MODE_AES_CBC
+          ? nal->full_size
+          : CIPHER_CHUNK_SIZE;
+  guint offset = 0;
+  do {
+    GstH264EncryptSliceTask task = {
+        .ctx = utils->ctx,
+        .au = au,
+        .nal_index = nal_index,
+        .offset = offset,
+        .size = MIN(chunk_size, nal->full_size - offset),
+        .zero_count = 0,
+    };
+    task.last = offset + task.size == nal->full_size;
+    if (utils->encryption_mode == GST_H264_ENCRYPTION_MODE_AES_CTR) {
+      _advance_counter(task.ctx.Iv, offset / AES_BLOCKLEN);
+    }
+    if (tasks->len == h264encrypt->slice_positions->len) {
+      g_ptr_array_add(h264encrypt->slice_positions,
+                      g_array_new(FALSE, FALSE, sizeof(guint)));
+    }
+    task.positions =
+        g_ptr_array_index(h264encrypt->slice_positions, tasks->len);
+    g_array_set_size(task.positions, 0);
+    g_array_append_val(tasks, task);
+    offset += task.size;
+  } while (offset < nal->full_size);
+}
+
+static void gst_h264_encrypt_run_slice_task(gpointer task,
+                                            gpointer user_data) {
+  GstH264EncryptSliceTask *slice_task = task;
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(user_data);
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(h264encrypt));
+  GstH264EncryptInPlaceNal *nal =
+      &g_array_index(h264encrypt->in_place_nals, GstH264EncryptInPlaceNal,
+                     slice_task->nal_index);
+  uint8_t *part = &slice_task->au[nal->payload_offset + slice_task->offset];
+  _encrypt_ctx_blocks(utils->encryption_mode, &slice_task->ctx, part,
+                      slice_task->size);
+  _find_emulation_prevention_positions(part, slice_task->size,
+                                       slice_task->offset,
+                                       &slice_task->zero_count,
+                                       slice_task->positions);
+  if (slice_task->last) {
+    _encrypt_ctx_blocks(utils->encryption_mode, &slice_task->ctx,
+                        nal->last_block, AES_BLOCKLEN);
+    _find_emulation_prevention_positions(
+        nal->last_block, AES_BLOCKLEN, nal->full_size,
+        &slice_task->zero_count, slice_task->positions);
+  }
+}
+
+/**
+ * Appends the emulation prevention byte positions of the part task encrypted
+ * to epb_positions, given the zero bytes the part before it ends with in
+ * zero_count, which is updated to those of this part.
+ *
+ * The part was scanned as if no zero bytes preceded it. Both scans agree
+ * from its first non-zero byte on, which resets the count, so only the bytes
+ * up to that one are scanned again.
+ */
+static void gst_h264_encrypt_stitch_slice_task(
+    GstH264Encrypt *h264encrypt, const GstH264EncryptSliceTask *task,
+    const GstH264EncryptInPlaceNal *nal, guint *zero_count) {
+  const uint8_t *payload = &task->au[nal->payload_offset];
+  GArray *positions = task->positions;
+  guint end = task->offset + task->size + (task->last ? AES_BLOCKLEN : 0);
+  guint i = task->offset, p = 0;
+  gboolean settled = FALSE;
+  while (!settled && i < end) {
+    guint8 byte = i < nal->full_size ? payload[i]
+                                     : nal->last_block[i - nal->full_size];
+    if (*zero_count >= 2 && byte <= 0x03) {
+      g_array_append_val(h264encrypt->epb_positions, i);
+      *zero_count = 0;
+    }
+    *zero_count = byte == 0 ? *zero_count + 1 : 0;
+    settled = byte != 0;
+    i++;
+  }
+  while (p < positions->len && g_array_index(positions, guint, p) < i) {
+    p++;
+  }
+  g_array_append_vals(h264encrypt->epb_positions,
+                      &g_array_index(positions, guint, p), positions->len - p);
+  if (settled) {
+    *zero_count = task->zero_count;
+  }
+}
+
+/**
+ * Encrypts the slices of slice_tasks on the threads of the element, and
+ * merges their emulation prevention byte positions in order. Returns the
+ * growth the emulation prevention bytes add to the access unit.
+ */
+static gsize gst_h264_encrypt_run_slice_tasks(GstH264Encrypt *h264encrypt) {
+  GArray *tasks = h264encrypt->slice_tasks;
+  GArray *epb_positions = h264encrypt->epb_positions;
+  gsize growth = 0;
+  guint zero_count = 0;
+  gst_h264_encryption_base_run_tasks(
+      GST_H264_ENCRYPTION_BASE(h264encrypt), gst_h264_encrypt_run_slice_task,
+      tasks->data, tasks->len, sizeof(GstH264EncryptSliceTask), h264encrypt);
+  for (guint t = 0; t < tasks->len; t++) {
+    GstH264EncryptSliceTask *task =
+        &g_array_index(tasks, GstH264EncryptSliceTask, t);
+    GstH264EncryptInPlaceNal *nal = &g_array_index(
+        h264encrypt->in_place_nals, GstH264EncryptInPlaceNal, task->nal_index);
+    if (task->offset == 0) {
+      // First part of the slice, scanned from the start of the payload
+      nal->epb_index = epb_positions->len;
+      g_array_append_vals(epb_positions, task->positions->data,
+                          task->positions->len);
+      zero_count = task->zero_count;
+    } else {
+      gst_h264_encrypt_stitch_slice_task(h264encrypt, task, nal, &zero_count);
+    }
+    if (task->last) {
+      nal->epb_count = epb_positions->len - nal->epb_index;
+      nal->growth += nal->epb_count;
+      growth += nal->epb_count;
+    }
+  }
+  return growth;
+}
+
+/**
+ * Writes the NAL unit whose input starts at src to dest. For slices, this
+ * inserts the emulation prevention bytes and the end marker, and updates the
+ * length prefix if nal_length_size is not 0.
+ *
+ * dest may overlap src as long as it is not before it: bytes are written from
+ * the end, so every byte is read before it can be overwritten.
+ */
+static gboolean gst_h264_encrypt_write_in_place_nal(
+    const GstH264EncryptInPlaceNal *nal, const guint *epb_positions,
+    guint nal_length_size, const uint8_t *src, uint8_t *dest) {
+  if (nal->payload_offset == 0) {
+    memmove(dest, src, nal->span);
+    return TRUE;
+  }
+  size_t header_size = nal->payload_offset - nal->sc_offset;
+  size_t ciphertext_size = nal->full_size + AES_BLOCKLEN;
+  const guint *positions = &epb_positions[nal->epb_index];
+  guint epb_left = nal->epb_count;
+  uint8_t *target = &dest[header_size];
+  size_t j = ciphertext_size + nal->epb_count;
+  memset(&target[j + 1], 0, nal->trailing_size);
+  target[j] = CIPHERTEXT_END_MARKER;
+  for (size_t i = ciphertext_size; i-- > 0;) {
+    target[--j] = i < nal->full_size ? src[header_size + i]
+                                     : nal->last_block[i - nal->full_size];
+    if (epb_left > 0 && positions[epb_left - 1] == i) {
+      target[--j] = 0x03;
+      epb_left--;
+    }
+  }
+  memmove(dest, src, header_size);
+  if (nal_length_size > 0) {
+    return gst_h264_encryption_base_write_nal_length(
+        dest, nal_length_size,
+        header_size - nal_length_size + ciphertext_size + nal->epb_count + 1);
+  }
+  return TRUE;
+}
+
+/**
+ * Keeps the input buffer at hand for IV SEI pushed on their own, and returns
+ * the result of pushing them if that failed.
+ */
+static GstFlowReturn gst_h264_encrypt_transform(GstBaseTransform *trans,
+                                                GstBuffer *inbuf,
+                                                GstBuffer *outbuf) {
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(trans);
+  h264encrypt->input = inbuf;
+  h264encrypt->push_ret = GST_FLOW_OK;
+  GstFlowReturn ret =
+      GST_BASE_TRANSFORM_CLASS(parent_class)->transform(trans, inbuf, outbuf);
+  h264encrypt->input = NULL;
+  // Pushing the IV SEI may fail for reasons other than errors
+  if (ret == GST_FLOW_ERROR && h264encrypt->push_ret != GST_FLOW_OK) {
+    return h264encrypt->push_ret;
+  }
+  return ret;
+}
+
+/**
+ * Encrypts the access unit inside the head and tail room of its buffer.
+ *
+ * NAL units before the first slice move back into the head room to make room
+ * for the IV SEI. Slices are encrypted forward where they are, as the cipher
+ * state chains between them, or on all threads of the element once their IVs
+ * are set if slices have their own IV. They are then written out from the
+ * last one, each shifted by the growth of the slices before it. Only the
+ * inserted bytes move NAL units, instead of copying the whole access unit to a
+ * new buffer.
+ *
+ * If the slices grow more than the tail room, the result is written to a new
+ * memory that replaces the one of the buffer.
+ */
+static GstFlowReturn gst_h264_encrypt_transform_ip(GstBaseTransform *trans,
+                                                   GstBuffer *buf) {
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(trans);
+  GstH264EncryptionBase *encryption_base = GST_H264_ENCRYPTION_BASE(trans);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  GArray *nal_table = utils->nal_table;
+  GArray *in_place_nals = h264encrypt->in_place_nals;
+  GArray *slice_tasks = h264encrypt->slice_tasks;
+  GstMapInfo map_info, new_map_info;
+  GstMemory *new_memory = NULL;
+  GstH264NalUnit nalu;
+  guint8 sei[IV_SEI_MAX_SIZE];
+  gsize sei_size = 0, growth = 0;
+  gsize headroom, maxsize;
+  gsize size = gst_buffer_get_sizes(buf, &headroom, &maxsize);
+  guint i, first, nal_count;
+
+  GST_DEBUG_OBJECT(h264encrypt, "A buffer is received for in place");
+  utils->pts = GST_BUFFER_PTS(buf);
+  if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_TIMESTAMP(buf)))
+    gst_object_sync_values(GST_OBJECT(h264encrypt), GST_BUFFER_TIMESTAMP(buf));
+  // Map the head and tail room too, the access unit starts at headroom
+  gst_buffer_resize(buf, -(gssize)headroom, maxsize);
+  if (G_UNLIKELY(!gst_buffer_map(buf, &map_info, GST_MAP_READWRITE))) {
+    GST_ERROR_OBJECT(h264encrypt, "Unable to map buffer for rw!");
+    gst_buffer_resize(buf, headroom, size);
+    return GST_FLOW_ERROR;
+  }
+  uint8_t *au = &map_info.data[headroom];
+  if (!gst_h264_encryption_base_begin_au(encryption_base, au, size)) {
+    goto error;
+  }
+  // Parse NAL units before the IV SEI position for parameter sets
+  nal_count = nal_table->len;
+  for (first = 0; first < nal_count; first++) {
+    if (!gst_h264_encryption_base_identify_nalu(encryption_base, au, 0, first,
+                                                &nalu)) {
+      nal_count = first;
+      break;
+    }
+    if (_is_slice_type(utils->codec, nalu.type) ||
+        is_iv_sei(utils->codec, &nalu.data[nalu.offset], nalu.size)) {
+      break;
+    }
+  }
+  g_array_set_size(in_place_nals, 0);
+  g_array_set_size(h264encrypt->epb_positions, 0);
+  g_array_set_size(slice_tasks, 0);
+  // With slice IVs, slices are encrypted by all threads once their IV is set
+  gboolean parallel =
+      utils->slice_iv &&
+      gst_h264_encryption_base_get_threads(encryption_base) > 1;
+  if (first < nal_count && gst_h264_encrypt_needs_iv_sei(h264encrypt, &nalu)) {
+    gboolean write_sei;
+    guint8 sei_flags;
+    if (!gst_h264_encrypt_next_iv(h264encrypt, &nalu, &write_sei,
+                                  &sei_flags)) {
+      goto error;
+    }
+    if (write_sei) {
+      sei_size = gst_h264_encrypt_fill_iv_sei(
+          sei, utils->codec, &nalu.data[nalu.offset],
+          nalu.offset - nalu.sc_offset, utils->nal_length_size, utils->iv,
+          sei_flags, utils->key_id);
+    }
+    if (sei_size > 0 && h264encrypt->nal_aligned) {
+      if (!gst_h264_encrypt_push_iv_sei(h264encrypt, sei, sei_size)) {
+        goto error;
       }
-      int size = sizeof(rand_value) <= (block_len - i) ? sizeof(rand_value)
-                                                       : block_len - i;
-      memcpy(&iv[i], &rand_value, size);
-      i += size;
+      sei_size = 0;
     }
+    h264encrypt->inserted_sei = TRUE;
+  }
+  for (i = first; i < nal_count; i++) {
+    if (i > first && !gst_h264_encryption_base_identify_nalu(
+                         encryption_base, au, 0, i, &nalu)) {
+      nal_count = i;
+      break;
+    }
+    GstH264EncryptInPlaceNal nal = {0};
+    nal.sc_offset = nalu.sc_offset;
+    nal.span = (i + 1 < nal_table->len
+                    ? g_array_index(nal_table, GstH264EncryptionNalEntry, i + 1)
+                          .sc_offset
+                    : size) -
+               nal.sc_offset;
+    if (_is_slice_type(utils->codec, nalu.type)) {
+      h264encrypt->slice_count++;
+      if (!gst_h264_encrypt_prepare_slice_in_place(h264encrypt, &nalu,
+                                                   &nal)) {
+        GST_ERROR_OBJECT(h264encrypt, "Failed to encrypt slice nal unit");
+        goto error;
+      }
+      if (parallel) {
+        // Slices do not depend on each other, only their IVs are set here
+        gst_h264_encrypt_add_slice_tasks(h264encrypt, au, in_place_nals->len,
+                                         &nal);
+      } else {
+        gst_h264_encrypt_encrypt_in_place_nal(utils->encryption_mode,
+                                              &utils->ctx, au, &nal,
+                                              h264encrypt->epb_positions);
+      }
+      if (utils->slice_iv) {
+        h264encrypt->inserted_sei = FALSE;
+      }
+    }
+    growth += nal.growth;
+    g_array_append_val(in_place_nals, nal);
+  }
+  if (slice_tasks->len > 0) {
+    growth += gst_h264_encrypt_run_slice_tasks(h264encrypt);
+  }
+
+  // Output spans from the first start code, minus the IV SEI, to the end of
+  // the last processed NAL unit plus the growth of the slices
+  gsize start = 0, end = 0, sei_offset = 0;
+  if (nal_count > 0) {
+    start = g_array_index(nal_table, GstH264EncryptionNalEntry, 0).sc_offset;
+    end = nal_count < nal_table->len
+              ? g_array_index(nal_table, GstH264EncryptionNalEntry, nal_count)
+                    .sc_offset
+              : size;
+    sei_offset = first < nal_count ? g_array_index(nal_table,
+                                                   GstH264EncryptionNalEntry,
+                                                   first)
+                                         .sc_offset
+                                   : end;
+  }
+  gsize output_size = end - start + sei_size + growth;
+  uint8_t *dest;
+  if (headroom + start >= sei_size && end + growth <= maxsize - headroom) {
+    dest = &au[start] - sei_size;
+  } else {
+    GstAllocator *allocator;
+    GstAllocationParams params;
+    GST_DEBUG_OBJECT(h264encrypt,
+                     "Access unit grows by %ld, more than its room",
+                     sei_size + growth);
+    gst_base_transform_get_allocator(trans, &allocator, &params);
+    new_memory = gst_allocator_alloc(allocator, output_size, &params);
+    if (allocator) gst_object_unref(allocator);
+    if (G_UNLIKELY(new_memory == NULL ||
+                   !gst_memory_map(new_memory, &new_map_info,
+                                   GST_MAP_WRITE))) {
+      GST_ERROR_OBJECT(h264encrypt, "Unable to allocate output memory!");
+      goto error;
+    }
+    dest = new_map_info.data;
+  }
+  memmove(dest, &au[start], sei_offset - start);
+  memcpy(&dest[sei_offset - start], sei, sei_size);
+  // Slices grow, so start from the last NAL unit to not overwrite any input
+  gsize dest_offset = output_size;
+  for (i = in_place_nals->len; i-- > 0;) {
+    GstH264EncryptInPlaceNal *nal =
+        &g_array_index(in_place_nals, GstH264EncryptInPlaceNal, i);
+    dest_offset -= nal->span + nal->growth;
+    if (!gst_h264_encrypt_write_in_place_nal(
+            nal, (const guint *)h264encrypt->epb_positions->data,
+            utils->nal_length_size, &au[nal->sc_offset],
+            &dest[dest_offset])) {
+      if (new_memory) gst_memory_unmap(new_memory, &new_map_info);
+      goto error;
+    }
+  }
+  gst_h264_encryption_base_end_au(encryption_base);
+  gst_buffer_unmap(buf, &map_info);
+  if (new_memory != NULL) {
+    gst_memory_unmap(new_memory, &new_map_info);
+    gst_buffer_replace_all_memory(buf, new_memory);
+  } else {
+    gst_buffer_resize(buf, headroom + start - sei_size, output_size);
+  }
+  return GST_FLOW_OK;
+
+error:
+  if (new_memory) gst_memory_unref(new_memory);
+  gst_h264_encryption_base_end_au(encryption_base);
+  gst_buffer_unmap(buf, &map_info);
+  gst_buffer_resize(buf, headroom, size);
+  return GST_FLOW_ERROR;
+}
+
+/**
+ * Sets the IV provider of the application, replacing the previous one whose
+ * notify is called with its user_data once no call to it is in progress.
+ * callbacks_size must be the size of GstH264EncryptCallbacks, as applications
+ * declare the struct themselves; otherwise the callbacks are rejected and
+ * notify is called with user_data. Callbacks are faster to call than the iv
+ * signal, which is only emitted without them. Callbacks must not set
+ * callbacks themselves.
+ */
+void gst_h264_encrypt_set_callbacks(GstH264Encrypt *h264encrypt,
+                                    const GstH264EncryptCallbacks *callbacks,
+                                    guint callbacks_size, gpointer user_data,
+                                    GDestroyNotify notify) {
+  if (callbacks != NULL && callbacks_size != sizeof(GstH264EncryptCallbacks)) {
+    GST_ERROR_OBJECT(h264encrypt,
+                     "Callbacks of %u bytes do not match the %ld bytes of "
+                     "GstH264EncryptCallbacks",
+                     callbacks_size, sizeof(GstH264EncryptCallbacks));
+    if (notify) notify(user_data);
+    return;
+  }
+  g_mutex_lock(&h264encrypt->callbacks_lock);
+  gpointer old_user_data = h264encrypt->callbacks_user_data;
+  GDestroyNotify old_notify = h264encrypt->callbacks_notify;
+  if (callbacks != NULL) {
+    h264encrypt->callbacks = *callbacks;
   } else {
+    memset(&h264encrypt->callbacks, 0, sizeof(h264encrypt->callbacks));
+  }
+  h264encrypt->callbacks_user_data = user_data;
+  h264encrypt->callbacks_notify = notify;
+  h264encrypt->callbacks_generation++;
+  // IVs of the previous provider are not used anymore
+  h264encrypt->iv_batch_size = 0;
+  h264encrypt->iv_batch_index = 0;
+  // The previous provider may still be called on the streaming thread
+  while (h264encrypt->callbacks_calls > 0) {
+    g_cond_wait(&h264encrypt->callbacks_cond, &h264encrypt->callbacks_lock);
+  }
+  g_mutex_unlock(&h264encrypt->callbacks_lock);
+  if (old_notify) old_notify(old_user_data);
+}
+
+/**
+ * Takes the next IV from the callbacks, asking the batch callback for more
+ * when its IVs are used up. Returns FALSE if no callback gives one.
+ */
+static gboolean gst_h264_encrypt_callback_iv(GstH264Encrypt *h264encrypt,
+                                             uint8_t *iv) {
+  g_mutex_lock(&h264encrypt->callbacks_lock);
+  if (h264encrypt->iv_batch_index < h264encrypt->iv_batch_size) {
+    memcpy(iv, h264encrypt->iv_batch[h264encrypt->iv_batch_index++],
+           AES_BLOCKLEN);
+    g_mutex_unlock(&h264encrypt->callbacks_lock);
+    return TRUE;
+  }
+  // Application code is called without the lock, so that a slow provider
+  // does not hold back setting another one
+  GstH264EncryptCallbacks callbacks = h264encrypt->callbacks;
+  gpointer user_data = h264encrypt->callbacks_user_data;
+  guint generation = h264encrypt->callbacks_generation;
+  if (callbacks.ivs == NULL && callbacks.iv == NULL) {
+    g_mutex_unlock(&h264encrypt->callbacks_lock);
+    return FALSE;
+  }
+  h264encrypt->callbacks_calls++;
+  g_mutex_unlock(&h264encrypt->callbacks_lock);
+  gboolean ret = FALSE;
+  guint n_ivs = 0;
+  // Only the streaming thread fills the batch, so it is written unlocked
+  if (callbacks.ivs != NULL) {
+    n_ivs = MIN(callbacks.ivs(h264encrypt, &h264encrypt->iv_batch[0][0],
+                              GST_H264_ENCRYPT_IV_BATCH_SIZE, AES_BLOCKLEN,
+                              user_data),
+                GST_H264_ENCRYPT_IV_BATCH_SIZE);
+  }
+  if (n_ivs > 0) {
+    memcpy(iv, h264encrypt->iv_batch[0], AES_BLOCKLEN);
+    ret = TRUE;
+  } else if (callbacks.iv != NULL) {
+    ret = callbacks.iv(h264encrypt, iv, AES_BLOCKLEN, user_data);
+  }
+  g_mutex_lock(&h264encrypt->callbacks_lock);
+  // Keep the rest of the batch unless another provider was set meanwhile
+  if (generation == h264encrypt->callbacks_generation) {
+    h264encrypt->iv_batch_size = n_ivs;
+    h264encrypt->iv_batch_index = MIN(n_ivs, 1);
+  }
+  if (--h264encrypt->callbacks_calls == 0) {
+    g_cond_broadcast(&h264encrypt->callbacks_cond);
+  }
+  g_mutex_unlock(&h264encrypt->callbacks_lock);
+  return ret;
+}
+
+gboolean gst_h264_encrypt_get_random_iv(GstH264Encrypt *h264encrypt,
+                                        uint8_t *iv, guint block_len) {
+  gboolean ret = FALSE;
+  if (gst_h264_encrypt_callback_iv(h264encrypt, iv)) {
+    GST_LOG_OBJECT(h264encrypt, "Using IV provided by IV callbacks.");
+    return TRUE;
+  }
+  // Try to get application provided IV, without emitting if nobody listens
+  if (g_signal_has_handler_pending(
+          h264encrypt, gst_h264_encrypt_signals[SIGNAL_IV], 0, TRUE)) {
+    g_signal_emit(h264encrypt, gst_h264_encrypt_signals[SIGNAL_IV], 0, iv,
+                  AES_BLOCKLEN, &ret);
+  }
+  if (ret) {
     GST_LOG_OBJECT(h264encrypt, "Using IV provided by IV signal.");
+    return TRUE;
+  }
+  GST_LOG_OBJECT(h264encrypt, "No IV is provided, using random IV.");
+  GST_OBJECT_LOCK(h264encrypt);
+  if (h264encrypt->drbg_index == GST_H264_ENCRYPT_DRBG_POOL_SIZE &&
+      !gst_h264_encrypt_refill_drbg(h264encrypt)) {
+    GST_OBJECT_UNLOCK(h264encrypt);
+    return FALSE;
   }
+  memcpy(iv, h264encrypt->drbg_pool[h264encrypt->drbg_index],
+         MIN(block_len, AES_BLOCKLEN));
+  // Used IVs do not stay in memory
+  memset(h264encrypt->drbg_pool[h264encrypt->drbg_index++], 0, AES_BLOCKLEN);
+  GST_OBJECT_UNLOCK(h264encrypt);
   return TRUE;
 }
 
+/**
+ * Sets the key and counter of the IV generator from the system random
+ * source, or from seed if not 0.
+ */
+static gboolean gst_h264_encrypt_seed_drbg(GstH264Encrypt *h264encrypt,
+                                           guint seed) {
+  guint8 material[AES_KEYLEN + AES_BLOCKLEN] = {0};
+  if (seed == 0) {
+    if (getrandom(material, sizeof(material), 0) != sizeof(material)) {
+      GST_ERROR_OBJECT(h264encrypt, "Unable to seed the IV generator: %s",
+                       strerror(errno));
+      return FALSE;
+    }
+  } else {
+    // Stretch the seed with the cipher, as key of the keystream of the
+    // actual key and counter
+    struct AES_ctx seed_ctx;
+    guint8 seed_key[AES_KEYLEN] = {0};
+    guint8 counter[AES_BLOCKLEN] = {0};
+    GST_WRITE_UINT32_BE(seed_key, seed);
+    AES_init_ctx_iv(&seed_ctx, seed_key, counter);
+    AES_CTR_xcrypt_buffer(&seed_ctx, material, sizeof(material));
+  }
+  AES_init_ctx_iv(&h264encrypt->drbg_ctx, material, &material[AES_KEYLEN]);
+  memset(material, 0, sizeof(material));
+  h264encrypt->drbg_refills = 0;
+  return TRUE;
+}
+
+/**
+ * Fills the IV pool with the next keystream blocks of the IV generator, then
+ * replaces its key with the block after them, so that its state does not
+ * tell the IVs it already gave. Reseeds from the system random source every
+ * DRBG_RESEED_INTERVAL refills unless a seed is set.
+ */
+static gboolean gst_h264_encrypt_refill_drbg(GstH264Encrypt *h264encrypt) {
+  guint8 next_key[AES_KEYLEN] = {0};
+  if (!h264encrypt->drbg_seeded ||
+      (h264encrypt->iv_random_seed == 0 &&
+       h264encrypt->drbg_refills == DRBG_RESEED_INTERVAL)) {
+    h264encrypt->drbg_seeded =
+        gst_h264_encrypt_seed_drbg(h264encrypt, h264encrypt->iv_random_seed);
+    if (!h264encrypt->drbg_seeded) {
+      return FALSE;
+    }
+  }
+  memset(h264encrypt->drbg_pool, 0, sizeof(h264encrypt->drbg_pool));
+  AES_CTR_xcrypt_buffer(&h264encrypt->drbg_ctx,
+                        &h264encrypt->drbg_pool[0][0],
+                        sizeof(h264encrypt->drbg_pool));
+  AES_CTR_xcrypt_buffer(&h264encrypt->drbg_ctx, next_key, sizeof(next_key));
+  // Keeps the counter, only the round keys change
+  AES_init_ctx(&h264encrypt->drbg_ctx, next_key);
+  memset(next_key, 0, sizeof(next_key));
+  h264encrypt->drbg_index = 0;
+  h264encrypt->drbg_refills++;
+  GST_LOG_OBJECT(h264encrypt, "IV generator made %d IVs",
+                 GST_H264_ENCRYPT_DRBG_POOL_SIZE);
+  return TRUE;
+}
+
+/**
+ * Seeds the IV generator again. IVs it already made are dropped.
+ */
 void gst_h264_encrypt_set_random_iv_seed(GstH264Encrypt *h264encrypt,
                                          guint seed) {
   GST_INFO_OBJECT(h264encrypt, "Setting random seed.");
-  if (initstate_r(seed, h264encrypt->iv_random_state_buf,
-                  sizeof(h264encrypt->iv_random_state_buf),
-                  &h264encrypt->iv_random_data) != 0) {
-    GST_ERROR_OBJECT(h264encrypt, "Unable to set random seed: %s",
-                     strerror(errno));
-  } else {
-    h264encrypt->iv_random_seed = seed;
-  }
+  GST_OBJECT_LOCK(h264encrypt);
+  h264encrypt->iv_random_seed = seed;
+  h264encrypt->drbg_seeded = FALSE;
+  h264encrypt->drbg_index = GST_H264_ENCRYPT_DRBG_POOL_SIZE;
+  memset(h264encrypt->drbg_pool, 0, sizeof(h264encrypt->drbg_pool));
+  GST_OBJECT_UNLOCK(h264encrypt);
 }
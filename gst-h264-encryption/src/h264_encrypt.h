@@ -26,57 +26,65 @@
 #include <gst/base/gstbasetransform.h>
 #include <gst/codecparsers/gsth264parser.h>
 #include <gst/gst.h>
-#include <stdlib.h>
 
 #include "ciphers/aes.h"
 #include "h264_encryption_base.h"
 #include "h264_encryption_mode.h"
 #include "h264_encryption_types.h"
+#include "h264_iv_mode.h"
 
 G_BEGIN_DECLS
 
-#define RANDOM_IV_SEED_DEFAULT 1869052520
-
-/*
- * Declares type structure as with derivable/final declares but does not define
- * class or instance structures.
- * See G_DECLARE_FINAL_TYPE and/or G_DECLARE_FINAL_TYPE for details.
- */
-#define G_DECLARE_TYPE_STRUCTURES(ModuleObjName, module_obj_name, MODULE,     \
-                                  OBJ_NAME, ParentName)                       \
-  GType module_obj_name##_get_type(void);                                     \
-  G_GNUC_BEGIN_IGNORE_DEPRECATIONS                                            \
-  typedef struct _##ModuleObjName ModuleObjName;                              \
-  typedef struct _##ModuleObjName##Class ModuleObjName##Class;                \
-                                                                              \
-  _GLIB_DEFINE_AUTOPTR_CHAINUP(ModuleObjName, ParentName)                     \
-  G_DEFINE_AUTOPTR_CLEANUP_FUNC(ModuleObjName##Class, g_type_class_unref)     \
-                                                                              \
-  G_GNUC_UNUSED static inline ModuleObjName *MODULE##_##OBJ_NAME(             \
-      gpointer ptr) {                                                         \
-    return G_TYPE_CHECK_INSTANCE_CAST(ptr, module_obj_name##_get_type(),      \
-                                      ModuleObjName);                         \
-  }                                                                           \
-  G_GNUC_UNUSED static inline gboolean MODULE##_IS_##OBJ_NAME(gpointer ptr) { \
-    return G_TYPE_CHECK_INSTANCE_TYPE(ptr, module_obj_name##_get_type());     \
-  }                                                                           \
-  G_GNUC_END_IGNORE_DEPRECATIONS
+// 0 seeds the IV generator from getrandom
+#define RANDOM_IV_SEED_DEFAULT 0
+// IVs the IV generator makes at once
+#define GST_H264_ENCRYPT_DRBG_POOL_SIZE 256
 
 GST_ELEMENT_REGISTER_DECLARE(h264encrypt)
 #define GST_TYPE_H264_ENCRYPT (gst_h264_encrypt_get_type())
 G_DECLARE_TYPE_STRUCTURES(GstH264Encrypt, gst_h264_encrypt, GST, H264_ENCRYPT,
                           GstH264EncryptionBase)
 
+// IVs asked from the batch IV callback at once
+#define GST_H264_ENCRYPT_IV_BATCH_SIZE 64
+
+/**
+ * IV provider of the application, called on the streaming thread instead of
+ * emitting the iv signal. Either callback may be NULL. Applications set it
+ * with the set-callbacks action signal, declaring this struct with the same
+ * layout, as the plugin installs no header, and passing its size along so that
+ * a mismatched layout is rejected.
+ *
+ * @iv: Writes the IV of the next IV SEI of block_length bytes to iv. Returns
+ * FALSE to let the element pick a random IV.
+ * @ivs: Writes up to n_ivs IVs of the next IV SEI, one after another, to ivs
+ * and returns how many were written. Asked before iv whenever the IVs it
+ * gave are used up.
+ */
+typedef struct {
+  gboolean (*iv)(GstH264Encrypt *encrypt, guint8 *iv, guint block_length,
+                 gpointer user_data);
+  guint (*ivs)(GstH264Encrypt *encrypt, guint8 *ivs, guint n_ivs,
+               guint block_length, gpointer user_data);
+
+  /*< private >*/
+  gpointer _gst_reserved[GST_PADDING];
+} GstH264EncryptCallbacks;
+
 struct _GstH264EncryptClass {
   GstH264EncryptionBaseClass parent_class;
 
   /* Signals */
-  /* NOTE For performance, these can be replaced with callbacks, ie.
-   * gst_app_sink_set_callbacks.
-   */
+  /* Fallback of GstH264EncryptCallbacks, which are faster to call */
   gboolean (*iv)(GstH264Encrypt *encrypt, uint8_t *iv, guint block_length);
 
-  gpointer padding[12];
+  /* Actions */
+  void (*set_callbacks)(GstH264Encrypt *encrypt,
+                        const GstH264EncryptCallbacks *callbacks,
+                        guint callbacks_size, gpointer user_data,
+                        GDestroyNotify notify);
+
+  gpointer padding[11];
 };
 
 // GstH264Encrypt *gst_h264_encrypt_new(void);
@@ -85,12 +93,67 @@ struct _GstH264Encrypt {
   GstH264EncryptionBase encryption_base;
 
   gboolean inserted_sei;
-  // randomness data
-  char iv_random_state_buf[128];
-  struct random_data iv_random_data;
+  // Slices of the buffer being encrypted. Until it is, those of the previous
+  // buffer, which the next one likely has as many of.
+  guint slice_count;
+  // Output is one NAL unit per buffer, so IV SEI are pushed on their own
+  gboolean nal_aligned;
+  // Buffer being transformed, whose metadata pushed IV SEI copy, and the
+  // result of pushing the last one
+  GstBuffer *input;
+  GstFlowReturn push_ret;
+  // Pictures that carry an IV SEI
+  GstH264IvMode iv_mode;
+  // Keyring entry to encrypt with from the next IV SEI on, set atomically
+  gint key_id;
+  // Per NAL unit state of in place encryption, reused between buffers
+  GArray *in_place_nals;
+  // Emulation prevention byte positions of in place encrypted slices
+  GArray *epb_positions;
+  // Slice parts of the access unit encrypted on several threads, and a
+  // GArray of emulation prevention byte positions for each of them
+  GArray *slice_tasks;
+  GPtrArray *slice_positions;
+  // IV generator: AES-CTR keystream of its own key, whose IVs are used from
+  // drbg_index on. The key changes with every refill.
+  struct AES_ctx drbg_ctx;
+  guint8 drbg_pool[GST_H264_ENCRYPT_DRBG_POOL_SIZE][AES_BLOCKLEN];
+  guint drbg_index;
+  guint drbg_refills;
+  gboolean drbg_seeded;
   guint iv_random_seed;
+  // IV provider, and IVs it gave ahead from iv_batch_index on. Callbacks are
+  // called without the lock, callbacks_calls counts the calls in progress and
+  // callbacks_generation changes with every provider.
+  GMutex callbacks_lock;
+  GCond callbacks_cond;
+  GstH264EncryptCallbacks callbacks;
+  gpointer callbacks_user_data;
+  GDestroyNotify callbacks_notify;
+  guint callbacks_calls;
+  guint callbacks_generation;
+  guint8 iv_batch[GST_H264_ENCRYPT_IV_BATCH_SIZE][AES_BLOCKLEN];
+  guint iv_batch_size;
+  guint iv_batch_index;
 };
 
+size_t gst_h264_encrypt_fill_iv_sei(uint8_t *target,
+                                    GstH264EncryptionCodec codec,
+                                    const guint8 *next_header,
+                                    guint start_code_prefix_length,
+                                    guint nal_length_size, const guint8 *iv,
+                                    guint8 flags, guint8 key_id);
+
+gboolean gst_h264_encrypt_select_key(GstH264Encrypt *h264encrypt);
+
+void gst_h264_encrypt_set_callbacks(GstH264Encrypt *h264encrypt,
+                                    const GstH264EncryptCallbacks *callbacks,
+                                    guint callbacks_size, gpointer user_data,
+                                    GDestroyNotify notify);
+
+gboolean gst_h264_encrypt_get_random_iv(GstH264Encrypt *h264encrypt,
+                                        uint8_t *iv, guint block_len);
+
 G_END_DECLS
 
 #endif /* __GST_H264ENCRYPT_H__ */
@@ -47,17 +47,143 @@
 #include "h264_encryption_mode.h"
 #include "h264_encryption_plugin.h"
 #include "h264_encryption_types.h"
+#include "h264_nal_parser_pool.h"
 
 GST_DEBUG_CATEGORY_STATIC(gst_h264_encryption_base_debug);
 #define GST_CAT_DEFAULT gst_h264_encryption_base_debug
 #define DEFAULT_ENCRYPTION_MODE GST_H264_ENCRYPTION_MODE_AES_CTR
+// Output buffers are aligned for SIMD loads/stores (32 bytes, AVX2)
+#define OUTPUT_BUFFER_ALIGN 31
+// Granularity of pooled output buffer size growth
+#define OUTPUT_BUFFER_SIZE_STEP 4096
+#define DEFAULT_SHARE_THRESHOLD 4096
+#define DEFAULT_COMPACT FALSE
+#define DEFAULT_IDLE_TIMEOUT 5000
+#define DEFAULT_THREADS 1
+#define MAX_THREADS 256
+// NAL unit length size of avc3/hev1 streams without codec_data
+#define DEFAULT_NAL_LENGTH_SIZE 4
 
 #define gst_h264_encryption_base_parent_class parent_class
 
+enum { SIGNAL_ADD_KEY, SIGNAL_REMOVE_KEY, SIGNAL_LAST };
+
 typedef struct _GstH264EncryptionBasePrivate GstH264EncryptionBasePrivate;
 struct _GstH264EncryptionBasePrivate {
   GstH264EncryptionUtils utils;
+  // Buffer size requested from the pool on the next allocation query
+  gsize output_buffer_size;
+  // Buffer size of the negotiated pool
+  gsize pool_buffer_size;
+  // Minimum size of non-slice NAL units shared with the input, 0 to copy all
+  guint share_threshold;
+  // GstH264EncryptionSharedRegion of the access unit being processed
+  GArray *shared_regions;
+  // GstH264EncryptionChunk for every memory of the input buffer
+  GArray *chunks;
+  // NAL units spanning input memories are gathered here
+  GByteArray *scratch;
+  // Compact mode leases a NAL parser for every access unit
+  gboolean compact;
+  guint64 parser_owner;
+  GstH264NalParserLease *parser_lease;
+  // GstH264EncryptionParameterSet the leased parsers are given
+  GArray *parameter_sets;
+  // Pooled output buffers are released after this many idle milliseconds
+  guint idle_timeout;
+  GstClockID idle_clock_id;
+  // Access units processed, and the count at the last idle check
+  gint activity;
+  gint checked_activity;
+  // Serializes pool use with its release from the clock thread
+  GMutex pool_lock;
+  // The output buffer pool was created here rather than by downstream, so
+  // releasing it while idle is up to this element. Under pool_lock.
+  gboolean owns_pool;
+  // Byte-stream input without alignment is framed into access units here
+  gboolean unaligned;
+  GstAdapter *adapter;
+  // Adapter offset the start code scan resumes from
+  gsize scan_offset;
+  // Whether the access unit being framed has a slice, and an IDR slice
+  gboolean framed_slice;
+  gboolean framed_idr;
+  // Timestamps of the last input buffer an access unit was stamped with, as
+  // only the first access unit starting in a buffer takes its timestamps
+  GstClockTime framed_pts;
+  GstClockTime framed_dts;
+  // Flow of the access unit pushed before new caps, for the next input
+  GstFlowReturn drain_ret;
+  // Output of the buffer list being processed, NULL outside of one. The
+  // leased parser is kept for the whole list.
+  GstBufferList *output_list;
+  // The next output of a buffer list is marked DISCONT, as GstBaseTransform
+  // chain does after dropped or DISCONT input buffers
+  gboolean list_discont;
+  // Mode property and GstH264EncryptionKeyringEntry of the keys, the key
+  // property as key ID 0, guarded by the object lock
+  GstH264EncryptionMode encryption_mode;
+  GArray *keyring;
+  // GstH264EncryptionConfig of the last key, mode or keyring change, until
+  // the streaming thread takes it. Swapped atomically, without locks.
+  gpointer pending_config;
+  // Config taken by the streaming thread, whose keyring keys are selected from
+  GstH264EncryptionConfig *config;
+  // Threads slices are encrypted or decrypted with, 0 for one per processor.
+  // Workers other than the streaming thread come from task_pool, created on
+  // first use.
+  guint threads;
+  GThreadPool *task_pool;
+  // GstH264EncryptionCipherTask of the access unit, run at its end
+  GArray *cipher_tasks;
 };
+
+/**
+ * Blocks decrypted at the end of the access unit by
+ * gst_h264_encryption_base_decrypt_blocks, with the cipher state they start
+ * from.
+ */
+typedef struct GstH264EncryptionCipherTask {
+  struct AES_ctx ctx;
+  GstH264EncryptionMode encryption_mode;
+  guint8 *data;
+  gsize size;
+} GstH264EncryptionCipherTask;
+
+/**
+ * Tasks of one gst_h264_encryption_base_run_tasks call. Threads take the
+ * next task until none is left, and workers count down running when done.
+ */
+typedef struct GstH264EncryptionTaskSet {
+  GstH264EncryptionTaskFunc func;
+  guint8 *tasks;
+  guint n_tasks;
+  gsize task_size;
+  gpointer user_data;
+  gint next_task;
+  guint running;
+  GMutex lock;
+  GCond done;
+} GstH264EncryptionTaskSet;
+
+/**
+ * SPS or PPS last seen with its id, kept as the NAL unit after a 4 byte start
+ * code whatever the stream format.
+ */
+typedef struct GstH264EncryptionParameterSet {
+  guint8 type;
+  guint id;
+  GBytes *nal;
+} GstH264EncryptionParameterSet;
+
+/**
+ * Input bytes that are not copied but shared into the output at dest_offset.
+ */
+typedef struct GstH264EncryptionSharedRegion {
+  gsize dest_offset;
+  gsize offset;
+  gsize size;
+} GstH264EncryptionSharedRegion;
 G_DEFINE_TYPE_WITH_PRIVATE(GstH264EncryptionBase, gst_h264_encryption_base,
                            GST_TYPE_BASE_TRANSFORM);
 GST_ELEMENT_REGISTER_DEFINE(h264encryptionbase, "h264encryptionbase",
@@ -70,12 +196,62 @@ static void gst_h264_encryption_base_set_property(GObject *object,
 static void gst_h264_encryption_base_get_property(GObject *object,
                                                   guint prop_id, GValue *value,
                                                   GParamSpec *pspec);
+static void gst_h264_encryption_base_constructed(GObject *object);
 static void gst_h264_encryption_base_dispose(GObject *object);
 static void gst_h264_encryption_base_finalize(GObject *object);
 
+static gboolean gst_h264_encryption_base_decide_allocation(
+    GstBaseTransform *trans, GstQuery *query);
 static GstFlowReturn gst_h264_encryption_base_transform(GstBaseTransform *base,
                                                         GstBuffer *inbuf,
                                                         GstBuffer *outbuf);
+static GstFlowReturn gst_h264_encryption_base_transform_ip(
+    GstBaseTransform *base, GstBuffer *buf);
+static void gst_h264_encryption_base_unmap_chunks(
+    GstH264EncryptionBase *h264encryptionbase);
+static gboolean gst_h264_encryption_base_start(GstBaseTransform *trans);
+static gboolean gst_h264_encryption_base_stop(GstBaseTransform *trans);
+static gboolean gst_h264_encryption_base_set_caps(GstBaseTransform *trans,
+                                                  GstCaps *incaps,
+                                                  GstCaps *outcaps);
+static GstCaps *gst_h264_encryption_base_transform_caps(
+    GstBaseTransform *trans, GstPadDirection direction, GstCaps *caps,
+    GstCaps *filter);
+static gboolean gst_h264_encryption_base_sink_event(GstBaseTransform *trans,
+                                                    GstEvent *event);
+static GstFlowReturn gst_h264_encryption_base_submit_input_buffer(
+    GstBaseTransform *trans, gboolean is_discont, GstBuffer *input);
+static GstFlowReturn gst_h264_encryption_base_generate_output(
+    GstBaseTransform *trans, GstBuffer **outbuf);
+static void gst_h264_encryption_base_lease_parser(
+    GstH264EncryptionBase *h264encryptionbase);
+static void gst_h264_encryption_base_release_parser(
+    GstH264EncryptionBase *h264encryptionbase);
+static void gst_h264_encryption_base_record_parameter_set(
+    GstH264EncryptionBase *h264encryptionbase, const GstH264NalUnit *nalu);
+static void gst_h264_encryption_base_replay_parameter_sets(
+    GstH264EncryptionBase *h264encryptionbase, GstH264NalParser *parser);
+static guint64 gst_h264_encryption_base_get_memory_footprint(
+    GstH264EncryptionBase *h264encryptionbase);
+static void gst_h264_encryption_base_reset_framing(
+    GstH264EncryptionBase *h264encryptionbase);
+static void gst_h264_encryption_base_reset_gop(
+    GstH264EncryptionBase *h264encryptionbase);
+static void gst_h264_encryption_base_free_config(
+    GstH264EncryptionConfig *config);
+static void gst_h264_encryption_base_publish_config(
+    GstH264EncryptionBase *encryption_base);
+static void gst_h264_encryption_base_take_config(
+    GstH264EncryptionBase *encryption_base);
+static gboolean gst_h264_encryption_base_add_key(
+    GstH264EncryptionBase *encryption_base, guint key_id,
+    GstEncryptionKey *key);
+static gboolean gst_h264_encryption_base_remove_key(
+    GstH264EncryptionBase *encryption_base, guint key_id);
+static GstFlowReturn gst_h264_encryption_base_chain_list(GstPad *pad,
+                                                         GstObject *parent,
+                                                         GstBufferList *list);
+static guint gst_h264_encryption_base_signals[SIGNAL_LAST] = {0};
 
 /* GObject vmethod implementations */
 
@@ -90,12 +266,16 @@ static void gst_h264_encryption_base_class_init(
 
   gobject_class->set_property = gst_h264_encryption_base_set_property;
   gobject_class->get_property = gst_h264_encryption_base_get_property;
+  gobject_class->constructed = gst_h264_encryption_base_constructed;
   gobject_class->dispose = gst_h264_encryption_base_dispose;
   gobject_class->finalize = gst_h264_encryption_base_finalize;
 
   klass->enter_base_transform = NULL;
   klass->before_nalu_copy = NULL;
   klass->process_slice_nalu = NULL;
+  klass->codec = GST_H264_ENCRYPTION_CODEC_H264;
+  klass->add_key = gst_h264_encryption_base_add_key;
+  klass->remove_key = gst_h264_encryption_base_remove_key;
 
   gst_element_class_set_details_simple(
       gstelement_class, "h264encryptionbase", "Codec/Encryption/Video",
@@ -104,20 +284,104 @@ static void gst_h264_encryption_base_class_init(
   g_object_class_install_property(
       gobject_class, PROP_ENCRYPTION_MODE,
       g_param_spec_enum("encryption-mode", "Encryption Mode",
-                        "Mode of encryption to perform",
+                        "Mode of encryption to perform. Changes apply from "
+                        "the next access unit on.",
                         GST_TYPE_H264_ENCRYPTION_MODE, DEFAULT_ENCRYPTION_MODE,
                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
-                            GST_PARAM_MUTABLE_PAUSED));
+                            GST_PARAM_MUTABLE_PLAYING));
   g_object_class_install_property(
       gobject_class, PROP_KEY,
       g_param_spec_boxed("key", "Encryption Key",
-                         G_STRINGIFY(AES_KEYLEN * 8) " bit encryption key",
+                         G_STRINGIFY(AES_KEYLEN * 8) " bit encryption key. "
+                         "Changes apply from the next access unit on.",
                          GST_TYPE_ENCRYPTION_KEY,
-                         G_PARAM_WRITABLE | GST_PARAM_MUTABLE_PAUSED |
+                         G_PARAM_WRITABLE | GST_PARAM_MUTABLE_PLAYING |
                              G_PARAM_STATIC_STRINGS));
 
+  /**
+   * Adds a key to the keyring under a key ID up to 255, or replaces the key
+   * of the ID, 0 being the key property. The key is expanded in the calling
+   * thread, so adding it ahead of the IV SEI that names it does not stall
+   * the stream.
+   */
+  gst_h264_encryption_base_signals[SIGNAL_ADD_KEY] = g_signal_new(
+      "add-key", G_TYPE_FROM_CLASS(klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET(GstH264EncryptionBaseClass, add_key), NULL, NULL, NULL,
+      G_TYPE_BOOLEAN, 2, G_TYPE_UINT, GST_TYPE_ENCRYPTION_KEY);
+  gst_h264_encryption_base_signals[SIGNAL_REMOVE_KEY] = g_signal_new(
+      "remove-key", G_TYPE_FROM_CLASS(klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET(GstH264EncryptionBaseClass, remove_key), NULL, NULL,
+      NULL, G_TYPE_BOOLEAN, 1, G_TYPE_UINT);
+  g_object_class_install_property(
+      gobject_class, PROP_SHARE_THRESHOLD,
+      g_param_spec_uint(
+          "share-threshold", "Share threshold",
+          "Non-slice NAL units of at least this many bytes are shared with "
+          "the input buffer instead of being copied, 0 to always copy. Output "
+          "buffers with shared memory are not reused by the buffer pool.",
+          0, G_MAXUINT, DEFAULT_SHARE_THRESHOLD,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property(
+      gobject_class, PROP_COMPACT,
+      g_param_spec_boolean(
+          "compact", "Compact",
+          "Reduce the memory of the element for running many instances: NAL "
+          "parsers are shared between instances, only active parameter sets "
+          "are kept and pooled output buffers are released when idle",
+          DEFAULT_COMPACT,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property(
+      gobject_class, PROP_IDLE_TIMEOUT,
+      g_param_spec_uint("idle-timeout", "Idle timeout",
+                        "Milliseconds without buffers after which pooled "
+                        "output buffers are released in compact mode, 0 to "
+                        "keep them",
+                        0, G_MAXUINT, DEFAULT_IDLE_TIMEOUT,
+                        G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+                            G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property(
+      gobject_class, PROP_MEMORY_FOOTPRINT,
+      g_param_spec_uint64(
+          "memory-footprint", "Memory footprint",
+          "Estimated bytes held by the element alone: instance, own NAL "
+          "parser, parameter sets, work buffers and minimum pooled output "
+          "buffers. Pooled parsers and shared key schedules are left out",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property(
+      gobject_class, PROP_THREADS,
+      g_param_spec_uint(
+          "threads", "Threads",
+          "Threads to encrypt or decrypt the slices of an access unit with, "
+          "0 for one per processor. Above 1, h264encrypt gives every slice "
+          "its own IV.",
+          0, MAX_THREADS, DEFAULT_THREADS,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+              G_PARAM_STATIC_STRINGS));
+
+  GST_BASE_TRANSFORM_CLASS(klass)->start =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_start);
+  GST_BASE_TRANSFORM_CLASS(klass)->stop =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_stop);
+  GST_BASE_TRANSFORM_CLASS(klass)->set_caps =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_set_caps);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform_caps =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_transform_caps);
+  GST_BASE_TRANSFORM_CLASS(klass)->sink_event =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_sink_event);
+  GST_BASE_TRANSFORM_CLASS(klass)->submit_input_buffer =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_submit_input_buffer);
+  GST_BASE_TRANSFORM_CLASS(klass)->generate_output =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_generate_output);
+  GST_BASE_TRANSFORM_CLASS(klass)->decide_allocation =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_decide_allocation);
   GST_BASE_TRANSFORM_CLASS(klass)->transform =
       GST_DEBUG_FUNCPTR(gst_h264_encryption_base_transform);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform_ip =
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_transform_ip);
 
   GST_DEBUG_CATEGORY_INIT(gst_h264_encryption_base_debug, "h264encryptionbase",
                           0, "h264encryptionbase general logs");
@@ -132,9 +396,80 @@ static void gst_h264_encryption_base_init(
     GstH264EncryptionBase *h264encryptionbase) {
   GstH264EncryptionBasePrivate *priv =
       gst_h264_encryption_base_get_instance_private(h264encryptionbase);
-  priv->utils.nalparser = gst_h264_nal_parser_new();
+  // The parser of the codec is created once the class of the instance is set
+  priv->utils.codec = GST_H264_ENCRYPTION_CODEC_H264;
+  priv->utils.nalparser = NULL;
+  priv->utils.h265parser = NULL;
   priv->utils.encryption_mode = DEFAULT_ENCRYPTION_MODE;
-  priv->utils.key = NULL;
+  priv->utils.key_id = 0;
+  priv->utils.keyed = FALSE;
+  priv->utils.nal_table =
+      g_array_sized_new(FALSE, FALSE, sizeof(GstH264EncryptionNalEntry), 16);
+  priv->utils.nal_length_size = 0;
+  priv->utils.slice_iv = FALSE;
+  priv->utils.pts = GST_CLOCK_TIME_NONE;
+  priv->utils.gop_flags = 0;
+  priv->utils.gop_pts = GST_CLOCK_TIME_NONE;
+  priv->utils.gop_frame = 0;
+  priv->utils.gop_lost = FALSE;
+  priv->output_buffer_size = 0;
+  priv->pool_buffer_size = 0;
+  priv->share_threshold = DEFAULT_SHARE_THRESHOLD;
+  priv->shared_regions =
+      g_array_new(FALSE, FALSE, sizeof(GstH264EncryptionSharedRegion));
+  priv->chunks = g_array_new(FALSE, FALSE, sizeof(GstH264EncryptionChunk));
+  priv->scratch = g_byte_array_new();
+  priv->compact = DEFAULT_COMPACT;
+  priv->parser_owner = gst_h264_nal_parser_pool_new_owner();
+  priv->parser_lease = NULL;
+  priv->parameter_sets =
+      g_array_new(FALSE, FALSE, sizeof(GstH264EncryptionParameterSet));
+  priv->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  priv->idle_clock_id = NULL;
+  priv->activity = 0;
+  priv->checked_activity = 0;
+  g_mutex_init(&priv->pool_lock);
+  priv->owns_pool = FALSE;
+  priv->unaligned = FALSE;
+  priv->adapter = gst_adapter_new();
+  priv->scan_offset = 0;
+  priv->framed_slice = FALSE;
+  priv->framed_idr = FALSE;
+  priv->framed_pts = GST_CLOCK_TIME_NONE;
+  priv->framed_dts = GST_CLOCK_TIME_NONE;
+  priv->drain_ret = GST_FLOW_OK;
+  priv->output_list = NULL;
+  priv->list_discont = FALSE;
+  priv->encryption_mode = DEFAULT_ENCRYPTION_MODE;
+  priv->keyring =
+      g_array_new(FALSE, FALSE, sizeof(GstH264EncryptionKeyringEntry));
+  priv->pending_config = NULL;
+  priv->config = NULL;
+  priv->threads = DEFAULT_THREADS;
+  priv->task_pool = NULL;
+  priv->cipher_tasks =
+      g_array_new(FALSE, FALSE, sizeof(GstH264EncryptionCipherTask));
+}
+
+/**
+ * Creates the parser of the codec of the subclass. Instance init functions of
+ * parent types see their own class, so it cannot be done at init.
+ */
+static void gst_h264_encryption_base_constructed(GObject *object) {
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(object);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  G_OBJECT_CLASS(parent_class)->constructed(object);
+  priv->utils.codec =
+      GST_H264_ENCRYPTION_BASE_GET_CLASS(h264encryptionbase)->codec;
+  if (priv->utils.codec == GST_H264_ENCRYPTION_CODEC_H265) {
+    priv->utils.h265parser = gst_h265_parser_new();
+  } else {
+    priv->utils.nalparser = gst_h264_nal_parser_new();
+  }
+  gst_pad_set_chain_list_function(
+      GST_BASE_TRANSFORM_SINK_PAD(object),
+      GST_DEBUG_FUNCPTR(gst_h264_encryption_base_chain_list));
 }
 
 static void gst_h264_encryption_base_dispose(GObject *object) {
@@ -145,10 +480,45 @@ static void gst_h264_encryption_base_finalize(GObject *object) {
   GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(object);
   GstH264EncryptionBasePrivate *priv =
       gst_h264_encryption_base_get_instance_private(h264encryptionbase);
-  gst_h264_nal_parser_free(priv->utils.nalparser);
+  // Compact instances do not own a parser
+  if (priv->utils.nalparser) gst_h264_nal_parser_free(priv->utils.nalparser);
   priv->utils.nalparser = NULL;
-  if (priv->utils.key) g_boxed_free(GST_TYPE_ENCRYPTION_KEY, priv->utils.key);
-  priv->utils.key = NULL;
+  if (priv->utils.h265parser) gst_h265_parser_free(priv->utils.h265parser);
+  priv->utils.h265parser = NULL;
+  for (guint i = 0; i < priv->keyring->len; i++) {
+    gst_h264_key_schedule_unref(
+        g_array_index(priv->keyring, GstH264EncryptionKeyringEntry, i)
+            .schedule);
+  }
+  g_array_free(priv->keyring, TRUE);
+  priv->keyring = NULL;
+  gst_h264_encryption_base_free_config(priv->pending_config);
+  priv->pending_config = NULL;
+  gst_h264_encryption_base_free_config(priv->config);
+  priv->config = NULL;
+  memset(&priv->utils.ctx, 0, sizeof(priv->utils.ctx));
+  g_array_free(priv->utils.nal_table, TRUE);
+  priv->utils.nal_table = NULL;
+  g_array_free(priv->shared_regions, TRUE);
+  priv->shared_regions = NULL;
+  g_array_free(priv->chunks, TRUE);
+  priv->chunks = NULL;
+  g_byte_array_free(priv->scratch, TRUE);
+  priv->scratch = NULL;
+  for (guint i = 0; i < priv->parameter_sets->len; i++) {
+    g_bytes_unref(g_array_index(priv->parameter_sets,
+                                GstH264EncryptionParameterSet, i)
+                      .nal);
+  }
+  g_array_free(priv->parameter_sets, TRUE);
+  priv->parameter_sets = NULL;
+  g_mutex_clear(&priv->pool_lock);
+  g_object_unref(priv->adapter);
+  priv->adapter = NULL;
+  if (priv->task_pool) g_thread_pool_free(priv->task_pool, FALSE, TRUE);
+  priv->task_pool = NULL;
+  g_array_free(priv->cipher_tasks, TRUE);
+  priv->cipher_tasks = NULL;
   G_OBJECT_CLASS(parent_class)->finalize(object);
 }
 
@@ -162,13 +532,42 @@ static void gst_h264_encryption_base_set_property(GObject *object,
 
   switch (prop_id) {
     case PROP_ENCRYPTION_MODE:
-      priv->utils.encryption_mode = g_value_get_enum(value);
+      GST_OBJECT_LOCK(h264encryptionbase);
+      priv->encryption_mode = g_value_get_enum(value);
+      gst_h264_encryption_base_publish_config(h264encryptionbase);
+      GST_OBJECT_UNLOCK(h264encryptionbase);
+      break;
+    case PROP_KEY: {
+      GstEncryptionKey *key = g_value_get_boxed(value);
+      if (key) {
+        gst_h264_encryption_base_add_key(h264encryptionbase, 0, key);
+      } else {
+        gst_h264_encryption_base_remove_key(h264encryptionbase, 0);
+      }
+      break;
+    }
+    case PROP_SHARE_THRESHOLD:
+      priv->share_threshold = g_value_get_uint(value);
       break;
-    case PROP_KEY:
-      if (priv->utils.key) {
-        g_boxed_free(GST_TYPE_ENCRYPTION_KEY, priv->utils.key);
+    case PROP_COMPACT:
+      priv->compact = g_value_get_boolean(value);
+      if (priv->utils.codec != GST_H264_ENCRYPTION_CODEC_H264) {
+        // Only H.264 parsers are pooled, others stay with their instance
+        break;
+      } else if (priv->compact && priv->utils.nalparser) {
+        gst_h264_nal_parser_free(priv->utils.nalparser);
+        priv->utils.nalparser = NULL;
+      } else if (!priv->compact && !priv->utils.nalparser) {
+        priv->utils.nalparser = gst_h264_nal_parser_new();
+        gst_h264_encryption_base_replay_parameter_sets(h264encryptionbase,
+                                                       priv->utils.nalparser);
       }
-      priv->utils.key = g_value_dup_boxed(value);
+      break;
+    case PROP_IDLE_TIMEOUT:
+      priv->idle_timeout = g_value_get_uint(value);
+      break;
+    case PROP_THREADS:
+      priv->threads = g_value_get_uint(value);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
@@ -185,7 +584,25 @@ static void gst_h264_encryption_base_get_property(GObject *object,
 
   switch (prop_id) {
     case PROP_ENCRYPTION_MODE:
-      g_value_set_enum(value, priv->utils.encryption_mode);
+      GST_OBJECT_LOCK(h264encryptionbase);
+      g_value_set_enum(value, priv->encryption_mode);
+      GST_OBJECT_UNLOCK(h264encryptionbase);
+      break;
+    case PROP_SHARE_THRESHOLD:
+      g_value_set_uint(value, priv->share_threshold);
+      break;
+    case PROP_COMPACT:
+      g_value_set_boolean(value, priv->compact);
+      break;
+    case PROP_IDLE_TIMEOUT:
+      g_value_set_uint(value, priv->idle_timeout);
+      break;
+    case PROP_THREADS:
+      g_value_set_uint(value, priv->threads);
+      break;
+    case PROP_MEMORY_FOOTPRINT:
+      g_value_set_uint64(value, gst_h264_encryption_base_get_memory_footprint(
+                                    h264encryptionbase));
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
@@ -195,168 +612,2130 @@ static void gst_h264_encryption_base_get_property(GObject *object,
 
 /* GstBaseTransform vmethod implementations */
 
-size_t _copy_memory_bytes(GstMapInfo *dest_map_info, GstMapInfo *src_map_info,
-                          size_t *dest_offset, size_t src_offset, size_t size) {
-  if (dest_map_info->maxsize < *dest_offset + size) {
-    GST_ERROR("Unable to copy as destination is too small");
-    return 0;
+/**
+ * Releases the pooled output buffers if no access unit was processed since
+ * the previous check. Runs in the clock thread. Pools of downstream are
+ * shared with others, so they are left alone.
+ */
+static gboolean gst_h264_encryption_base_idle_check(GstClock *clock,
+                                                    GstClockTime time,
+                                                    GstClockID id,
+                                                    gpointer user_data) {
+  GstH264EncryptionBase *h264encryptionbase = user_data;
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  gint activity = g_atomic_int_get(&priv->activity);
+  if (activity != priv->checked_activity) {
+    priv->checked_activity = activity;
+    return TRUE;
   }
-  memcpy(&dest_map_info->data[*dest_offset], &src_map_info->data[src_offset],
-         size);
-  *dest_offset += size;
-  return size;
+  GstBufferPool *pool =
+      gst_base_transform_get_buffer_pool(GST_BASE_TRANSFORM(user_data));
+  if (pool == NULL) {
+    return TRUE;
+  }
+  g_mutex_lock(&priv->pool_lock);
+  if (priv->owns_pool && gst_buffer_pool_is_active(pool)) {
+    GST_DEBUG_OBJECT(h264encryptionbase,
+                     "Idle, releasing pooled output buffers");
+    gst_buffer_pool_set_active(pool, FALSE);
+  }
+  g_mutex_unlock(&priv->pool_lock);
+  gst_object_unref(pool);
+  return TRUE;
 }
 
-size_t _copy_nalu_bytes(GstMapInfo *dest_map_info, GstH264NalUnit *nalu,
-                        size_t *dest_offset) {
-  size_t nalu_total_size = nalu->size + (nalu->offset - nalu->sc_offset);
-  if (dest_map_info->maxsize < *dest_offset + nalu_total_size) {
-    GST_ERROR("Unable to copy as destination is too small");
-    return 0;
+static gboolean gst_h264_encryption_base_start(GstBaseTransform *trans) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(
+          GST_H264_ENCRYPTION_BASE(trans));
+  if (priv->compact && priv->idle_timeout > 0) {
+    GstClock *clock = gst_system_clock_obtain();
+    GstClockTime interval = priv->idle_timeout * GST_MSECOND;
+    priv->idle_clock_id = gst_clock_new_periodic_id(
+        clock, gst_clock_get_time(clock) + interval, interval);
+    gst_clock_id_wait_async(priv->idle_clock_id,
+                            gst_h264_encryption_base_idle_check,
+                            gst_object_ref(trans), gst_object_unref);
+    gst_object_unref(clock);
   }
-  memcpy(&dest_map_info->data[*dest_offset], &nalu->data[nalu->sc_offset],
-         nalu_total_size);
-  *dest_offset += nalu_total_size;
-  return nalu_total_size;
+  return TRUE;
 }
 
-static GstFlowReturn gst_h264_encryption_base_transform(GstBaseTransform *base,
-                                                        GstBuffer *inbuf,
-                                                        GstBuffer *outbuf) {
-  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(base);
-  GstH264NalUnit nalu;
-  GstH264ParserResult result;
-  struct AES_ctx *ctx;
-  GstMapInfo map_info, dest_map_info;
+static gboolean gst_h264_encryption_base_stop(GstBaseTransform *trans) {
   GstH264EncryptionBasePrivate *priv =
-      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
-  ctx = &priv->utils.ctx;
+      gst_h264_encryption_base_get_instance_private(
+          GST_H264_ENCRYPTION_BASE(trans));
+  if (priv->idle_clock_id != NULL) {
+    gst_clock_id_unschedule(priv->idle_clock_id);
+    gst_clock_id_unref(priv->idle_clock_id);
+    priv->idle_clock_id = NULL;
+  }
+  // Workers are idle outside of access units, and the thread count may
+  // change until the next start
+  if (priv->task_pool != NULL) {
+    g_thread_pool_free(priv->task_pool, FALSE, TRUE);
+    priv->task_pool = NULL;
+  }
+  gst_h264_encryption_base_reset_framing(GST_H264_ENCRYPTION_BASE(trans));
+  gst_h264_encryption_base_reset_gop(GST_H264_ENCRYPTION_BASE(trans));
+  return TRUE;
+}
 
-  GST_DEBUG_OBJECT(h264encryptionbase, "A buffer is received");
-  if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_TIMESTAMP(inbuf)))
-    gst_object_sync_values(GST_OBJECT(h264encryptionbase),
-                           GST_BUFFER_TIMESTAMP(inbuf));
-  if (G_UNLIKELY(!gst_buffer_map(inbuf, &map_info, GST_MAP_READ))) {
-    GST_ERROR_OBJECT(base, "Unable to map input buffer for read!");
-    return GST_FLOW_ERROR;
+/**
+ * Reads the NAL unit length size and the parameter sets of an avc/avc3
+ * decoder configuration record.
+ */
+static gboolean gst_h264_encryption_base_parse_avc_config(
+    GstH264EncryptionBase *h264encryptionbase, const guint8 *data,
+    gsize size) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstH264DecoderConfigRecord *config = NULL;
+  if (gst_h264_parser_parse_decoder_config_record(
+          priv->utils.nalparser, data, size, &config) != GST_H264_PARSER_OK) {
+    return FALSE;
   }
-  if (G_UNLIKELY(!gst_buffer_map(outbuf, &dest_map_info, GST_MAP_READWRITE))) {
-    GST_ERROR_OBJECT(base, "Unable to map output buffer for rw!");
-    return GST_FLOW_ERROR;
+  priv->utils.nal_length_size = config->length_size_minus_one + 1;
+  // Slice headers of avc streams refer to parameter sets only found here
+  GArray *parameter_sets[] = {config->sps, config->pps};
+  for (guint p = 0; p < G_N_ELEMENTS(parameter_sets); p++) {
+    for (guint i = 0; i < parameter_sets[p]->len; i++) {
+      GstH264NalUnit *nalu =
+          &g_array_index(parameter_sets[p], GstH264NalUnit, i);
+      gst_h264_parser_parse_nal(priv->utils.nalparser, nalu);
+      if (priv->compact) {
+        gst_h264_encryption_base_record_parameter_set(h264encryptionbase,
+                                                      nalu);
+      }
+    }
   }
-  // Init context with key (iv is later if needed)
-  if (G_UNLIKELY(!priv->utils.key)) {
-    GST_ERROR_OBJECT(base, "Key is not set!");
-    goto error;
+  gst_h264_decoder_config_record_free(config);
+  return TRUE;
+}
+
+/**
+ * Same as gst_h264_encryption_base_parse_avc_config for hvc1/hev1 decoder
+ * configuration records, whose parameter sets come in arrays of VPS, SPS and
+ * PPS.
+ */
+static gboolean gst_h264_encryption_base_parse_hevc_config(
+    GstH264EncryptionBase *h264encryptionbase, const guint8 *data,
+    gsize size) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstH265DecoderConfigRecord *config = NULL;
+  if (gst_h265_parser_parse_decoder_config_record(
+          priv->utils.h265parser, data, size, &config) != GST_H265_PARSER_OK) {
+    return FALSE;
   }
-  AES_init_ctx(ctx, priv->utils.key->bytes);
-  size_t dest_offset = 0;
-  result = gst_h264_parser_identify_nalu(priv->utils.nalparser, map_info.data,
-                                         0, map_info.size, &nalu);
-  GST_H264_ENCRYPTION_BASE_GET_CLASS(h264encryptionbase)
-      ->enter_base_transform(h264encryptionbase);
-  while (result == GST_H264_PARSER_OK || result == GST_H264_PARSER_NO_NAL_END) {
-    // Processes the following NALU types:
-    // GST_H264_NAL_SLICE        = 1,
-    // GST_H264_NAL_SLICE_DPA    = 2,
-    // GST_H264_NAL_SLICE_DPB    = 3,
-    // GST_H264_NAL_SLICE_DPC    = 4,
-    // GST_H264_NAL_SLICE_IDR    = 5,
-    // Need to populate SPS/PPS of nalparser for parsing slice header later
-    gst_h264_parser_parse_nal(priv->utils.nalparser, &nalu);
-    gboolean copy;
-    if (!GST_H264_ENCRYPTION_BASE_GET_CLASS(h264encryptionbase)
-             ->before_nalu_copy(h264encryptionbase, &nalu, &dest_map_info,
-                                &dest_offset, &copy)) {
-      goto error;
+  priv->utils.nal_length_size = config->length_size_minus_one + 1;
+  for (guint a = 0; a < config->nalu_array->len; a++) {
+    GstH265DecoderConfigRecordNalUnitArray *array = &g_array_index(
+        config->nalu_array, GstH265DecoderConfigRecordNalUnitArray, a);
+    for (guint i = 0; i < array->nalu->len; i++) {
+      gst_h265_parser_parse_nal(
+          priv->utils.h265parser,
+          &g_array_index(array->nalu, GstH265NalUnit, i));
     }
-    if (G_LIKELY(copy)) {
-      if (IS_SLICE_NALU(nalu.type)) {
-        // Copy the slice into dest
-        size_t nalu_total_size;
-        if ((nalu_total_size =
-                 _copy_nalu_bytes(&dest_map_info, &nalu, &dest_offset)) == 0) {
-          goto error;
-        }
-        // Process dest nalu
-        GstH264NalUnit dest_nalu;  // NOTE Maybe we can modify nalu instead of
-                                   // parsing another one
-        GstH264ParserResult parse_result = gst_h264_parser_identify_nalu(
-            priv->utils.nalparser, dest_map_info.data,
-            dest_offset - nalu_total_size, dest_offset, &dest_nalu);
-        GST_DEBUG_OBJECT(
-            h264encryptionbase,
-            "Source nal unit is copied. Type %d sc_offset %d total_size "
-            "%d",
-            nalu.type, nalu.sc_offset,
-            nalu.size + (nalu.offset - nalu.sc_offset));
-        GST_DEBUG_OBJECT(
-            h264encryptionbase,
-            "Copied nal unit is parsed. Type %d sc_offset %d "
-            "total_size %d expected size %ld",
-            dest_nalu.type, dest_nalu.sc_offset,
-            dest_nalu.size + (dest_nalu.offset - dest_nalu.sc_offset),
-            nalu_total_size);
-        if (parse_result != GST_H264_PARSER_NO_NAL_END &&
-            parse_result != GST_H264_PARSER_OK) {
-          GST_ERROR_OBJECT(h264encryptionbase,
-                           "Unable to parse destination nal unit");
-          goto error;
-        }
-        if (!GST_H264_ENCRYPTION_BASE_GET_CLASS(h264encryptionbase)
-                 ->process_slice_nalu(h264encryptionbase, &dest_nalu,
-                                      &dest_map_info, &dest_offset)) {
-          GST_ERROR_OBJECT(h264encryptionbase,
-                           "Subclass failed to parse slice nalu");
-          goto error;
-        }
-      } else {
-        // Copy non-slice nal unit
-        size_t nalu_total_size = nalu.size + (nalu.offset - nalu.sc_offset);
-        if (_copy_memory_bytes(&dest_map_info, &map_info, &dest_offset,
-                               nalu.sc_offset, nalu_total_size) == 0) {
-          goto error;
+  }
+  gst_h265_decoder_config_record_free(config);
+  return TRUE;
+}
+
+/**
+ * Reads the NAL unit length size and the parameter sets of avc/avc3 and
+ * hvc1/hev1 streams from codec_data, which avc3/hev1 may go without as
+ * their parameter sets are in band. Output caps are the input ones, so
+ * codec_data stays valid as parameter sets are never encrypted. Byte-stream
+ * input without alignment is framed into access units by the element.
+ */
+static gboolean gst_h264_encryption_base_set_caps(GstBaseTransform *trans,
+                                                  GstCaps *incaps,
+                                                  GstCaps *outcaps) {
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(trans);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstStructure *structure = gst_caps_get_structure(incaps, 0);
+  const gchar *stream_format =
+      gst_structure_get_string(structure, "stream-format");
+  const GValue *codec_data_value;
+  GstMapInfo map_info;
+  gboolean parsed;
+
+  gst_h264_encryption_base_reset_gop(h264encryptionbase);
+  priv->utils.nal_length_size = 0;
+  if (!gst_structure_has_name(structure,
+                              _codec_caps_name(priv->utils.codec))) {
+    // Packetized by the subclass, such as RTP
+    priv->unaligned = FALSE;
+    return TRUE;
+  }
+  if (stream_format == NULL || g_str_equal(stream_format, "byte-stream")) {
+    const gchar *alignment = gst_structure_get_string(structure, "alignment");
+    priv->unaligned = alignment == NULL || g_str_equal(alignment, "none");
+    GST_DEBUG_OBJECT(trans, "Byte-stream input is %s",
+                     priv->unaligned ? "framed into access units" : "aligned");
+    return TRUE;
+  }
+  priv->unaligned = FALSE;
+  codec_data_value = gst_structure_get_value(structure, "codec_data");
+  if (codec_data_value == NULL &&
+      (g_str_equal(stream_format, "avc3") ||
+       g_str_equal(stream_format, "hev1"))) {
+    // Parameter sets are in band, only the length size is unknown and it is
+    // 4 bytes in practice
+    priv->utils.nal_length_size = DEFAULT_NAL_LENGTH_SIZE;
+    GST_DEBUG_OBJECT(trans,
+                     "Stream format %s without codec_data, assuming %u byte "
+                     "NAL unit lengths",
+                     stream_format, priv->utils.nal_length_size);
+    return TRUE;
+  }
+  if (G_UNLIKELY(codec_data_value == NULL)) {
+    GST_ERROR_OBJECT(trans, "Stream format %s needs codec_data",
+                     stream_format);
+    return FALSE;
+  }
+  GstBuffer *codec_data = gst_value_get_buffer(codec_data_value);
+  if (G_UNLIKELY(!gst_buffer_map(codec_data, &map_info, GST_MAP_READ))) {
+    GST_ERROR_OBJECT(trans, "Unable to map codec_data for read!");
+    return FALSE;
+  }
+  gst_h264_encryption_base_lease_parser(h264encryptionbase);
+  if (priv->utils.codec == GST_H264_ENCRYPTION_CODEC_H265) {
+    parsed = gst_h264_encryption_base_parse_hevc_config(
+        h264encryptionbase, map_info.data, map_info.size);
+  } else {
+    parsed = gst_h264_encryption_base_parse_avc_config(
+        h264encryptionbase, map_info.data, map_info.size);
+  }
+  gst_h264_encryption_base_release_parser(h264encryptionbase);
+  gst_buffer_unmap(codec_data, &map_info);
+  if (!parsed) {
+    GST_ERROR_OBJECT(trans, "Unable to parse codec_data!");
+    return FALSE;
+  }
+  GST_DEBUG_OBJECT(trans, "Stream format %s with %u byte NAL unit lengths",
+                   stream_format, priv->utils.nal_length_size);
+  return TRUE;
+}
+
+/**
+ * Byte-stream without alignment is accepted for access unit aligned output.
+ */
+static GstCaps *gst_h264_encryption_base_transform_caps(
+    GstBaseTransform *trans, GstPadDirection direction, GstCaps *caps,
+    GstCaps *filter) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(
+          GST_H264_ENCRYPTION_BASE(trans));
+  const gchar *caps_name = _codec_caps_name(priv->utils.codec);
+  GstCaps *res;
+  if (gst_caps_is_any(caps)) {
+    res = gst_caps_ref(caps);
+  } else {
+    GstStructure *au_byte_stream = gst_structure_new(
+        caps_name, "alignment", G_TYPE_STRING, "au", "stream-format",
+        G_TYPE_STRING, "byte-stream", NULL);
+    res = gst_caps_new_empty();
+    for (guint i = 0; i < gst_caps_get_size(caps); i++) {
+      GstStructure *structure = gst_caps_get_structure(caps, i);
+      const gchar *alignment = gst_structure_get_string(structure, "alignment");
+      if (!gst_structure_has_name(structure, caps_name)) {
+        // Such as RTP, whose caps are the same on both sides
+        gst_caps_append_structure(res, gst_structure_copy(structure));
+        continue;
+      }
+      if (direction == GST_PAD_SINK) {
+        structure = gst_structure_copy(structure);
+        if (alignment == NULL || g_str_equal(alignment, "none")) {
+          gst_structure_set(structure, "alignment", G_TYPE_STRING, "au", NULL);
         }
+        gst_caps_append_structure(res, structure);
+        continue;
+      }
+      gst_caps_append_structure(res, gst_structure_copy(structure));
+      if (gst_structure_can_intersect(structure, au_byte_stream)) {
+        structure = gst_structure_copy(structure);
+        gst_structure_remove_field(structure, "codec_data");
+        gst_structure_set(structure, "alignment", G_TYPE_STRING, "none",
+                          "stream-format", G_TYPE_STRING, "byte-stream", NULL);
+        gst_caps_append_structure(res, structure);
       }
     }
-    // Parse the next nalu
-    result = gst_h264_parser_identify_nalu(priv->utils.nalparser, map_info.data,
-                                           nalu.offset + nalu.size,  //
-                                           map_info.size, &nalu);
+    gst_structure_free(au_byte_stream);
   }
-  gst_buffer_unmap(inbuf, &map_info);
-  gst_buffer_unmap(outbuf, &dest_map_info);
-  // Set size of the output buffer to "dest_offset" to discard
-  // unused but allocated bytes.
-  if (G_UNLIKELY(!gst_buffer_resize_range(outbuf, 0, -1, 0, dest_offset))) {
-    GST_ERROR_OBJECT(base, "Unable to set buffer size!");
-    return GST_FLOW_ERROR;
+  if (filter) {
+    GstCaps *intersection =
+        gst_caps_intersect_full(filter, res, GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref(res);
+    res = intersection;
+  }
+  GST_DEBUG_OBJECT(trans, "Transformed %" GST_PTR_FORMAT " into %" GST_PTR_FORMAT,
+                   caps, res);
+  return res;
+}
+
+static void gst_h264_encryption_base_reset_framing(
+    GstH264EncryptionBase *h264encryptionbase) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  gst_adapter_clear(priv->adapter);
+  priv->scan_offset = 0;
+  priv->framed_slice = FALSE;
+  priv->framed_idr = FALSE;
+  priv->framed_pts = GST_CLOCK_TIME_NONE;
+  priv->framed_dts = GST_CLOCK_TIME_NONE;
+  priv->drain_ret = GST_FLOW_OK;
+}
+
+/**
+ * Forgets the GOP after a discontinuity, which pictures of the GOP may be
+ * missing in. Counting pictures or reading the PTS across it would derive
+ * wrong IVs, so the encryptor starts a new GOP and the decryptor waits for
+ * the next IV SEI.
+ */
+static void gst_h264_encryption_base_reset_gop(
+    GstH264EncryptionBase *h264encryptionbase) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  priv->utils.gop_lost |= priv->utils.gop_flags != 0;
+  priv->utils.gop_flags = 0;
+  priv->utils.gop_pts = GST_CLOCK_TIME_NONE;
+  priv->utils.gop_frame = 0;
+}
+
+/**
+ * Takes the next complete access unit out of the adapter, or all that is left
+ * when draining, and NULL if there is none yet. An access unit ends before the
+ * first AUD, SEI, parameter set or slice starting a picture that follows a
+ * slice.
+ * Start codes are scanned in place across the queued input buffers, resuming
+ * where the previous call stopped, and the access unit shares their memory.
+ * It takes the timestamps of the input buffer it starts in, unless an earlier
+ * access unit starting in that buffer took them already.
+ */
+static GstBuffer *gst_h264_encryption_base_take_au(
+    GstH264EncryptionBase *h264encryptionbase, gboolean drain) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstH264EncryptionCodec codec = priv->utils.codec;
+  guint header_size = NAL_HEADER_SIZE(codec);
+  gsize available = gst_adapter_available(priv->adapter);
+  gsize au_size = 0;
+  // Framing state of the access unit after the one taken
+  gsize next_scan_offset = 0;
+  gboolean next_slice = FALSE, next_idr = FALSE;
+
+  while (priv->scan_offset + 4 <= available) {
+    guint32 start_code;
+    gssize sc_offset = gst_adapter_masked_scan_uint32_peek(
+        priv->adapter, 0xffffff00, 0x00000100, priv->scan_offset,
+        available - priv->scan_offset, &start_code);
+    if (sc_offset < 0) {
+      // A start code may still be completed by the next input buffer
+      priv->scan_offset = available - 3;
+      break;
+    }
+    guint8 header = start_code & 0xff;
+    guint8 type = _nal_type(codec, &header);
+    // Data partitions B and C continue the slice of partition A
+    gboolean is_slice = _is_slice_type(codec, type) &&
+                        (codec != GST_H264_ENCRYPTION_CODEC_H264 ||
+                         (type != GST_H264_NAL_SLICE_DPB &&
+                          type != GST_H264_NAL_SLICE_DPC));
+    gboolean starts_au;
+    if (is_slice) {
+      guint8 nal[3];
+      if (sc_offset + 3 + header_size + 1 > available) {
+        priv->scan_offset = sc_offset;
+        break;
+      }
+      gst_adapter_copy(priv->adapter, nal, sc_offset + 3, header_size + 1);
+      starts_au = priv->framed_slice && _slice_starts_picture(codec, nal);
+    } else {
+      starts_au = priv->framed_slice && _starts_au_type(codec, type);
+    }
+    if (!starts_au) {
+      priv->framed_slice |= is_slice;
+      priv->framed_idr |= _is_keyframe_type(codec, type);
+      priv->scan_offset = sc_offset + 3;
+      continue;
+    }
+    guint8 zero_byte;
+    au_size = sc_offset;
+    // The zero byte of a 4 byte start code belongs to the next NAL unit
+    gst_adapter_copy(priv->adapter, &zero_byte, au_size - 1, 1);
+    if (zero_byte == 0) au_size--;
+    next_scan_offset = sc_offset - au_size + 3;
+    next_slice = is_slice;
+    next_idr = _is_keyframe_type(codec, type);
+    break;
+  }
+  if (au_size == 0) {
+    if (!drain || available == 0) {
+      return NULL;
+    }
+    au_size = available;
+  }
+
+  guint64 pts_distance, dts_distance;
+  GstClockTime pts = gst_adapter_prev_pts(priv->adapter, &pts_distance);
+  GstClockTime dts = gst_adapter_prev_dts(priv->adapter, &dts_distance);
+  GstBuffer *au = gst_buffer_make_writable(
+      gst_adapter_take_buffer_fast(priv->adapter, au_size));
+  // Past the start of the buffer, its timestamps may belong to an earlier
+  // access unit
+  if (pts_distance > 0 && pts == priv->framed_pts) {
+    pts = GST_CLOCK_TIME_NONE;
+  } else {
+    priv->framed_pts = pts;
+  }
+  if (dts_distance > 0 && dts == priv->framed_dts) {
+    dts = GST_CLOCK_TIME_NONE;
+  } else {
+    priv->framed_dts = dts;
+  }
+  GST_BUFFER_PTS(au) = pts;
+  GST_BUFFER_DTS(au) = dts;
+  if (priv->framed_idr) {
+    GST_BUFFER_FLAG_UNSET(au, GST_BUFFER_FLAG_DELTA_UNIT);
+  } else {
+    GST_BUFFER_FLAG_SET(au, GST_BUFFER_FLAG_DELTA_UNIT);
+  }
+  priv->scan_offset = next_scan_offset;
+  priv->framed_slice = next_slice;
+  priv->framed_idr = next_idr;
+  return au;
+}
+
+/**
+ * Runs the parent class output generation on the next access unit taken from
+ * the adapter, as if it was the input buffer.
+ */
+static GstFlowReturn gst_h264_encryption_base_generate_au(
+    GstBaseTransform *trans, gboolean drain, GstBuffer **outbuf) {
+  GstBuffer *au =
+      gst_h264_encryption_base_take_au(GST_H264_ENCRYPTION_BASE(trans), drain);
+  *outbuf = NULL;
+  if (au == NULL) {
+    return GST_FLOW_OK;
+  }
+  GST_LOG_OBJECT(trans, "Framed access unit of %ld bytes",
+                 gst_buffer_get_size(au));
+  trans->queued_buf = au;
+  return GST_BASE_TRANSFORM_CLASS(parent_class)->generate_output(trans, outbuf);
+}
+
+/**
+ * Queues unaligned input in the adapter instead of processing it directly,
+ * and forgets the GOP on discontinuities. Those are told by the flag of the
+ * input, as is_discont may also be set after an output buffer was dropped,
+ * which loses no input.
+ */
+static GstFlowReturn gst_h264_encryption_base_submit_input_buffer(
+    GstBaseTransform *trans, gboolean is_discont, GstBuffer *input) {
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(trans);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  if (G_UNLIKELY(priv->drain_ret != GST_FLOW_OK)) {
+    GstFlowReturn drain_ret = priv->drain_ret;
+    priv->drain_ret = GST_FLOW_OK;
+    gst_buffer_unref(input);
+    return drain_ret;
+  }
+  gboolean lost_input = GST_BUFFER_FLAG_IS_SET(input, GST_BUFFER_FLAG_DISCONT);
+  if (lost_input) {
+    gst_h264_encryption_base_reset_gop(h264encryptionbase);
+  }
+  GstFlowReturn ret =
+      GST_BASE_TRANSFORM_CLASS(parent_class)
+          ->submit_input_buffer(trans, is_discont, input);
+  if (ret != GST_FLOW_OK || !priv->unaligned || trans->queued_buf == NULL) {
+    return ret;
+  }
+  if (lost_input) {
+    // A partial access unit can not be completed after lost data
+    GST_DEBUG_OBJECT(trans, "Discontinuity, dropping %ld framed bytes",
+                     gst_adapter_available(priv->adapter));
+    gst_h264_encryption_base_reset_framing(h264encryptionbase);
   }
+  gst_adapter_push(priv->adapter, trans->queued_buf);
+  trans->queued_buf = NULL;
   return GST_FLOW_OK;
-error: {
-  gst_buffer_unmap(inbuf, &map_info);
-  gst_buffer_unmap(outbuf, &dest_map_info);
-  return GST_FLOW_ERROR;
 }
+
+/**
+ * Outputs the access units completed by the last input buffer, one per call.
+ */
+static GstFlowReturn gst_h264_encryption_base_generate_output(
+    GstBaseTransform *trans, GstBuffer **outbuf) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(
+          GST_H264_ENCRYPTION_BASE(trans));
+  if (!priv->unaligned) {
+    return GST_BASE_TRANSFORM_CLASS(parent_class)
+        ->generate_output(trans, outbuf);
+  }
+  return gst_h264_encryption_base_generate_au(trans, FALSE, outbuf);
 }
 
-gboolean gst_h264_encryption_base_calculate_payload_offset_and_size(
-    GstH264EncryptionBase *encryption_base, GstH264NalParser *nalparser,
-    GstH264NalUnit *nalu, gsize *payload_offset, gsize *payload_size) {
-  // Calculate payload offset and size
-  GstH264SliceHdr slice;
-  GstH264ParserResult parse_slice_hdr_result;
-  if ((parse_slice_hdr_result = gst_h264_parser_parse_slice_hdr(
-           nalparser, nalu, &slice, TRUE, TRUE)) != GST_H264_PARSER_OK) {
-    GST_ERROR_OBJECT(encryption_base, "Unable to parse slice header! Err: %d",
-                     (uint32_t)parse_slice_hdr_result);
-    return FALSE;
+/**
+ * Processes a buffer list as one batch: every buffer goes through the same
+ * steps as with GstBaseTransform chain, but a compact parser is leased once
+ * for the list, and the output is pushed as a single list. Like chain, the
+ * segment position follows the input, and the output after dropped buffers
+ * is marked DISCONT.
+ */
+static GstFlowReturn gst_h264_encryption_base_chain_list(GstPad *pad,
+                                                         GstObject *parent,
+                                                         GstBufferList *list) {
+  UNUSED(pad);
+  GstBaseTransform *trans = GST_BASE_TRANSFORM(parent);
+  GstBaseTransformClass *klass = GST_BASE_TRANSFORM_GET_CLASS(trans);
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(trans);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  guint n_buffers = gst_buffer_list_length(list);
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  GST_LOG_OBJECT(trans, "Processing a list of %u buffers", n_buffers);
+  priv->output_list = gst_buffer_list_new_sized(n_buffers);
+  for (guint i = 0; i < n_buffers && ret == GST_FLOW_OK; i++) {
+    GstBuffer *input = gst_buffer_ref(gst_buffer_list_get(list, i));
+    // End of the input, as the position of the segment
+    GstClockTime position = GST_BUFFER_TIMESTAMP(input);
+    if (GST_CLOCK_TIME_IS_VALID(position) &&
+        GST_BUFFER_DURATION_IS_VALID(input)) {
+      position += GST_BUFFER_DURATION(input);
+    }
+    gboolean is_discont =
+        GST_BUFFER_FLAG_IS_SET(input, GST_BUFFER_FLAG_DISCONT);
+    priv->list_discont |= is_discont;
+    ret = klass->submit_input_buffer(trans, is_discont, input);
+    while (ret == GST_FLOW_OK) {
+      GstBuffer *outbuf = NULL;
+      ret = klass->generate_output(trans, &outbuf);
+      if (outbuf == NULL) {
+        break;
+      }
+      if (ret != GST_FLOW_OK) {
+        gst_buffer_unref(outbuf);
+        break;
+      }
+      if (GST_CLOCK_TIME_IS_VALID(position) &&
+          trans->segment.format == GST_FORMAT_TIME) {
+        trans->segment.position = position;
+      }
+      if (priv->list_discont) {
+        if (!GST_BUFFER_FLAG_IS_SET(outbuf, GST_BUFFER_FLAG_DISCONT)) {
+          outbuf = gst_buffer_make_writable(outbuf);
+          GST_BUFFER_FLAG_SET(outbuf, GST_BUFFER_FLAG_DISCONT);
+        }
+        priv->list_discont = FALSE;
+      }
+      gst_buffer_list_add(priv->output_list, outbuf);
+    }
+    if (ret == GST_BASE_TRANSFORM_FLOW_DROPPED) {
+      GST_DEBUG_OBJECT(trans, "Dropped a buffer, marking DISCONT");
+      priv->list_discont = TRUE;
+      ret = GST_FLOW_OK;
+    }
   }
-  const gsize slice_header_size =
-      ((slice.header_size - 1) / 8 + 1) + slice.n_emulation_prevention_bytes;
-  *payload_offset = nalu->offset + nalu->header_bytes + slice_header_size;
-  *payload_size = nalu->size - nalu->header_bytes - slice_header_size;
-  return TRUE;
+  gst_buffer_list_unref(list);
+
+  GstBufferList *output_list = priv->output_list;
+  priv->output_list = NULL;
+  gst_h264_encryption_base_release_parser(h264encryptionbase);
+  if (gst_buffer_list_length(output_list) == 0) {
+    gst_buffer_list_unref(output_list);
+    return ret;
+  }
+  GST_LOG_OBJECT(trans, "Pushing a list of %u buffers",
+                 gst_buffer_list_length(output_list));
+  GstFlowReturn push_ret =
+      gst_pad_push_list(GST_BASE_TRANSFORM_SRC_PAD(trans), output_list);
+  return ret != GST_FLOW_OK ? ret : push_ret;
+}
+
+/**
+ * Pushes a buffer the subclass made besides the output buffer of transform,
+ * such as an extra RTP packet. While a buffer list is processed, the buffer
+ * is added to the output list instead, so that it keeps its place among the
+ * output buffers.
+ */
+GstFlowReturn gst_h264_encryption_base_push(
+    GstH264EncryptionBase *encryption_base, GstBuffer *buffer) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  if (priv->output_list != NULL) {
+    gst_buffer_list_add(priv->output_list, buffer);
+    return GST_FLOW_OK;
+  }
+  return gst_pad_push(
+      GST_BASE_TRANSFORM_SRC_PAD(GST_BASE_TRANSFORM(encryption_base)), buffer);
+}
+
+/**
+ * Pushes the access unit left in the adapter and returns the flow of the
+ * push, or of its processing.
+ */
+static GstFlowReturn gst_h264_encryption_base_drain(GstBaseTransform *trans) {
+  GstBuffer *outbuf;
+  GstFlowReturn ret =
+      gst_h264_encryption_base_generate_au(trans, TRUE, &outbuf);
+  if (outbuf != NULL) {
+    if (ret == GST_FLOW_OK) {
+      ret = gst_pad_push(GST_BASE_TRANSFORM_SRC_PAD(trans), outbuf);
+    } else {
+      gst_buffer_unref(outbuf);
+    }
+  }
+  return ret == GST_BASE_TRANSFORM_FLOW_DROPPED ? GST_FLOW_OK : ret;
+}
+
+/**
+ * Pushes the last framed access unit at EOS and before new caps, and forgets
+ * the framed data and the GOP on flush. A flow error of the push before new
+ * caps is returned for the next input buffer.
+ */
+static gboolean gst_h264_encryption_base_sink_event(GstBaseTransform *trans,
+                                                    GstEvent *event) {
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(trans);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  switch (GST_EVENT_TYPE(event)) {
+    case GST_EVENT_EOS:
+    case GST_EVENT_CAPS:
+      if (priv->unaligned) {
+        GstFlowReturn ret = gst_h264_encryption_base_drain(trans);
+        if (ret == GST_FLOW_OK) {
+          break;
+        }
+        GST_DEBUG_OBJECT(trans, "Draining returned %s",
+                         gst_flow_get_name(ret));
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+          priv->drain_ret = ret;
+        } else if (ret == GST_FLOW_NOT_LINKED || ret < GST_FLOW_EOS) {
+          // Nothing follows EOS to return the flow from
+          GST_ELEMENT_FLOW_ERROR(trans, ret);
+        }
+      }
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_h264_encryption_base_reset_framing(h264encryptionbase);
+      gst_h264_encryption_base_reset_gop(h264encryptionbase);
+      break;
+    default:
+      break;
+  }
+  return GST_BASE_TRANSFORM_CLASS(parent_class)->sink_event(trans, event);
+}
+
+/**
+ * Asks for SIMD aligned memory and makes sure a buffer pool is used, either
+ * the downstream one or a new one, with buffers large enough for the access
+ * units seen so far.
+ */
+static gboolean gst_h264_encryption_base_decide_allocation(
+    GstBaseTransform *trans, GstQuery *query) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(
+          GST_H264_ENCRYPTION_BASE(trans));
+  GstAllocator *allocator = NULL;
+  GstAllocationParams params;
+  GstBufferPool *pool = NULL;
+  guint size = 0, min = 0, max = 0;
+  gboolean owns_pool = TRUE;
+
+  if (gst_query_get_n_allocation_params(query) > 0) {
+    gst_query_parse_nth_allocation_param(query, 0, &allocator, &params);
+    params.align = MAX(params.align, OUTPUT_BUFFER_ALIGN);
+    gst_query_set_nth_allocation_param(query, 0, allocator, &params);
+  } else {
+    gst_allocation_params_init(&params);
+    params.align = OUTPUT_BUFFER_ALIGN;
+    gst_query_add_allocation_param(query, NULL, &params);
+  }
+  if (allocator) gst_object_unref(allocator);
+
+  if (gst_query_get_n_allocation_pools(query) > 0) {
+    gst_query_parse_nth_allocation_pool(query, 0, &pool, &size, &min, &max);
+    size = MAX(size, priv->output_buffer_size);
+    gst_query_set_nth_allocation_pool(query, 0, pool, size, min, max);
+    owns_pool = pool == NULL;
+    if (pool) gst_object_unref(pool);
+  } else {
+    // Parent class creates a pool for entries without one
+    gst_query_add_allocation_pool(query, NULL, priv->output_buffer_size, 0, 0);
+  }
+
+  if (!GST_BASE_TRANSFORM_CLASS(parent_class)
+           ->decide_allocation(trans, query)) {
+    return FALSE;
+  }
+  gst_query_parse_nth_allocation_pool(query, 0, NULL, &size, NULL, NULL);
+  priv->pool_buffer_size = size;
+  g_mutex_lock(&priv->pool_lock);
+  priv->owns_pool = owns_pool;
+  g_mutex_unlock(&priv->pool_lock);
+  GST_DEBUG_OBJECT(trans, "Output buffer pool size is %u", size);
+  return TRUE;
+}
+
+/**
+ * Provides an output buffer of at least the given size with metadata of the
+ * input buffer.
+ *
+ * Buffers come from the negotiated pool. If the access unit does not fit in
+ * pooled buffers, it is allocated separately and the pool is renegotiated
+ * with a larger size, so that allocations settle once the largest access
+ * unit is seen.
+ */
+GstFlowReturn gst_h264_encryption_base_allocate_output_buffer(
+    GstH264EncryptionBase *encryption_base, GstBuffer *input, gsize size,
+    GstBuffer **outbuf) {
+  GstBaseTransform *trans = GST_BASE_TRANSFORM(encryption_base);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstBufferPool *pool = gst_base_transform_get_buffer_pool(trans);
+  GstFlowReturn ret;
+
+  if (pool != NULL && size <= priv->pool_buffer_size) {
+    if (priv->compact) {
+      // Pool may have been released while idle
+      g_mutex_lock(&priv->pool_lock);
+      if (G_UNLIKELY(priv->owns_pool && !gst_buffer_pool_is_active(pool))) {
+        GST_DEBUG_OBJECT(trans, "Reactivating output buffer pool");
+        gst_buffer_pool_set_active(pool, TRUE);
+      }
+      ret = gst_buffer_pool_acquire_buffer(pool, outbuf, NULL);
+      g_mutex_unlock(&priv->pool_lock);
+    } else {
+      ret = gst_buffer_pool_acquire_buffer(pool, outbuf, NULL);
+    }
+  } else {
+    if (pool != NULL && size > priv->output_buffer_size) {
+      priv->output_buffer_size =
+          GST_ROUND_UP_N(size + size / 4, OUTPUT_BUFFER_SIZE_STEP);
+      GST_DEBUG_OBJECT(trans, "Growing pooled output buffers to %ld",
+                       priv->output_buffer_size);
+      gst_base_transform_reconfigure_src(trans);
+    }
+    GstAllocator *allocator;
+    GstAllocationParams params;
+    gst_base_transform_get_allocator(trans, &allocator, &params);
+    *outbuf = gst_buffer_new_allocate(allocator, size, &params);
+    if (allocator) gst_object_unref(allocator);
+    ret = *outbuf != NULL ? GST_FLOW_OK : GST_FLOW_ERROR;
+  }
+  if (pool) gst_object_unref(pool);
+  if (G_UNLIKELY(ret != GST_FLOW_OK)) {
+    GST_ERROR_OBJECT(trans, "Unable to allocate output buffer!");
+    return ret;
+  }
+  GST_BASE_TRANSFORM_GET_CLASS(trans)->copy_metadata(trans, input, *outbuf);
+  return GST_FLOW_OK;
+}
+
+size_t _copy_nalu_bytes(GstMapInfo *dest_map_info, GstH264NalUnit *nalu,
+                        size_t *dest_offset) {
+  size_t nalu_total_size = nalu->size + (nalu->offset - nalu->sc_offset);
+  if (dest_map_info->maxsize < *dest_offset + nalu_total_size) {
+    GST_ERROR("Unable to copy as destination is too small");
+    return 0;
+  }
+  // Source and destination may overlap when processing in place
+  memmove(&dest_map_info->data[*dest_offset], &nalu->data[nalu->sc_offset],
+          nalu_total_size);
+  *dest_offset += nalu_total_size;
+  return nalu_total_size;
+}
+
+/**
+ * Returns the byte at offset of the access unit, starting the search for its
+ * chunk from chunk c. Bytes looked up are mostly in chunk c, only those next
+ * to chunk boundaries are in the neighbouring chunks.
+ */
+static inline guint8 _chunk_byte(const GstH264EncryptionChunk *chunks, guint c,
+                                 gsize offset) {
+  while (offset < chunks[c].offset) {
+    c--;
+  }
+  while (offset >= chunks[c].offset + chunks[c].map.size) {
+    c++;
+  }
+  return chunks[c].map.data[offset - chunks[c].offset];
+}
+
+/**
+ * Finds every start code in the access unit with a single pass and records
+ * the NAL units in nal_table. The access unit can be split into chunks, such
+ * as the memories of a buffer, and start codes can span chunk boundaries.
+ *
+ * Start codes are located by looking for their 0x01 byte with memchr, which
+ * libc implements with SIMD instructions, and checking the two bytes before
+ * it. NAL unit sizes follow gst_h264_parser_identify_nalu: trailing zero bytes
+ * are not counted, except for the last NAL unit which extends to the end of
+ * the data.
+ */
+void gst_h264_encryption_base_scan_chunks(GstH264EncryptionCodec codec,
+                                          const GstH264EncryptionChunk *chunks,
+                                          guint n_chunks, GArray *nal_table) {
+  GstH264EncryptionNalEntry *last = NULL;
+  gsize size = 0;
+  gsize pos = 2;
+  g_array_set_size(nal_table, 0);
+  if (n_chunks > 0) {
+    size = chunks[n_chunks - 1].offset + chunks[n_chunks - 1].map.size;
+  }
+  for (guint c = 0; c < n_chunks; c++) {
+    const guint8 *data = chunks[c].map.data;
+    gsize chunk_offset = chunks[c].offset;
+    gsize chunk_end = chunk_offset + chunks[c].map.size;
+    pos = MAX(pos, chunk_offset);
+    while (pos < chunk_end) {
+      const guint8 *found =
+          memchr(&data[pos - chunk_offset], 0x01, chunk_end - pos);
+      if (found == NULL) {
+        break;
+      }
+      gsize one = chunk_offset + (found - data);
+      if (_chunk_byte(chunks, c, one - 1) != 0 ||
+          _chunk_byte(chunks, c, one - 2) != 0) {
+        pos = one + 1;
+        continue;
+      }
+      gsize sc_offset = one - 2;
+      if (sc_offset > 0 && _chunk_byte(chunks, c, sc_offset - 1) == 0) {
+        sc_offset--;
+      }
+      if (last != NULL) {
+        // Previous NAL unit ends at this start code, minus trailing zeros
+        gsize end = one - 2;
+        while (end > last->offset && _chunk_byte(chunks, c, end - 1) == 0) {
+          end--;
+        }
+        last->size = end - last->offset;
+      }
+      if (one + 1 >= size) {
+        // Start code without a NAL unit header
+        last = NULL;
+        goto done;
+      }
+      guint8 header = _chunk_byte(chunks, c, one + 1);
+      GstH264EncryptionNalEntry entry = {
+          .sc_offset = sc_offset,
+          .offset = one + 1,
+          .size = 0,
+          .type = _nal_type(codec, &header),
+      };
+      g_array_append_val(nal_table, entry);
+      last = &g_array_index(nal_table, GstH264EncryptionNalEntry,
+                            nal_table->len - 1);
+      // Next start code can begin at the header byte at the earliest
+      pos = one + 2;
+    }
+  }
+done:
+  if (last != NULL) {
+    last->size = size - last->offset;
+  }
+  // End of sequence/stream NAL units are exactly their header
+  for (guint i = 0; i < nal_table->len; i++) {
+    GstH264EncryptionNalEntry *entry =
+        &g_array_index(nal_table, GstH264EncryptionNalEntry, i);
+    if (_is_end_type(codec, entry->type)) {
+      entry->size = NAL_HEADER_SIZE(codec);
+    }
+  }
+}
+
+/**
+ * Same as gst_h264_encryption_base_scan_chunks for avc/avc3 access units,
+ * where every NAL unit is preceded by its length on nal_length_size bytes.
+ * Scanning stops at a NAL unit that does not fit in the access unit.
+ */
+void gst_h264_encryption_base_scan_avc_chunks(
+    GstH264EncryptionCodec codec, const GstH264EncryptionChunk *chunks,
+    guint n_chunks, guint nal_length_size, GArray *nal_table) {
+  gsize size = 0, pos = 0;
+  guint c = 0;
+  g_array_set_size(nal_table, 0);
+  if (n_chunks > 0) {
+    size = chunks[n_chunks - 1].offset + chunks[n_chunks - 1].map.size;
+  }
+  while (pos + nal_length_size < size) {
+    while (pos >= chunks[c].offset + chunks[c].map.size) {
+      c++;
+    }
+    gsize length = 0;
+    for (guint i = 0; i < nal_length_size; i++) {
+      length = (length << 8) | _chunk_byte(chunks, c, pos + i);
+    }
+    if (G_UNLIKELY(length > size - pos - nal_length_size)) {
+      GST_WARNING("Nal unit at offset %ld of size %ld exceeds the access unit",
+                  pos, length);
+      break;
+    }
+    if (length > 0) {
+      guint8 header = _chunk_byte(chunks, c, pos + nal_length_size);
+      GstH264EncryptionNalEntry entry = {
+          .sc_offset = pos,
+          .offset = pos + nal_length_size,
+          .size = length,
+          .type = _nal_type(codec, &header),
+      };
+      g_array_append_val(nal_table, entry);
+    }
+    pos += nal_length_size + length;
+  }
+}
+
+/**
+ * Writes size as the big endian NAL unit length prefix of nal_length_size
+ * bytes at prefix. Returns FALSE if size does not fit.
+ */
+gboolean gst_h264_encryption_base_write_nal_length(guint8 *prefix,
+                                                   guint nal_length_size,
+                                                   gsize size) {
+  if (G_UNLIKELY(nal_length_size < sizeof(guint32) &&
+                 size >> (nal_length_size * 8) != 0)) {
+    GST_ERROR("Nal unit size %ld does not fit in %u bytes", size,
+              nal_length_size);
+    return FALSE;
+  }
+  for (guint i = nal_length_size; i-- > 0;) {
+    prefix[i] = size & 0xff;
+    size >>= 8;
+  }
+  return TRUE;
+}
+
+/**
+ * Records the NAL units of the access unit made of chunks in the NAL table,
+ * according to the stream format.
+ */
+static void gst_h264_encryption_base_build_nal_table(
+    GstH264EncryptionBase *h264encryptionbase,
+    const GstH264EncryptionChunk *chunks, guint n_chunks) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  if (priv->utils.nal_length_size > 0) {
+    gst_h264_encryption_base_scan_avc_chunks(
+        priv->utils.codec, chunks, n_chunks, priv->utils.nal_length_size,
+        priv->utils.nal_table);
+  } else {
+    gst_h264_encryption_base_scan_chunks(priv->utils.codec, chunks, n_chunks,
+                                         priv->utils.nal_table);
+  }
+}
+
+/**
+ * Identifies the NAL unit whose start code or length prefix is at offset of
+ * data, which holds it up to size, according to the stream format.
+ */
+static GstH264ParserResult gst_h264_encryption_base_identify(
+    GstH264EncryptionBase *h264encryptionbase, GstH264NalParser *parser,
+    const guint8 *data, gsize offset, gsize size, GstH264NalUnit *nalu) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  if (priv->utils.nal_length_size > 0) {
+    return gst_h264_parser_identify_nalu_avc(
+        parser, data, offset, size, priv->utils.nal_length_size, nalu);
+  }
+  return gst_h264_parser_identify_nalu_unchecked(parser, data, offset, size,
+                                                 nalu);
+}
+
+/**
+ * Describes the H.265 NAL unit h265_nalu as a GstH264NalUnit for subclasses.
+ */
+static void _h264_nal_unit_from_h265(const GstH265NalUnit *h265_nalu,
+                                     GstH264NalUnit *nalu) {
+  memset(nalu, 0, sizeof(*nalu));
+  nalu->type = h265_nalu->type;
+  nalu->size = h265_nalu->size;
+  nalu->offset = h265_nalu->offset;
+  nalu->sc_offset = h265_nalu->sc_offset;
+  nalu->valid = h265_nalu->valid;
+  nalu->data = h265_nalu->data;
+  nalu->header_bytes = h265_nalu->header_bytes;
+}
+
+/**
+ * Rebuilds the H.265 NAL unit that nalu describes, reading the layer and
+ * temporal ids from its header.
+ */
+static void _h265_nal_unit_from_h264(const GstH264NalUnit *nalu,
+                                     GstH265NalUnit *h265_nalu) {
+  const guint8 *header = &nalu->data[nalu->offset];
+  memset(h265_nalu, 0, sizeof(*h265_nalu));
+  h265_nalu->type = nalu->type;
+  h265_nalu->layer_id = ((header[0] & 0x01) << 5) | (header[1] >> 3);
+  h265_nalu->temporal_id_plus1 = header[1] & 0x07;
+  h265_nalu->size = nalu->size;
+  h265_nalu->offset = nalu->offset;
+  h265_nalu->sc_offset = nalu->sc_offset;
+  h265_nalu->valid = nalu->valid;
+  h265_nalu->data = nalu->data;
+  h265_nalu->header_bytes = nalu->header_bytes;
+}
+
+/**
+ * Same as gst_h264_encryption_base_identify for H.265 NAL units, which are
+ * then parsed if they are parameter sets and described in nalu. Returns
+ * FALSE if the NAL unit header cannot be identified.
+ */
+static gboolean gst_h264_encryption_base_identify_h265(
+    GstH264EncryptionBase *h264encryptionbase, const guint8 *data,
+    gsize offset, gsize size, GstH264NalUnit *nalu) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstH265NalUnit h265_nalu;
+  GstH265ParserResult result;
+  if (priv->utils.nal_length_size > 0) {
+    result = gst_h265_parser_identify_nalu_hevc(
+        priv->utils.h265parser, data, offset, size,
+        priv->utils.nal_length_size, &h265_nalu);
+  } else {
+    result = gst_h265_parser_identify_nalu_unchecked(
+        priv->utils.h265parser, data, offset, size, &h265_nalu);
+  }
+  if (G_UNLIKELY(result != GST_H265_PARSER_OK)) {
+    return FALSE;
+  }
+  // Slice headers refer to VPS/SPS/PPS, which the parser keeps
+  if (_is_parameter_set_type(GST_H264_ENCRYPTION_CODEC_H265, h265_nalu.type)) {
+    gst_h265_parser_parse_nal(priv->utils.h265parser, &h265_nalu);
+  }
+  _h264_nal_unit_from_h265(&h265_nalu, nalu);
+  return TRUE;
+}
+
+/**
+ * Returns bit of the RBSP bytes, most significant bit first.
+ */
+static inline guint _rbsp_bit(const guint8 *rbsp, guint bit) {
+  return (rbsp[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/**
+ * Reads the id of the SPS or PPS in nalu, the first ue(v) after skip bytes of
+ * its RBSP. Returns FALSE if the NAL unit is too short.
+ */
+static gboolean _read_parameter_set_id(const GstH264NalUnit *nalu, guint skip,
+                                       guint *id) {
+  // Ids fit in the first few bytes once emulation prevention bytes are gone
+  guint8 rbsp[8];
+  guint size = 0, zero_count = 0;
+  for (guint i = nalu->header_bytes; i < nalu->size && size < sizeof(rbsp);
+       i++) {
+    guint8 byte = nalu->data[nalu->offset + i];
+    if (zero_count >= 2 && byte == 0x03) {
+      zero_count = 0;
+      continue;
+    }
+    rbsp[size++] = byte;
+    zero_count = byte == 0 ? zero_count + 1 : 0;
+  }
+  guint bit = skip * 8, leading_zeros = 0;
+  while (bit < size * 8 && !_rbsp_bit(rbsp, bit)) {
+    leading_zeros++;
+    bit++;
+  }
+  // PPS ids go up to 255, which has 8 leading zeros
+  if (leading_zeros > 8 || bit + 1 + leading_zeros > size * 8) {
+    return FALSE;
+  }
+  bit++;
+  guint value = 0;
+  for (guint i = 0; i < leading_zeros; i++) {
+    value = (value << 1) | _rbsp_bit(rbsp, bit++);
+  }
+  *id = (1u << leading_zeros) - 1 + value;
+  return TRUE;
+}
+
+/**
+ * Keeps the SPS or PPS in nalu for the parsers leased in compact mode,
+ * replacing the one with the same id. Repeated parameter sets, such as those
+ * before every IDR, are only compared.
+ */
+static void gst_h264_encryption_base_record_parameter_set(
+    GstH264EncryptionBase *h264encryptionbase, const GstH264NalUnit *nalu) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  const guint8 *data = &nalu->data[nalu->offset];
+  gsize size = nalu->size;
+  guint id;
+  // SPS id follows profile, constraint flags and level
+  if (!_read_parameter_set_id(nalu, nalu->type == GST_H264_NAL_SPS ? 3 : 0,
+                              &id)) {
+    GST_WARNING_OBJECT(h264encryptionbase, "Unable to read parameter set id");
+    return;
+  }
+  GstH264EncryptionParameterSet *parameter_set = NULL;
+  for (guint i = 0; i < priv->parameter_sets->len; i++) {
+    GstH264EncryptionParameterSet *candidate = &g_array_index(
+        priv->parameter_sets, GstH264EncryptionParameterSet, i);
+    if (candidate->type == nalu->type && candidate->id == id) {
+      parameter_set = candidate;
+      break;
+    }
+  }
+  if (parameter_set == NULL) {
+    GstH264EncryptionParameterSet new_set = {
+        .type = nalu->type, .id = id, .nal = NULL};
+    g_array_append_val(priv->parameter_sets, new_set);
+    parameter_set =
+        &g_array_index(priv->parameter_sets, GstH264EncryptionParameterSet,
+                       priv->parameter_sets->len - 1);
+  } else {
+    gsize stored_size;
+    const guint8 *stored = g_bytes_get_data(parameter_set->nal, &stored_size);
+    if (stored_size == size + 4 && memcmp(&stored[4], data, size) == 0) {
+      return;
+    }
+    g_bytes_unref(parameter_set->nal);
+  }
+  GST_DEBUG_OBJECT(h264encryptionbase, "Keeping %s %u",
+                   nalu->type == GST_H264_NAL_SPS ? "SPS" : "PPS", id);
+  guint8 *nal = g_malloc(size + 4);
+  memcpy(nal, "\x00\x00\x00\x01", 4);
+  memcpy(&nal[4], data, size);
+  parameter_set->nal = g_bytes_new_take(nal, size + 4);
+}
+
+/**
+ * Parses the kept parameter sets into parser, SPS first as PPS refer to them.
+ */
+static void gst_h264_encryption_base_replay_parameter_sets(
+    GstH264EncryptionBase *h264encryptionbase, GstH264NalParser *parser) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  const guint8 types[] = {GST_H264_NAL_SPS, GST_H264_NAL_PPS};
+  for (guint t = 0; t < G_N_ELEMENTS(types); t++) {
+    for (guint i = 0; i < priv->parameter_sets->len; i++) {
+      GstH264EncryptionParameterSet *parameter_set = &g_array_index(
+          priv->parameter_sets, GstH264EncryptionParameterSet, i);
+      GstH264NalUnit nalu;
+      gsize size;
+      const guint8 *data = g_bytes_get_data(parameter_set->nal, &size);
+      if (parameter_set->type == types[t] &&
+          gst_h264_parser_identify_nalu_unchecked(parser, data, 0, size,
+                                                  &nalu) ==
+              GST_H264_PARSER_OK) {
+        gst_h264_parser_parse_nal(parser, &nalu);
+      }
+    }
+  }
+}
+
+/**
+ * In compact mode, leases a NAL parser as utils.nalparser until
+ * gst_h264_encryption_base_release_parser. Does nothing otherwise, as the
+ * instance owns its parser.
+ */
+static void gst_h264_encryption_base_lease_parser(
+    GstH264EncryptionBase *h264encryptionbase) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  if (!priv->compact || priv->utils.codec != GST_H264_ENCRYPTION_CODEC_H264 ||
+      priv->parser_lease != NULL) {
+    return;
+  }
+  priv->parser_lease = gst_h264_nal_parser_pool_lease(priv->parser_owner);
+  if (priv->parser_lease->owner != priv->parser_owner) {
+    gst_h264_encryption_base_replay_parameter_sets(h264encryptionbase,
+                                                   priv->parser_lease->parser);
+  }
+  priv->utils.nalparser = priv->parser_lease->parser;
+}
+
+static void gst_h264_encryption_base_release_parser(
+    GstH264EncryptionBase *h264encryptionbase) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  // The lease is kept until the buffer list is processed
+  if (priv->parser_lease == NULL || priv->output_list != NULL) {
+    return;
+  }
+  gst_h264_nal_parser_pool_release(priv->parser_lease, priv->parser_owner);
+  priv->parser_lease = NULL;
+  priv->utils.nalparser = NULL;
+}
+
+/**
+ * Parses the parameter set in data, which starts with its start code or length
+ * prefix, outside of an access unit. Keeps the parser current while a
+ * subclass lets access units through without processing them.
+ */
+void gst_h264_encryption_base_parse_parameter_set(
+    GstH264EncryptionBase *encryption_base, const guint8 *data, gsize size) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264NalUnit nalu;
+  if (priv->utils.codec == GST_H264_ENCRYPTION_CODEC_H265) {
+    gst_h264_encryption_base_identify_h265(encryption_base, data, 0, size,
+                                           &nalu);
+    return;
+  }
+  gst_h264_encryption_base_lease_parser(encryption_base);
+  if (gst_h264_encryption_base_identify(encryption_base, priv->utils.nalparser,
+                                        data, 0, size,
+                                        &nalu) == GST_H264_PARSER_OK) {
+    gst_h264_parser_parse_nal(priv->utils.nalparser, &nalu);
+    if (priv->compact) {
+      gst_h264_encryption_base_record_parameter_set(encryption_base, &nalu);
+    }
+  }
+  gst_h264_encryption_base_release_parser(encryption_base);
+}
+
+static void gst_h264_encryption_base_free_config(
+    GstH264EncryptionConfig *config) {
+  if (config == NULL) {
+    return;
+  }
+  for (guint i = 0; i < config->n_keys; i++) {
+    gst_h264_key_schedule_unref(config->keys[i].schedule);
+  }
+  g_free(config);
+}
+
+/**
+ * Publishes the keyring with the mode property, replacing a config the
+ * streaming thread has not taken yet. Called with the object lock held.
+ */
+static void gst_h264_encryption_base_publish_config(
+    GstH264EncryptionBase *encryption_base) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  gsize keys_size =
+      priv->keyring->len * sizeof(GstH264EncryptionKeyringEntry);
+  GstH264EncryptionConfig *config =
+      g_malloc0(sizeof(GstH264EncryptionConfig) + keys_size);
+  gpointer replaced;
+
+  config->encryption_mode = priv->encryption_mode;
+  config->n_keys = priv->keyring->len;
+  memcpy(config->keys, priv->keyring->data, keys_size);
+  for (guint i = 0; i < config->n_keys; i++) {
+    gst_h264_key_schedule_ref(config->keys[i].schedule);
+  }
+  do {
+    replaced = g_atomic_pointer_get(&priv->pending_config);
+  } while (!g_atomic_pointer_compare_and_exchange(&priv->pending_config,
+                                                  replaced, config));
+  gst_h264_encryption_base_free_config(replaced);
+}
+
+/**
+ * Returns the round keys of key_id in config, or NULL if it has no such key.
+ */
+static GstH264KeySchedule *_config_get_schedule(GstH264EncryptionConfig *config,
+                                                guint8 key_id) {
+  for (guint i = 0; config != NULL && i < config->n_keys; i++) {
+    if (config->keys[i].key_id == key_id) {
+      return config->keys[i].schedule;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Takes the published config, if it was not taken since it was checked, and
+ * selects the key in use again from its keyring. The IV of the cipher
+ * context is kept. If the key in use was replaced under the same ID, the GOP
+ * is forgotten, so that no picture derives its IV under the new key from an
+ * IV SEI written under the old one.
+ */
+static void gst_h264_encryption_base_take_config(
+    GstH264EncryptionBase *encryption_base) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264EncryptionConfig *config = g_atomic_pointer_get(&priv->pending_config);
+
+  if (config == NULL || !g_atomic_pointer_compare_and_exchange(
+                            &priv->pending_config, config, NULL)) {
+    return;
+  }
+  GST_DEBUG_OBJECT(encryption_base, "Taking new keyring and mode");
+  GstH264KeySchedule *schedule =
+      _config_get_schedule(priv->config, priv->utils.key_id);
+  if (priv->utils.keyed &&
+      _config_get_schedule(config, priv->utils.key_id) != schedule) {
+    GST_DEBUG_OBJECT(encryption_base, "Key %u in use was replaced",
+                     priv->utils.key_id);
+    gst_h264_encryption_base_reset_gop(encryption_base);
+  }
+  gst_h264_encryption_base_free_config(priv->config);
+  priv->config = config;
+  priv->utils.encryption_mode = config->encryption_mode;
+  priv->utils.keyed = FALSE;
+  gst_h264_encryption_base_select_key(encryption_base, priv->utils.key_id);
+}
+
+/**
+ * Puts the round keys of key_id in the cipher context, unless they already
+ * are. Returns FALSE if the keyring has no such key. Keys are looked up in
+ * the config taken at the start of the access unit, never expanded here.
+ */
+gboolean gst_h264_encryption_base_select_key(
+    GstH264EncryptionBase *encryption_base, guint8 key_id) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+
+  if (G_LIKELY(priv->utils.keyed && priv->utils.key_id == key_id)) {
+    return TRUE;
+  }
+  GstH264KeySchedule *schedule = _config_get_schedule(priv->config, key_id);
+  if (schedule != NULL) {
+    memcpy(priv->utils.ctx.RoundKey, schedule->round_key,
+           sizeof(priv->utils.ctx.RoundKey));
+    priv->utils.key_id = key_id;
+    priv->utils.keyed = TRUE;
+    GST_DEBUG_OBJECT(encryption_base, "Selected key %u", key_id);
+    return TRUE;
+  }
+  priv->utils.key_id = key_id;
+  priv->utils.keyed = FALSE;
+  return FALSE;
+}
+
+/**
+ * Puts key into the keyring as key_id, replacing the key it had, and
+ * publishes the keyring. Key ID 0 is the key property. Keys are expanded
+ * once for every instance, in the thread of the first one adding them.
+ */
+static gboolean gst_h264_encryption_base_add_key(
+    GstH264EncryptionBase *encryption_base, guint key_id,
+    GstEncryptionKey *key) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264EncryptionKeyringEntry entry;
+  GstH264KeySchedule *replaced = NULL;
+  guint i;
+
+  if (key_id > G_MAXUINT8 || key == NULL) {
+    GST_ERROR_OBJECT(encryption_base, "Unable to add key %u to the keyring",
+                     key_id);
+    return FALSE;
+  }
+  // Looked up outside of the lock, off the streaming thread
+  entry.key_id = key_id;
+  entry.schedule = gst_h264_key_schedule_cache_get(key->bytes);
+  GST_OBJECT_LOCK(encryption_base);
+  for (i = 0; i < priv->keyring->len; i++) {
+    if (g_array_index(priv->keyring, GstH264EncryptionKeyringEntry, i)
+            .key_id == key_id) {
+      replaced =
+          g_array_index(priv->keyring, GstH264EncryptionKeyringEntry, i)
+              .schedule;
+      break;
+    }
+  }
+  if (i == priv->keyring->len) {
+    g_array_set_size(priv->keyring, i + 1);
+  }
+  g_array_index(priv->keyring, GstH264EncryptionKeyringEntry, i) = entry;
+  gst_h264_encryption_base_publish_config(encryption_base);
+  GST_OBJECT_UNLOCK(encryption_base);
+  gst_h264_key_schedule_unref(replaced);
+  GST_INFO_OBJECT(encryption_base, "Key %u is in the keyring", key_id);
+  return TRUE;
+}
+
+/**
+ * Removes key_id from the keyring and publishes the keyring.
+ */
+static gboolean gst_h264_encryption_base_remove_key(
+    GstH264EncryptionBase *encryption_base, guint key_id) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264KeySchedule *removed = NULL;
+
+  GST_OBJECT_LOCK(encryption_base);
+  for (guint i = 0; i < priv->keyring->len; i++) {
+    GstH264EncryptionKeyringEntry *entry =
+        &g_array_index(priv->keyring, GstH264EncryptionKeyringEntry, i);
+    if (entry->key_id == key_id) {
+      removed = entry->schedule;
+      g_array_remove_index_fast(priv->keyring, i);
+      gst_h264_encryption_base_publish_config(encryption_base);
+      break;
+    }
+  }
+  GST_OBJECT_UNLOCK(encryption_base);
+  gst_h264_key_schedule_unref(removed);
+  return removed != NULL;
+}
+
+/**
+ * Sets up the cipher context and lets the subclass reset its state for the
+ * access unit whose NAL table was just built. In compact mode, also leases a
+ * NAL parser until gst_h264_encryption_base_end_au.
+ */
+static gboolean gst_h264_encryption_base_enter_au(
+    GstH264EncryptionBase *encryption_base) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  // Take the key schedule of a key or mode change (iv is later if needed)
+  if (G_UNLIKELY(g_atomic_pointer_get(&priv->pending_config) != NULL)) {
+    gst_h264_encryption_base_take_config(encryption_base);
+  }
+  // Subclasses select the key of the access unit from the keyring
+  if (G_UNLIKELY(priv->config == NULL || priv->config->n_keys == 0)) {
+    GST_ERROR_OBJECT(encryption_base, "Key is not set!");
+    return FALSE;
+  }
+  if (priv->compact) {
+    g_atomic_int_inc(&priv->activity);
+    gst_h264_encryption_base_lease_parser(encryption_base);
+  }
+  GST_H264_ENCRYPTION_BASE_GET_CLASS(encryption_base)
+      ->enter_base_transform(encryption_base);
+  return TRUE;
+}
+
+/**
+ * Decrypts the blocks that gst_h264_encryption_base_decrypt_blocks left for
+ * the end of the access unit.
+ */
+static void gst_h264_encryption_base_run_cipher_task(gpointer task,
+                                                     gpointer user_data) {
+  GstH264EncryptionCipherTask *cipher_task = task;
+  _decrypt_ctx_blocks(cipher_task->encryption_mode, &cipher_task->ctx,
+                      cipher_task->data, cipher_task->size);
+}
+
+/**
+ * Finishes processing an access unit: decrypts the blocks left for its end,
+ * while the buffers they are in are still mapped. In compact mode, also
+ * returns the leased NAL parser and frees the work buffers.
+ */
+void gst_h264_encryption_base_end_au(GstH264EncryptionBase *encryption_base) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  if (priv->cipher_tasks->len > 0) {
+    gst_h264_encryption_base_run_tasks(
+        encryption_base, gst_h264_encryption_base_run_cipher_task,
+        priv->cipher_tasks->data, priv->cipher_tasks->len,
+        sizeof(GstH264EncryptionCipherTask), NULL);
+    g_array_set_size(priv->cipher_tasks, 0);
+  }
+  if (priv->parser_lease == NULL) {
+    return;
+  }
+  gst_h264_encryption_base_release_parser(encryption_base);
+  if (priv->scratch->len > 0) {
+    g_byte_array_unref(priv->scratch);
+    priv->scratch = g_byte_array_new();
+  }
+}
+
+/**
+ * Prepares processing of the access unit in data: sets up the cipher
+ * context, builds the NAL table and lets the subclass reset its state.
+ */
+gboolean gst_h264_encryption_base_begin_au(
+    GstH264EncryptionBase *encryption_base, const guint8 *data, gsize size) {
+  GstH264EncryptionChunk chunk = {.offset = 0};
+  chunk.map.data = (guint8 *)data;
+  chunk.map.size = size;
+  gst_h264_encryption_base_build_nal_table(encryption_base, &chunk, 1);
+  return gst_h264_encryption_base_enter_au(encryption_base);
+}
+
+/**
+ * Fills nalu from the NAL table entry at index and parses it, so that the
+ * parser knows SPS/PPS by the time slice headers are parsed. data holds the
+ * NAL unit and starts at data_offset of the access unit.
+ *
+ * Returns FALSE if the NAL unit header cannot be identified.
+ */
+gboolean gst_h264_encryption_base_identify_nalu(
+    GstH264EncryptionBase *encryption_base, const guint8 *data,
+    gsize data_offset, guint index, GstH264NalUnit *nalu) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264EncryptionNalEntry *entry =
+      &g_array_index(priv->utils.nal_table, GstH264EncryptionNalEntry, index);
+  gsize offset = entry->sc_offset - data_offset;
+  gsize size = entry->offset + entry->size - data_offset;
+  if (priv->utils.codec == GST_H264_ENCRYPTION_CODEC_H265) {
+    if (G_UNLIKELY(!gst_h264_encryption_base_identify_h265(
+            encryption_base, data, offset, size, nalu))) {
+      GST_WARNING_OBJECT(encryption_base,
+                         "Unable to identify nal unit at offset %u",
+                         entry->sc_offset);
+      return FALSE;
+    }
+    return TRUE;
+  }
+  // Boundaries are already known, so this only parses the NAL unit header
+  GstH264ParserResult result = gst_h264_encryption_base_identify(
+      encryption_base, priv->utils.nalparser, data, offset, size, nalu);
+  if (G_UNLIKELY(result != GST_H264_PARSER_OK)) {
+    GST_WARNING_OBJECT(encryption_base,
+                       "Unable to identify nal unit at offset %u",
+                       entry->sc_offset);
+    return FALSE;
+  }
+  // Processes the following NALU types:
+  // GST_H264_NAL_SLICE        = 1,
+  // GST_H264_NAL_SLICE_DPA    = 2,
+  // GST_H264_NAL_SLICE_DPB    = 3,
+  // GST_H264_NAL_SLICE_DPC    = 4,
+  // GST_H264_NAL_SLICE_IDR    = 5,
+  // Need to populate SPS/PPS of nalparser for parsing slice header later
+  gst_h264_parser_parse_nal(priv->utils.nalparser, nalu);
+  if (priv->compact &&
+      (nalu->type == GST_H264_NAL_SPS || nalu->type == GST_H264_NAL_PPS)) {
+    gst_h264_encryption_base_record_parameter_set(encryption_base, nalu);
+  }
+  return TRUE;
+}
+
+/**
+ * Returns the bytes of the NAL unit at entry, which starts in chunk c of the
+ * access unit, and their offset in the access unit.
+ *
+ * NAL units inside a single chunk are used where they are. Those spanning
+ * chunk boundaries are gathered into the scratch buffer.
+ */
+static const guint8 *gst_h264_encryption_base_get_nalu_data(
+    GstH264EncryptionBase *h264encryptionbase,
+    const GstH264EncryptionChunk *chunks, guint c,
+    const GstH264EncryptionNalEntry *entry, gsize *data_offset) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  gsize start = entry->sc_offset;
+  gsize end = entry->offset + entry->size;
+  if (G_LIKELY(end <= chunks[c].offset + chunks[c].map.size)) {
+    *data_offset = chunks[c].offset;
+    return chunks[c].map.data;
+  }
+  GST_LOG_OBJECT(h264encryptionbase,
+                 "Gathering nal unit at offset %ld spanning memories", start);
+  g_byte_array_set_size(priv->scratch, end - start);
+  for (gsize copied = 0; copied < end - start; c++) {
+    gsize from = start + copied - chunks[c].offset;
+    gsize size = MIN(chunks[c].map.size - from, end - start - copied);
+    memcpy(&priv->scratch->data[copied], &chunks[c].map.data[from], size);
+    copied += size;
+  }
+  *data_offset = start;
+  return priv->scratch->data;
+}
+
+/**
+ * Processes the access unit made of chunks into dest_map_info, starting from
+ * dest_offset, and advances dest_offset past the written bytes.
+ *
+ * A single chunk can be mapped to dest_map_info when processing in place, as
+ * long as the subclass never grows NAL units: written bytes then always stay
+ * behind the NAL unit being read.
+ *
+ * If share_threshold is not 0, large enough non-slice NAL units are not
+ * written but recorded in shared_regions, to be shared from the input.
+ */
+static gboolean gst_h264_encryption_base_process_au(
+    GstH264EncryptionBase *h264encryptionbase,
+    const GstH264EncryptionChunk *chunks, guint n_chunks,
+    GstMapInfo *dest_map_info, size_t *dest_offset, guint share_threshold) {
+  GstH264NalUnit nalu;
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GArray *nal_table = priv->utils.nal_table;
+  // Every region adds up to two memories to the output buffer, which merges
+  // all of them once it has too many
+  guint max_shared_regions = (gst_buffer_get_max_memory() - 1) / 2;
+  guint c = 0;
+
+  g_array_set_size(priv->shared_regions, 0);
+  gst_h264_encryption_base_build_nal_table(h264encryptionbase, chunks,
+                                           n_chunks);
+  if (!gst_h264_encryption_base_enter_au(h264encryptionbase)) {
+    return FALSE;
+  }
+  for (guint i = 0; i < nal_table->len; i++) {
+    GstH264EncryptionNalEntry *entry =
+        &g_array_index(nal_table, GstH264EncryptionNalEntry, i);
+    while (entry->sc_offset >= chunks[c].offset + chunks[c].map.size) {
+      c++;
+    }
+    gsize data_offset;
+    const guint8 *data = gst_h264_encryption_base_get_nalu_data(
+        h264encryptionbase, chunks, c, entry, &data_offset);
+    if (!gst_h264_encryption_base_identify_nalu(h264encryptionbase, data,
+                                                data_offset, i, &nalu)) {
+      break;
+    }
+    gboolean copy;
+    if (!GST_H264_ENCRYPTION_BASE_GET_CLASS(h264encryptionbase)
+             ->before_nalu_copy(h264encryptionbase, &nalu, dest_map_info,
+                                dest_offset, &copy)) {
+      return FALSE;
+    }
+    if (G_LIKELY(copy)) {
+      if (_is_slice_type(priv->utils.codec, nalu.type)) {
+        // Copy the slice into dest
+        size_t nalu_total_size;
+        if ((nalu_total_size =
+                 _copy_nalu_bytes(dest_map_info, &nalu, dest_offset)) == 0) {
+          return FALSE;
+        }
+        // Copied nal unit only differs from the source one by its location
+        GstH264NalUnit dest_nalu = nalu;
+        dest_nalu.data = dest_map_info->data;
+        dest_nalu.sc_offset = *dest_offset - nalu_total_size;
+        dest_nalu.offset = dest_nalu.sc_offset + (nalu.offset - nalu.sc_offset);
+        GST_DEBUG_OBJECT(
+            h264encryptionbase,
+            "Source nal unit is copied. Type %d sc_offset %d total_size %ld",
+            nalu.type, nalu.sc_offset, nalu_total_size);
+        if (!GST_H264_ENCRYPTION_BASE_GET_CLASS(h264encryptionbase)
+                 ->process_slice_nalu(h264encryptionbase, &dest_nalu,
+                                      dest_map_info, dest_offset)) {
+          GST_ERROR_OBJECT(h264encryptionbase,
+                           "Subclass failed to parse slice nalu");
+          return FALSE;
+        }
+        // Slice size changed, so does its length prefix
+        if (priv->utils.nal_length_size > 0 &&
+            !gst_h264_encryption_base_write_nal_length(
+                &dest_map_info->data[dest_nalu.sc_offset],
+                priv->utils.nal_length_size,
+                *dest_offset - dest_nalu.offset)) {
+          return FALSE;
+        }
+      } else {
+        size_t nalu_total_size = nalu.size + (nalu.offset - nalu.sc_offset);
+        GArray *regions = priv->shared_regions;
+        GstH264EncryptionSharedRegion *last =
+            regions->len > 0 ? &g_array_index(regions,
+                                              GstH264EncryptionSharedRegion,
+                                              regions->len - 1)
+                             : NULL;
+        if (share_threshold == 0 || nalu_total_size < share_threshold) {
+          // Copy non-slice nal unit
+          if (_copy_nalu_bytes(dest_map_info, &nalu, dest_offset) == 0) {
+            return FALSE;
+          }
+        } else if (last != NULL && last->dest_offset == *dest_offset &&
+                   last->offset + last->size == entry->sc_offset) {
+          // Directly follows the previous shared nal unit
+          last->size += nalu_total_size;
+        } else if (regions->len < max_shared_regions) {
+          GstH264EncryptionSharedRegion region = {
+              .dest_offset = *dest_offset,
+              .offset = entry->sc_offset,
+              .size = nalu_total_size,
+          };
+          g_array_append_val(regions, region);
+        } else if (_copy_nalu_bytes(dest_map_info, &nalu, dest_offset) == 0) {
+          return FALSE;
+        }
+      }
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * Maps every memory of buffer on its own into chunks, so that multi-memory
+ * buffers are not merged into a copy as gst_buffer_map does.
+ */
+static gboolean gst_h264_encryption_base_map_chunks(
+    GstH264EncryptionBase *h264encryptionbase, GstBuffer *buffer) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  guint n_memory = gst_buffer_n_memory(buffer);
+  gsize offset = 0;
+  g_array_set_size(priv->chunks, 0);
+  for (guint i = 0; i < n_memory; i++) {
+    GstH264EncryptionChunk chunk = {.offset = offset};
+    if (!gst_memory_map(gst_buffer_peek_memory(buffer, i), &chunk.map,
+                        GST_MAP_READ)) {
+      gst_h264_encryption_base_unmap_chunks(h264encryptionbase);
+      return FALSE;
+    }
+    g_array_append_val(priv->chunks, chunk);
+    offset += chunk.map.size;
+  }
+  return TRUE;
+}
+
+static void gst_h264_encryption_base_unmap_chunks(
+    GstH264EncryptionBase *h264encryptionbase) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  for (guint i = 0; i < priv->chunks->len; i++) {
+    GstH264EncryptionChunk *chunk =
+        &g_array_index(priv->chunks, GstH264EncryptionChunk, i);
+    gst_memory_unmap(chunk->map.memory, &chunk->map);
+  }
+  g_array_set_size(priv->chunks, 0);
+}
+
+/**
+ * Rebuilds outbuf as a chain of memories: the written bytes of its memory,
+ * up to size, interleaved with the shared regions of inbuf.
+ */
+static GstFlowReturn gst_h264_encryption_base_splice_shared_regions(
+    GstH264EncryptionBase *h264encryptionbase, GstBuffer *inbuf,
+    GstBuffer *outbuf, gsize size) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstMemory *written = gst_buffer_get_memory(outbuf, 0);
+  gsize written_offset = 0;
+  gst_buffer_remove_all_memory(outbuf);
+  for (guint i = 0; i < priv->shared_regions->len; i++) {
+    GstH264EncryptionSharedRegion *region = &g_array_index(
+        priv->shared_regions, GstH264EncryptionSharedRegion, i);
+    if (region->dest_offset > written_offset) {
+      gst_buffer_append_memory(
+          outbuf, gst_memory_share(written, written_offset,
+                                   region->dest_offset - written_offset));
+      written_offset = region->dest_offset;
+    }
+    if (G_UNLIKELY(!gst_buffer_copy_into(outbuf, inbuf, GST_BUFFER_COPY_MEMORY,
+                                         region->offset, region->size))) {
+      GST_ERROR_OBJECT(h264encryptionbase, "Unable to share input memory!");
+      gst_memory_unref(written);
+      return GST_FLOW_ERROR;
+    }
+  }
+  if (size > written_offset) {
+    gst_buffer_append_memory(outbuf, gst_memory_share(written, written_offset,
+                                                      size - written_offset));
+  }
+  gst_memory_unref(written);
+  GST_LOG_OBJECT(h264encryptionbase, "Shared %u regions of the input",
+                 priv->shared_regions->len);
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn gst_h264_encryption_base_transform(GstBaseTransform *base,
+                                                        GstBuffer *inbuf,
+                                                        GstBuffer *outbuf) {
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(base);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstMapInfo dest_map_info;
+
+  if (inbuf == outbuf) {
+    // Subclass chose to process the input buffer in place
+    return GST_BASE_TRANSFORM_GET_CLASS(base)->transform_ip(base, outbuf);
+  }
+  GST_DEBUG_OBJECT(h264encryptionbase, "A buffer is received");
+  priv->utils.pts = GST_BUFFER_PTS(inbuf);
+  if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_TIMESTAMP(inbuf)))
+    gst_object_sync_values(GST_OBJECT(h264encryptionbase),
+                           GST_BUFFER_TIMESTAMP(inbuf));
+  if (G_UNLIKELY(!gst_h264_encryption_base_map_chunks(h264encryptionbase,
+                                                      inbuf))) {
+    GST_ERROR_OBJECT(base, "Unable to map input buffer for read!");
+    return GST_FLOW_ERROR;
+  }
+  if (G_UNLIKELY(!gst_buffer_map(outbuf, &dest_map_info, GST_MAP_READWRITE))) {
+    GST_ERROR_OBJECT(base, "Unable to map output buffer for rw!");
+    gst_h264_encryption_base_unmap_chunks(h264encryptionbase);
+    return GST_FLOW_ERROR;
+  }
+  // Shared regions are spliced between parts of the single output memory
+  guint share_threshold =
+      gst_buffer_n_memory(outbuf) == 1 ? priv->share_threshold : 0;
+  size_t dest_offset = 0;
+  gboolean processed = gst_h264_encryption_base_process_au(
+      h264encryptionbase, (GstH264EncryptionChunk *)priv->chunks->data,
+      priv->chunks->len, &dest_map_info, &dest_offset, share_threshold);
+  gst_h264_encryption_base_end_au(h264encryptionbase);
+  gst_h264_encryption_base_unmap_chunks(h264encryptionbase);
+  gst_buffer_unmap(outbuf, &dest_map_info);
+  if (!processed) {
+    return GST_FLOW_ERROR;
+  }
+  if (priv->shared_regions->len > 0) {
+    return gst_h264_encryption_base_splice_shared_regions(
+        h264encryptionbase, inbuf, outbuf, dest_offset);
+  }
+  // Set size of the output buffer to "dest_offset" to discard
+  // unused but allocated bytes.
+  if (G_UNLIKELY(!gst_buffer_resize_range(outbuf, 0, -1, 0, dest_offset))) {
+    GST_ERROR_OBJECT(base, "Unable to set buffer size!");
+    return GST_FLOW_ERROR;
+  }
+  return GST_FLOW_OK;
+}
+
+/**
+ * Processes the access unit in place and shrinks the buffer to the result.
+ *
+ * Only valid for subclasses that never grow NAL units, see
+ * gst_h264_encryption_base_process_au. GstBaseTransform calls transform
+ * unless the element is always in place, so subclasses select this path by
+ * returning the input buffer from prepare_output_buffer.
+ */
+static GstFlowReturn gst_h264_encryption_base_transform_ip(
+    GstBaseTransform *base, GstBuffer *buf) {
+  GstH264EncryptionBase *h264encryptionbase = GST_H264_ENCRYPTION_BASE(base);
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GstH264EncryptionChunk chunk = {.offset = 0};
+
+  GST_DEBUG_OBJECT(h264encryptionbase, "A buffer is received for in place");
+  priv->utils.pts = GST_BUFFER_PTS(buf);
+  if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_TIMESTAMP(buf)))
+    gst_object_sync_values(GST_OBJECT(h264encryptionbase),
+                           GST_BUFFER_TIMESTAMP(buf));
+  if (G_UNLIKELY(!gst_buffer_map(buf, &chunk.map, GST_MAP_READWRITE))) {
+    GST_ERROR_OBJECT(base, "Unable to map buffer for rw!");
+    return GST_FLOW_ERROR;
+  }
+  size_t dest_offset = 0;
+  gboolean processed = gst_h264_encryption_base_process_au(
+      h264encryptionbase, &chunk, 1, &chunk.map, &dest_offset, 0);
+  gst_h264_encryption_base_end_au(h264encryptionbase);
+  gst_buffer_unmap(buf, &chunk.map);
+  if (!processed) {
+    return GST_FLOW_ERROR;
+  }
+  if (G_UNLIKELY(!gst_buffer_resize_range(buf, 0, -1, 0, dest_offset))) {
+    GST_ERROR_OBJECT(base, "Unable to set buffer size!");
+    return GST_FLOW_ERROR;
+  }
+  return GST_FLOW_OK;
+}
+
+/**
+ * Same as gst_h264_encryption_base_calculate_payload_offset_and_size for
+ * H.265 slice segments. Returns the size of the slice segment header in bytes
+ * and its slice_segment_address, or 0 if it cannot be parsed.
+ */
+static gsize gst_h264_encryption_base_parse_h265_slice_header(
+    GstH264EncryptionBase *encryption_base, GstH264NalUnit *nalu,
+    guint *slice_address) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH265NalUnit h265_nalu;
+  GstH265SliceHdr slice;
+  GstH265ParserResult result;
+  _h265_nal_unit_from_h264(nalu, &h265_nalu);
+  if ((result = gst_h265_parser_parse_slice_hdr(
+           priv->utils.h265parser, &h265_nalu, &slice)) != GST_H265_PARSER_OK) {
+    GST_ERROR_OBJECT(encryption_base, "Unable to parse slice header! Err: %d",
+                     (uint32_t)result);
+    return 0;
+  }
+  // Slice segment header ends byte aligned
+  gsize slice_header_size =
+      ((slice.header_size - 1) / 8 + 1) + slice.n_emulation_prevention_bytes;
+  *slice_address = slice.segment_address;
+  gst_h265_slice_hdr_free(&slice);
+  return slice_header_size;
+}
+
+/**
+ * Finds the slice data of the slice in nalu, which is encrypted, by parsing
+ * the slice header. slice_address is the first macroblock of H.264 slices
+ * and the first coding tree block of H.265 slice segments, which tells the
+ * slices of a picture apart.
+ */
+gboolean gst_h264_encryption_base_calculate_payload_offset_and_size(
+    GstH264EncryptionBase *encryption_base, GstH264NalUnit *nalu,
+    gsize *payload_offset, gsize *payload_size, guint *slice_address) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  gsize slice_header_size;
+  if (priv->utils.codec == GST_H264_ENCRYPTION_CODEC_H265) {
+    slice_header_size = gst_h264_encryption_base_parse_h265_slice_header(
+        encryption_base, nalu, slice_address);
+    if (slice_header_size == 0) {
+      return FALSE;
+    }
+  } else {
+    // Calculate payload offset and size
+    GstH264SliceHdr slice;
+    GstH264ParserResult parse_slice_hdr_result;
+    if ((parse_slice_hdr_result = gst_h264_parser_parse_slice_hdr(
+             priv->utils.nalparser, nalu, &slice, TRUE, TRUE)) !=
+        GST_H264_PARSER_OK) {
+      GST_ERROR_OBJECT(encryption_base,
+                       "Unable to parse slice header! Err: %d",
+                       (uint32_t)parse_slice_hdr_result);
+      return FALSE;
+    }
+    slice_header_size = ((slice.header_size - 1) / 8 + 1) +
+                        slice.n_emulation_prevention_bytes;
+    *slice_address = slice.first_mb_in_slice;
+  }
+  if (G_UNLIKELY(nalu->header_bytes + slice_header_size > nalu->size)) {
+    GST_ERROR_OBJECT(encryption_base, "Slice header exceeds the nal unit");
+    return FALSE;
+  }
+  *payload_offset = nalu->offset + nalu->header_bytes + slice_header_size;
+  *payload_size = nalu->size - nalu->header_bytes - slice_header_size;
+  return TRUE;
+}
+
+/**
+ * Sets the IV of the slice starting at slice_address, for streams whose
+ * slices have their own IV: the IV of the SEI, with slice_address XORed
+ * into its last 4 bytes, encrypted with the key. Slices of a picture start at
+ * different addresses, so their IVs differ and none depends on the others.
+ */
+void gst_h264_encryption_base_set_slice_iv(
+    GstH264EncryptionBase *encryption_base, guint slice_address) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  guint8 *iv = priv->utils.ctx.Iv;
+  memcpy(iv, priv->utils.iv, AES_BLOCKLEN);
+  for (guint i = 0; i < sizeof(guint32); i++) {
+    iv[AES_BLOCKLEN - 1 - i] ^= (slice_address >> (i * 8)) & 0xff;
+  }
+  AES_ECB_encrypt(&priv->utils.ctx, iv);
+}
+
+/**
+ * Makes the IV of the last IV SEI the IV of a new GOP, whose pictures derive
+ * their IV from it as told by the GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_* flags.
+ * Without them, every picture has to carry its own IV SEI.
+ */
+void gst_h264_encryption_base_start_gop(GstH264EncryptionBase *encryption_base,
+                                        guint8 flags) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  priv->utils.gop_flags = flags & GST_H264_ENCRYPT_IV_SEI_FLAGS_GOP;
+  memcpy(priv->utils.gop_iv, priv->utils.iv, AES_BLOCKLEN);
+  priv->utils.gop_pts = priv->utils.pts;
+  priv->utils.gop_frame = 0;
+  priv->utils.gop_lost = FALSE;
+}
+
+/**
+ * Sets the IV of the next picture of the GOP, which has no IV SEI: the IV of
+ * the GOP, with the index of the picture XORed into its bytes 8 to 11,
+ * encrypted with the key. The index is the count of pictures since the IV
+ * SEI, or the PTS since it in 90 kHz ticks, so that lost pictures do not
+ * change the IVs of the others.
+ *
+ * Returns FALSE if there is no GOP or the PTS is needed but unknown.
+ */
+gboolean gst_h264_encryption_base_next_frame_iv(
+    GstH264EncryptionBase *encryption_base) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264EncryptionUtils *utils = &priv->utils;
+  guint32 index;
+  switch (utils->gop_flags) {
+    case GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_COUNTER:
+      index = ++utils->gop_frame;
+      break;
+    case GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_PTS: {
+      if (!GST_CLOCK_TIME_IS_VALID(utils->pts) ||
+          !GST_CLOCK_TIME_IS_VALID(utils->gop_pts)) {
+        return FALSE;
+      }
+      // Pictures may precede the keyframe in presentation order
+      GstClockTimeDiff diff = GST_CLOCK_DIFF(utils->gop_pts, utils->pts);
+      guint64 ticks = gst_util_uint64_scale_round(ABS(diff), 90000, GST_SECOND);
+      index = (guint32)(diff < 0 ? -ticks : ticks);
+      break;
+    }
+    default:
+      return FALSE;
+  }
+  memcpy(utils->iv, utils->gop_iv, AES_BLOCKLEN);
+  for (guint i = 0; i < sizeof(guint32); i++) {
+    utils->iv[AES_BLOCKLEN - 5 - i] ^= (index >> (i * 8)) & 0xff;
+  }
+  AES_ECB_encrypt(&utils->ctx, utils->iv);
+  memcpy(utils->ctx.Iv, utils->iv, AES_BLOCKLEN);
+  GST_LOG_OBJECT(encryption_base, "IV of picture %u of the GOP is derived",
+                 index);
+  return TRUE;
+}
+
+/**
+ * Returns the threads slices are encrypted or decrypted with, the streaming
+ * thread included.
+ */
+guint gst_h264_encryption_base_get_threads(
+    GstH264EncryptionBase *encryption_base) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  return priv->threads > 0 ? priv->threads : g_get_num_processors();
+}
+
+static void gst_h264_encryption_base_run_task_set(
+    GstH264EncryptionTaskSet *set) {
+  guint i;
+  while ((i = g_atomic_int_add(&set->next_task, 1)) < set->n_tasks) {
+    set->func(&set->tasks[i * set->task_size], set->user_data);
+  }
+}
+
+static void gst_h264_encryption_base_task_worker(gpointer data,
+                                                 gpointer user_data) {
+  GstH264EncryptionTaskSet *set = data;
+  gst_h264_encryption_base_run_task_set(set);
+  g_mutex_lock(&set->lock);
+  if (--set->running == 0) {
+    g_cond_signal(&set->done);
+  }
+  g_mutex_unlock(&set->lock);
+}
+
+/**
+ * Calls func on each of the n_tasks tasks of task_size bytes at tasks, on the
+ * streaming thread and the workers of the element together, and returns once
+ * all are done. Tasks must not touch the same bytes.
+ */
+void gst_h264_encryption_base_run_tasks(GstH264EncryptionBase *encryption_base,
+                                        GstH264EncryptionTaskFunc func,
+                                        gpointer tasks, guint n_tasks,
+                                        gsize task_size, gpointer user_data) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  guint threads = gst_h264_encryption_base_get_threads(encryption_base);
+  guint n_workers = n_tasks > 0 ? MIN(threads, n_tasks) - 1 : 0;
+  GstH264EncryptionTaskSet set = {
+      .func = func,
+      .tasks = tasks,
+      .n_tasks = n_tasks,
+      .task_size = task_size,
+      .user_data = user_data,
+      .next_task = 0,
+      .running = n_workers,
+  };
+  if (n_workers == 0) {
+    gst_h264_encryption_base_run_task_set(&set);
+    return;
+  }
+  if (priv->task_pool == NULL) {
+    // Not exclusive, so idle threads are shared with other instances
+    priv->task_pool = g_thread_pool_new(gst_h264_encryption_base_task_worker,
+                                        NULL, threads - 1, FALSE, NULL);
+  }
+  g_mutex_init(&set.lock);
+  g_cond_init(&set.done);
+  for (guint i = 0; i < n_workers; i++) {
+    g_thread_pool_push(priv->task_pool, &set, NULL);
+  }
+  gst_h264_encryption_base_run_task_set(&set);
+  g_mutex_lock(&set.lock);
+  while (set.running > 0) {
+    g_cond_wait(&set.done, &set.lock);
+  }
+  g_mutex_unlock(&set.lock);
+  g_cond_clear(&set.done);
+  g_mutex_clear(&set.lock);
+}
+
+/**
+ * Decrypts size bytes of data, a multiple of AES_BLOCKLEN, continuing the
+ * cipher state of the access unit as _decrypt_blocks does.
+ *
+ * With more than one thread, only the last block is decrypted right away, so
+ * that its padding can be removed, and the cipher state is advanced past
+ * data. The other blocks are decrypted by all threads at
+ * gst_h264_encryption_base_end_au, so data must stay in place until then.
+ * They are split into parts of CIPHER_CHUNK_SIZE, which every mode can
+ * decrypt on their own: CTR parts start from the counter advanced by the
+ * blocks before them, and CBC parts from the ciphertext block before them,
+ * saved here before any part is decrypted.
+ */
+void gst_h264_encryption_base_decrypt_blocks(
+    GstH264EncryptionBase *encryption_base, guint8 *data, gsize size) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(encryption_base);
+  GstH264EncryptionUtils *utils = &priv->utils;
+  if (size < 2 * AES_BLOCKLEN ||
+      gst_h264_encryption_base_get_threads(encryption_base) < 2) {
+    _decrypt_blocks(utils, data, size);
+    return;
+  }
+  gsize deferred_size = size - AES_BLOCKLEN;
+  guint8 *last_block = &data[deferred_size];
+  for (gsize offset = 0; offset < deferred_size; offset += CIPHER_CHUNK_SIZE) {
+    GstH264EncryptionCipherTask task = {
+        .ctx = utils->ctx,
+        .encryption_mode = utils->encryption_mode,
+        .data = &data[offset],
+        .size = MIN(CIPHER_CHUNK_SIZE, deferred_size - offset),
+    };
+    if (utils->encryption_mode == GST_H264_ENCRYPTION_MODE_AES_CTR) {
+      _advance_counter(task.ctx.Iv, offset / AES_BLOCKLEN);
+    } else if (utils->encryption_mode == GST_H264_ENCRYPTION_MODE_AES_CBC &&
+               offset > 0) {
+      memcpy(task.ctx.Iv, &data[offset - AES_BLOCKLEN], AES_BLOCKLEN);
+    }
+    g_array_append_val(priv->cipher_tasks, task);
+  }
+  switch (utils->encryption_mode) {
+    case GST_H264_ENCRYPTION_MODE_AES_CTR:
+      _advance_counter(utils->ctx.Iv, deferred_size / AES_BLOCKLEN);
+      break;
+    case GST_H264_ENCRYPTION_MODE_AES_CBC:
+      // The last block is chained to the ciphertext before it, which is only
+      // decrypted later
+      memcpy(utils->ctx.Iv, last_block - AES_BLOCKLEN, AES_BLOCKLEN);
+      break;
+    case GST_H264_ENCRYPTION_MODE_AES_ECB:
+      break;
+  }
+  _decrypt_blocks(utils, last_block, AES_BLOCKLEN);
+}
+
+/**
+ * Estimates the bytes held by the instance alone. Parsers leased in compact
+ * mode are shared and not counted, so this is no measure of what compact mode
+ * saves; scripts/measure_rss.sh measures that. Pooled output buffers are
+ * counted up to the minimum the pool keeps.
+ */
+static guint64 gst_h264_encryption_base_get_memory_footprint(
+    GstH264EncryptionBase *h264encryptionbase) {
+  GstH264EncryptionBasePrivate *priv =
+      gst_h264_encryption_base_get_instance_private(h264encryptionbase);
+  GTypeQuery query;
+  g_type_query(G_OBJECT_TYPE(h264encryptionbase), &query);
+  guint64 bytes = query.instance_size + sizeof(GstH264EncryptionBasePrivate);
+  if (priv->utils.nalparser && !priv->compact) {
+    bytes += sizeof(GstH264NalParser);
+  }
+  if (priv->utils.h265parser) {
+    bytes += sizeof(GstH265Parser);
+  }
+  for (guint i = 0; i < priv->parameter_sets->len; i++) {
+    GstH264EncryptionParameterSet *parameter_set = &g_array_index(
+        priv->parameter_sets, GstH264EncryptionParameterSet, i);
+    bytes += sizeof(*parameter_set) + g_bytes_get_size(parameter_set->nal);
+  }
+  // Key schedules are shared with every instance using the same key
+  bytes += priv->keyring->len * sizeof(GstH264EncryptionKeyringEntry);
+  bytes += priv->cipher_tasks->len * sizeof(GstH264EncryptionCipherTask);
+  bytes += priv->utils.nal_table->len * sizeof(GstH264EncryptionNalEntry) +
+           priv->shared_regions->len * sizeof(GstH264EncryptionSharedRegion) +
+           priv->scratch->len + gst_adapter_available(priv->adapter);
+  GstBufferPool *pool = gst_base_transform_get_buffer_pool(
+      GST_BASE_TRANSFORM(h264encryptionbase));
+  if (pool != NULL) {
+    if (gst_buffer_pool_is_active(pool)) {
+      GstStructure *config = gst_buffer_pool_get_config(pool);
+      guint size, min_buffers;
+      if (gst_buffer_pool_config_get_params(config, NULL, &size, &min_buffers,
+                                            NULL)) {
+        bytes += (guint64)size * min_buffers;
+      }
+      gst_structure_free(config);
+    }
+    gst_object_unref(pool);
+  }
+  return bytes;
 }
 
 GstH264EncryptionUtils *gst_h264_encryption_base_get_encryption_utils(
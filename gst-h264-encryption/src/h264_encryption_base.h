@@ -28,6 +28,7 @@
 #include <gst/gst.h>
 
 #include "ciphers/aes.h"
+#include "h264_encryption_codec.h"
 #include "h264_encryption_mode.h"
 #include "h264_encryption_types.h"
 
@@ -46,10 +47,39 @@ G_BEGIN_DECLS
 #define IS_SLICE_NALU(nalu_type) \
   (nalu_type >= GST_H264_NAL_SLICE && nalu_type <= GST_H264_NAL_SLICE_IDR)
 
+/*
+ * Declares type structure as with derivable/final declares but does not define
+ * class or instance structures.
+ * See G_DECLARE_FINAL_TYPE and/or G_DECLARE_FINAL_TYPE for details.
+ */
+#define G_DECLARE_TYPE_STRUCTURES(ModuleObjName, module_obj_name, MODULE,     \
+                                  OBJ_NAME, ParentName)                       \
+  GType module_obj_name##_get_type(void);                                     \
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS                                            \
+  typedef struct _##ModuleObjName ModuleObjName;                              \
+  typedef struct _##ModuleObjName##Class ModuleObjName##Class;                \
+                                                                              \
+  _GLIB_DEFINE_AUTOPTR_CHAINUP(ModuleObjName, ParentName)                     \
+  G_DEFINE_AUTOPTR_CLEANUP_FUNC(ModuleObjName##Class, g_type_class_unref)     \
+                                                                              \
+  G_GNUC_UNUSED static inline ModuleObjName *MODULE##_##OBJ_NAME(             \
+      gpointer ptr) {                                                         \
+    return G_TYPE_CHECK_INSTANCE_CAST(ptr, module_obj_name##_get_type(),      \
+                                      ModuleObjName);                         \
+  }                                                                           \
+  G_GNUC_UNUSED static inline gboolean MODULE##_IS_##OBJ_NAME(gpointer ptr) { \
+    return G_TYPE_CHECK_INSTANCE_TYPE(ptr, module_obj_name##_get_type());     \
+  }                                                                           \
+  G_GNUC_END_IGNORE_DEPRECATIONS
+
 #define GST_TYPE_H264_ENCRYPTION_BASE (gst_h264_encryption_base_get_type())
 G_DECLARE_DERIVABLE_TYPE(GstH264EncryptionBase, gst_h264_encryption_base, GST,
                          H264_ENCRYPTION_BASE, GstBaseTransform)
 
+/*
+ * NAL units are given to subclasses as GstH264NalUnit whatever the codec. For
+ * H.265, only their location, type and header_bytes are set.
+ */
 typedef void (*enter_base_transform_func)(
     GstH264EncryptionBase *encryption_base);
 typedef gboolean (*before_nalu_copy_func)(
@@ -65,13 +95,30 @@ struct _GstH264EncryptionBaseClass {
   enter_base_transform_func enter_base_transform;
   before_nalu_copy_func before_nalu_copy;
   process_slice_nalu_func process_slice_nalu;
-  gpointer padding[6];
+
+  // Codec of the NAL units, set by subclasses before instances are created
+  GstH264EncryptionCodec codec;
+
+  /* Action signals */
+  gboolean (*add_key)(GstH264EncryptionBase *encryption_base, guint key_id,
+                      GstEncryptionKey *key);
+  gboolean (*remove_key)(GstH264EncryptionBase *encryption_base,
+                         guint key_id);
+
+  gpointer padding[3];
 };
 // GstH264EncryptionBase *    gst_h264_encryption_base_new(void);
 
+GstFlowReturn gst_h264_encryption_base_allocate_output_buffer(
+    GstH264EncryptionBase *encryption_base, GstBuffer *input, gsize size,
+    GstBuffer **outbuf);
+
+GstFlowReturn gst_h264_encryption_base_push(
+    GstH264EncryptionBase *encryption_base, GstBuffer *buffer);
+
 gboolean gst_h264_encryption_base_calculate_payload_offset_and_size(
-    GstH264EncryptionBase *encryption_base, GstH264NalParser *nalparser,
-    GstH264NalUnit *nalu, gsize *payload_offset, gsize *payload_size);
+    GstH264EncryptionBase *encryption_base, GstH264NalUnit *nalu,
+    gsize *payload_offset, gsize *payload_size, guint *slice_address);
 
 G_END_DECLS
 
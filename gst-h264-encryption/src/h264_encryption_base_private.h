@@ -27,6 +27,8 @@
 
 #include "ciphers/aes.h"
 #include "h264_encryption_base.h"
+#include "h264_encryption_plugin.h"
+#include "h264_key_schedule_cache.h"
 
 G_BEGIN_DECLS
 
@@ -34,18 +36,345 @@ enum {
   PROP_0,
   PROP_ENCRYPTION_MODE,
   PROP_KEY,
+  PROP_SHARE_THRESHOLD,
+  PROP_COMPACT,
+  PROP_IDLE_TIMEOUT,
+  PROP_MEMORY_FOOTPRINT,
+  PROP_THREADS,
   PROP_LAST,
 };
 
+/**
+ * Location of a NAL unit inside a mapped access unit, as recorded by
+ * gst_h264_encryption_base_scan_chunks.
+ */
+typedef struct GstH264EncryptionNalEntry {
+  guint sc_offset;  // Offset of the start code or length prefix
+  guint offset;     // Offset of the NAL unit header
+  guint size;       // Size from the header on, trailing zero bytes excluded
+  guint8 type;
+} GstH264EncryptionNalEntry;
+
 typedef struct GstH264EncryptionUtils {
+  GstH264EncryptionCodec codec;
+  // Parser of the codec, the other one is NULL
   GstH264NalParser *nalparser;
+  GstH265Parser *h265parser;
+  // Taken from the last published GstH264EncryptionConfig at access unit
+  // boundaries. ctx holds the round keys of keyring entry key_id, if keyed.
   GstH264EncryptionMode encryption_mode;
-  GstEncryptionKey *key;
+  guint8 key_id;
+  gboolean keyed;
   struct AES_ctx ctx;
+  // NAL units of the access unit being processed, reused between buffers
+  GArray *nal_table;
+  // Bytes of the NAL unit length prefix for avc/avc3, 0 for byte-stream
+  guint nal_length_size;
+  // IV of the last IV SEI, and whether slices derive their own IV from it
+  guint8 iv[AES_BLOCKLEN];
+  gboolean slice_iv;
+  // Timestamp of the access unit being processed
+  GstClockTime pts;
+  // IV SEI starting the GOP, for pictures that derive their IV from it:
+  // GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_* or 0, its IV, timestamp and pictures
+  guint8 gop_flags;
+  guint8 gop_iv[AES_BLOCKLEN];
+  GstClockTime gop_pts;
+  guint32 gop_frame;
+  // A GOP was forgotten on a discontinuity, so pictures without IV SEI may
+  // belong to it until the next IV SEI
+  gboolean gop_lost;
 } GstH264EncryptionUtils;
 
-size_t _copy_memory_bytes(GstMapInfo *dest_map_info, GstMapInfo *src_map_info,
-                          size_t *dest_offset, size_t src_offset, size_t size);
+/**
+ * Key of the keyring, expanded once for every instance using it. The same
+ * round keys serve encryption and decryption.
+ */
+typedef struct GstH264EncryptionKeyringEntry {
+  guint8 key_id;
+  GstH264KeySchedule *schedule;
+} GstH264EncryptionKeyringEntry;
+
+/**
+ * Keyring and mode built when the key, mode or keyring changes, and
+ * published to the streaming thread, which takes them at the next access
+ * unit. Never changed once published.
+ */
+typedef struct GstH264EncryptionConfig {
+  GstH264EncryptionMode encryption_mode;
+  guint n_keys;
+  GstH264EncryptionKeyringEntry keys[];
+} GstH264EncryptionConfig;
+
+/**
+ * Part of an access unit that is mapped on its own, such as one memory of a
+ * multi-memory buffer.
+ */
+typedef struct GstH264EncryptionChunk {
+  GstMapInfo map;
+  gsize offset;  // Offset of the chunk in the access unit
+} GstH264EncryptionChunk;
+
+void gst_h264_encryption_base_scan_chunks(GstH264EncryptionCodec codec,
+                                          const GstH264EncryptionChunk *chunks,
+                                          guint n_chunks, GArray *nal_table);
+
+void gst_h264_encryption_base_scan_avc_chunks(
+    GstH264EncryptionCodec codec, const GstH264EncryptionChunk *chunks,
+    guint n_chunks, guint nal_length_size, GArray *nal_table);
+
+gboolean gst_h264_encryption_base_write_nal_length(guint8 *prefix,
+                                                   guint nal_length_size,
+                                                   gsize size);
+
+gboolean gst_h264_encryption_base_begin_au(
+    GstH264EncryptionBase *encryption_base, const guint8 *data, gsize size);
+
+void gst_h264_encryption_base_end_au(GstH264EncryptionBase *encryption_base);
+
+void gst_h264_encryption_base_parse_parameter_set(
+    GstH264EncryptionBase *encryption_base, const guint8 *data, gsize size);
+
+gboolean gst_h264_encryption_base_identify_nalu(
+    GstH264EncryptionBase *encryption_base, const guint8 *data,
+    gsize data_offset, guint index, GstH264NalUnit *nalu);
+
+void gst_h264_encryption_base_set_slice_iv(
+    GstH264EncryptionBase *encryption_base, guint slice_address);
+
+void gst_h264_encryption_base_start_gop(GstH264EncryptionBase *encryption_base,
+                                        guint8 flags);
+
+gboolean gst_h264_encryption_base_next_frame_iv(
+    GstH264EncryptionBase *encryption_base);
+
+gboolean gst_h264_encryption_base_select_key(
+    GstH264EncryptionBase *encryption_base, guint8 key_id);
+
+// Payloads larger than this are split into parts of this size, a multiple of
+// AES_BLOCKLEN, for the threads of the element, where the cipher mode allows
+#define CIPHER_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Work item of gst_h264_encryption_base_run_tasks, called with a task and the
+ * user_data given there.
+ */
+typedef void (*GstH264EncryptionTaskFunc)(gpointer task, gpointer user_data);
+
+guint gst_h264_encryption_base_get_threads(
+    GstH264EncryptionBase *encryption_base);
+
+void gst_h264_encryption_base_run_tasks(GstH264EncryptionBase *encryption_base,
+                                        GstH264EncryptionTaskFunc func,
+                                        gpointer tasks, guint n_tasks,
+                                        gsize task_size, gpointer user_data);
+
+void gst_h264_encryption_base_decrypt_blocks(
+    GstH264EncryptionBase *encryption_base, guint8 *data, gsize size);
+
+// NAL header, payload type, payload size and UUID
+#define IV_SEI_SIGNATURE_SIZE(codec) \
+  (NAL_HEADER_SIZE(codec) + 2 + sizeof(GST_H264_ENCRYPT_IV_SEI_UUID) - 1)
+// Signature, IV and rbsp trailing bits
+#define IV_SEI_NALU_SIZE(codec) (IV_SEI_SIGNATURE_SIZE(codec) + AES_BLOCKLEN + 1)
+// Bytes after the IV: none, flags, or flags and key ID
+#define IV_SEI_MAX_EXTRA_SIZE 2
+// Longest IV SEI, the H.265 one with a 4 byte start code, flags and key ID,
+// and at most one emulation prevention byte for every two payload bytes
+#define IV_SEI_MAX_SIZE                                           \
+  (4 + IV_SEI_SIGNATURE_SIZE(GST_H264_ENCRYPTION_CODEC_H265) + \
+   (AES_BLOCKLEN + IV_SEI_MAX_EXTRA_SIZE) * 3 / 2 + 1)
+
+/**
+ * Returns the signature of the IV SEI of codec with extra_size bytes after
+ * the IV.
+ */
+static inline const guint8 *_iv_sei_signature(GstH264EncryptionCodec codec,
+                                              guint extra_size) {
+  static const char *const signatures[][IV_SEI_MAX_EXTRA_SIZE + 1] = {
+      {GST_H264_ENCRYPT_IV_SEI_SIGNATURE,
+       GST_H264_ENCRYPT_IV_SEI_FLAGS_SIGNATURE,
+       GST_H264_ENCRYPT_IV_SEI_KEY_ID_SIGNATURE},
+      {GST_H265_ENCRYPT_IV_SEI_SIGNATURE,
+       GST_H265_ENCRYPT_IV_SEI_FLAGS_SIGNATURE,
+       GST_H265_ENCRYPT_IV_SEI_KEY_ID_SIGNATURE},
+  };
+  return (const guint8 *)
+      signatures[codec == GST_H264_ENCRYPTION_CODEC_H265][extra_size];
+}
+
+/**
+ * Whether the size bytes of nal, from the NAL unit header on, start with the
+ * signature of the IV SEI, and the number of bytes after its IV in
+ * extra_size. The signature has no zero bytes, so it is never escaped. Layer
+ * and temporal ids of H.265 headers are not compared.
+ */
+static inline gboolean _is_iv_sei(GstH264EncryptionCodec codec,
+                                  const guint8 *nal, gsize size,
+                                  guint *extra_size) {
+  const guint8 *signature = _iv_sei_signature(codec, 0);
+  guint header_size = NAL_HEADER_SIZE(codec);
+  if (size < IV_SEI_SIGNATURE_SIZE(codec) || nal[0] != signature[0] ||
+      nal[header_size] != signature[header_size] ||
+      memcmp(&nal[header_size + 2], &signature[header_size + 2],
+             IV_SEI_SIGNATURE_SIZE(codec) - header_size - 2) != 0) {
+    return FALSE;
+  }
+  // SEI payload size follows the NAL unit header and payload type
+  *extra_size = nal[header_size + 1] - signature[header_size + 1];
+  return nal[header_size + 1] >= signature[header_size + 1] &&
+         *extra_size <= IV_SEI_MAX_EXTRA_SIZE;
+}
+
+/**
+ * Reads the IV, flags and key ID of the IV SEI at nal, free of emulation
+ * prevention bytes, which has extra_size bytes after its IV. Flags and key ID
+ * the SEI does not carry are 0.
+ */
+static inline void _read_iv_sei_payload(GstH264EncryptionCodec codec,
+                                        const guint8 *nal, guint extra_size,
+                                        guint8 *iv, guint8 *flags,
+                                        guint8 *key_id) {
+  const guint8 *payload = &nal[IV_SEI_SIGNATURE_SIZE(codec)];
+  memcpy(iv, payload, AES_BLOCKLEN);
+  *flags = extra_size > 0 ? payload[AES_BLOCKLEN] : 0;
+  *key_id = extra_size > 1 ? payload[AES_BLOCKLEN + 1] : 0;
+}
+
+/**
+ * Reads the IV, flags and key ID of the IV SEI whose NAL unit header is at
+ * header and whose size bytes after the header are at data, removing
+ * emulation prevention bytes. Returns FALSE if it is not an IV SEI made of
+ * the IV message only.
+ */
+static inline gboolean _read_iv_sei(GstH264EncryptionCodec codec,
+                                    const guint8 *header, const guint8 *data,
+                                    gsize size, guint8 *iv, guint8 *flags,
+                                    guint8 *key_id) {
+  guint8 rbsp[IV_SEI_NALU_SIZE(GST_H264_ENCRYPTION_CODEC_H265) +
+              IV_SEI_MAX_EXTRA_SIZE];
+  gsize rbsp_size = NAL_HEADER_SIZE(codec);
+  guint32 state = 0xffffffff;
+  guint extra_size;
+
+  memcpy(rbsp, header, rbsp_size);
+  for (gsize i = 0; i < size; i++) {
+    state = (state << 8) | data[i];
+    if ((state & 0x00ffffff) == 0x00000003) {
+      // Skip emulation prevention byte and reset state
+      state = 0xffffffff;
+      continue;
+    }
+    if (rbsp_size == IV_SEI_NALU_SIZE(codec) + IV_SEI_MAX_EXTRA_SIZE) {
+      return FALSE;
+    }
+    rbsp[rbsp_size++] = data[i];
+  }
+  if (!_is_iv_sei(codec, rbsp, rbsp_size, &extra_size) ||
+      rbsp_size != IV_SEI_NALU_SIZE(codec) + extra_size ||
+      rbsp[rbsp_size - 1] != 0x80) {
+    return FALSE;
+  }
+  _read_iv_sei_payload(codec, rbsp, extra_size, iv, flags, key_id);
+  return TRUE;
+}
+
+/**
+ * Encrypts size bytes of data, a multiple of AES_BLOCKLEN, continuing the
+ * cipher state in ctx.
+ */
+static inline void _encrypt_ctx_blocks(GstH264EncryptionMode encryption_mode,
+                                       struct AES_ctx *ctx, uint8_t *data,
+                                       size_t size) {
+  switch (encryption_mode) {
+    case GST_H264_ENCRYPTION_MODE_AES_CTR:
+      AES_CTR_xcrypt_buffer(ctx, data, size);
+      break;
+    case GST_H264_ENCRYPTION_MODE_AES_CBC:
+      AES_CBC_encrypt_buffer(ctx, data, size);
+      break;
+    case GST_H264_ENCRYPTION_MODE_AES_ECB:
+      for (size_t i = 0; i < size; i += AES_BLOCKLEN) {
+        AES_ECB_encrypt(ctx, &data[i]);
+      }
+      break;
+  }
+}
+
+/**
+ * Decrypts size bytes of data, a multiple of AES_BLOCKLEN, continuing the
+ * cipher state in ctx.
+ */
+static inline void _decrypt_ctx_blocks(GstH264EncryptionMode encryption_mode,
+                                       struct AES_ctx *ctx, uint8_t *data,
+                                       size_t size) {
+  switch (encryption_mode) {
+    case GST_H264_ENCRYPTION_MODE_AES_CTR:
+      AES_CTR_xcrypt_buffer(ctx, data, size);
+      break;
+    case GST_H264_ENCRYPTION_MODE_AES_CBC:
+      AES_CBC_decrypt_buffer(ctx, data, size);
+      break;
+    case GST_H264_ENCRYPTION_MODE_AES_ECB:
+      for (size_t i = 0; i < size; i += AES_BLOCKLEN) {
+        AES_ECB_decrypt(ctx, &data[i]);
+      }
+      break;
+  }
+}
+
+/**
+ * Encrypts size bytes of data, a multiple of AES_BLOCKLEN, continuing the
+ * cipher state of the access unit.
+ */
+static inline void _encrypt_blocks(GstH264EncryptionUtils *utils,
+                                   uint8_t *data, size_t size) {
+  _encrypt_ctx_blocks(utils->encryption_mode, &utils->ctx, data, size);
+}
+
+/**
+ * Decrypts size bytes of data, a multiple of AES_BLOCKLEN, continuing the
+ * cipher state of the access unit.
+ */
+static inline void _decrypt_blocks(GstH264EncryptionUtils *utils,
+                                   uint8_t *data, size_t size) {
+  _decrypt_ctx_blocks(utils->encryption_mode, &utils->ctx, data, size);
+}
+
+/**
+ * Advances the big endian AES-CTR counter by blocks, as encrypting that many
+ * blocks would.
+ */
+static inline void _advance_counter(uint8_t *counter, guint64 blocks) {
+  for (gint i = AES_BLOCKLEN - 1; i >= 0 && blocks > 0; i--) {
+    blocks += counter[i];
+    counter[i] = blocks & 0xff;
+    blocks >>= 8;
+  }
+}
+
+/**
+ * Removes the padding if exists and returns padding byte count, 0 if a byte
+ * other than the padding ones is found first.
+ *
+ * Assumes data is padded at byte level, so it does not check individual bits.
+ */
+static inline gint _remove_padding(uint8_t *data, size_t size) {
+  for (int i = size - 1; i >= 0; i--) {
+    switch (data[i]) {
+      case 0:
+        continue;
+      case 0x80: {
+        data[i] = 0;
+        return size - i;
+      }
+      default:
+        return 0;
+    }
+  }
+  // All zeros, not found
+  return 0;
+}
 
 size_t _copy_nalu_bytes(GstMapInfo *dest_map_info, GstH264NalUnit *nalu,
                         size_t *dest_offset);
@@ -0,0 +1,170 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_H264_ENCRYPTION_CODEC_H__
+#define __GST_H264_ENCRYPTION_CODEC_H__
+
+#include <gst/codecparsers/gsth264parser.h>
+#include <gst/codecparsers/gsth265parser.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Video codec of the NAL units an element processes. H.264 and H.265 share
+ * start codes, length prefixes, emulation prevention and SEI messages, only
+ * their NAL unit headers and types differ.
+ */
+typedef enum {
+  GST_H264_ENCRYPTION_CODEC_H264,
+  GST_H264_ENCRYPTION_CODEC_H265,
+} GstH264EncryptionCodec;
+
+// Bytes of the NAL unit header, a constant expression for a constant codec
+#define NAL_HEADER_SIZE(codec) \
+  ((codec) == GST_H264_ENCRYPTION_CODEC_H265 ? 2 : 1)
+
+/**
+ * Returns the type of the NAL unit whose header is at header.
+ */
+static inline guint8 _nal_type(GstH264EncryptionCodec codec,
+                               const guint8 *header) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return (header[0] >> 1) & 0x3f;
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return header[0] & 0x1f;
+  }
+}
+
+static inline gboolean _is_slice_type(GstH264EncryptionCodec codec,
+                                      guint type) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return type <= GST_H265_NAL_SLICE_CRA_NUT;
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return type >= GST_H264_NAL_SLICE && type <= GST_H264_NAL_SLICE_IDR;
+  }
+}
+
+/**
+ * Whether slices of type start a random access point: IDR slices for H.264,
+ * IRAP ones for H.265.
+ */
+static inline gboolean _is_keyframe_type(GstH264EncryptionCodec codec,
+                                         guint type) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return type >= GST_H265_NAL_SLICE_BLA_W_LP &&
+             type <= GST_H265_NAL_SLICE_CRA_NUT;
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return type == GST_H264_NAL_SLICE_IDR;
+  }
+}
+
+/**
+ * Whether type is the SEI type the IV SEI is sent as, prefix SEI for H.265.
+ */
+static inline gboolean _is_sei_type(GstH264EncryptionCodec codec, guint type) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return type == GST_H265_NAL_PREFIX_SEI;
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return type == GST_H264_NAL_SEI;
+  }
+}
+
+/**
+ * Whether type is a parameter set slice headers refer to: SPS and PPS, and
+ * VPS for H.265.
+ */
+static inline gboolean _is_parameter_set_type(GstH264EncryptionCodec codec,
+                                              guint type) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return type == GST_H265_NAL_VPS || type == GST_H265_NAL_SPS ||
+             type == GST_H265_NAL_PPS;
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return type == GST_H264_NAL_SPS || type == GST_H264_NAL_PPS;
+  }
+}
+
+/**
+ * Whether type is an end of sequence or end of stream NAL unit, which is
+ * made of its header only.
+ */
+static inline gboolean _is_end_type(GstH264EncryptionCodec codec,
+                                    guint type) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return type == GST_H265_NAL_EOS || type == GST_H265_NAL_EOB;
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return type == GST_H264_NAL_SEQ_END || type == GST_H264_NAL_STREAM_END;
+  }
+}
+
+/**
+ * Whether a non-slice NAL unit of type following a slice starts the next
+ * access unit.
+ */
+static inline gboolean _starts_au_type(GstH264EncryptionCodec codec,
+                                       guint type) {
+  switch (codec) {
+    case GST_H264_ENCRYPTION_CODEC_H265:
+      return (type >= GST_H265_NAL_VPS && type <= GST_H265_NAL_AUD) ||
+             type == GST_H265_NAL_PREFIX_SEI || (type >= 41 && type <= 44) ||
+             (type >= 48 && type <= 55);
+    case GST_H264_ENCRYPTION_CODEC_H264:
+    default:
+      return type == GST_H264_NAL_AU_DELIMITER || type == GST_H264_NAL_SEI ||
+             type == GST_H264_NAL_SPS || type == GST_H264_NAL_PPS ||
+             (type >= 14 && type <= 18);
+  }
+}
+
+/**
+ * Whether the slice whose NAL unit header is at nal starts a picture. That is
+ * the first bit after the header for both codecs: first_mb_in_slice is a
+ * single 1 bit when 0 for H.264, and first_slice_segment_in_pic_flag is set
+ * for H.265.
+ */
+static inline gboolean _slice_starts_picture(GstH264EncryptionCodec codec,
+                                             const guint8 *nal) {
+  return (nal[NAL_HEADER_SIZE(codec)] & 0x80) != 0;
+}
+
+/**
+ * Media type of the elementary stream caps of codec.
+ */
+static inline const gchar *_codec_caps_name(GstH264EncryptionCodec codec) {
+  return codec == GST_H264_ENCRYPTION_CODEC_H265 ? "video/x-h265"
+                                                 : "video/x-h264";
+}
+
+G_END_DECLS
+
+#endif /* __GST_H264_ENCRYPTION_CODEC_H__ */
@@ -52,6 +52,11 @@
 #include "h264_decrypt.h"
 #include "h264_encrypt.h"
 #include "h264_encryption_plugin.h"
+#include "h265_decrypt.h"
+#include "h265_encrypt.h"
+#include "rtp_h264_decrypt.h"
+#include "rtp_h264_encrypt.h"
+#include "ts_h264_encrypt.h"
 
 // GST_DEBUG_CATEGORY_STATIC(gst_plugin_template_debug);
 // #define GST_CAT_DEFAULT gst_plugin_template_debug
@@ -75,7 +80,12 @@ static gboolean h264encryption_init(GstPlugin *h264encryption) {
   GST_DEBUG_CATEGORY_INIT(GST_H264_ENCRYPTION, "GST_H264_ENCRYPTION", 0,
                           "GstH264Encryption general logs");
   gboolean result = GST_ELEMENT_REGISTER(h264decrypt, h264encryption);
-  return result & GST_ELEMENT_REGISTER(h264encrypt, h264encryption);
+  result &= GST_ELEMENT_REGISTER(h264encrypt, h264encryption);
+  result &= GST_ELEMENT_REGISTER(h265decrypt, h264encryption);
+  result &= GST_ELEMENT_REGISTER(h265encrypt, h264encryption);
+  result &= GST_ELEMENT_REGISTER(rtph264decrypt, h264encryption);
+  result &= GST_ELEMENT_REGISTER(rtph264encrypt, h264encryption);
+  return result & GST_ELEMENT_REGISTER(tsh264encrypt, h264encryption);
 }
 
 /* gstreamer looks for this structure to register plugins
@@ -61,6 +61,49 @@ G_BEGIN_DECLS
  */
 #define GST_H264_ENCRYPT_IV_SEI_SIGNATURE \
   "\x06\x05\x20" GST_H264_ENCRYPT_IV_SEI_UUID
+/**
+ * IV SEI of streams encrypted slice by slice. Its payload is one byte longer:
+ * the IV is followed by a byte of GST_H264_ENCRYPT_IV_SEI_FLAG_* flags.
+ */
+#define GST_H264_ENCRYPT_IV_SEI_FLAGS_SIGNATURE \
+  "\x06\x05\x21" GST_H264_ENCRYPT_IV_SEI_UUID
+/**
+ * IV SEI that names the key of the slices it precedes: the flags byte is
+ * followed by a key ID byte, which makes the payload one byte longer again.
+ * IV SEI without it use key ID 0, the key property.
+ */
+#define GST_H264_ENCRYPT_IV_SEI_KEY_ID_SIGNATURE \
+  "\x06\x05\x22" GST_H264_ENCRYPT_IV_SEI_UUID
+/**
+ * Same SEI messages for H.265, in a prefix SEI with a two byte NAL unit
+ * header. The second header byte carries the layer and temporal ids, which
+ * the IV SEI takes from the NAL unit it precedes.
+ */
+#define GST_H265_ENCRYPT_IV_SEI_SIGNATURE \
+  "\x4e\x01\x05\x20" GST_H264_ENCRYPT_IV_SEI_UUID
+#define GST_H265_ENCRYPT_IV_SEI_FLAGS_SIGNATURE \
+  "\x4e\x01\x05\x21" GST_H264_ENCRYPT_IV_SEI_UUID
+#define GST_H265_ENCRYPT_IV_SEI_KEY_ID_SIGNATURE \
+  "\x4e\x01\x05\x22" GST_H264_ENCRYPT_IV_SEI_UUID
+/**
+ * Every slice has its own IV, derived from the IV of the SEI and the
+ * first_mb_in_slice of the slice, slice_segment_address for H.265, instead of
+ * continuing the cipher state of the previous slice. The IV SEI then only
+ * precedes slices starting a picture.
+ */
+#define GST_H264_ENCRYPT_IV_SEI_FLAG_SLICE_IV 0x01
+/**
+ * The IV SEI starts a GOP: pictures after it without an IV SEI of their own,
+ * until the next IV SEI, derive their IV from the IV of the SEI and their
+ * index in the GOP, see gst_h264_encryption_base_next_frame_iv. The index is
+ * counted in pictures with GOP_COUNTER and in 90 kHz ticks of the PTS since
+ * the SEI with GOP_PTS.
+ */
+#define GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_COUNTER 0x02
+#define GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_PTS 0x04
+#define GST_H264_ENCRYPT_IV_SEI_FLAGS_GOP \
+  (GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_COUNTER | \
+   GST_H264_ENCRYPT_IV_SEI_FLAG_GOP_PTS)
 
 G_END_DECLS
 
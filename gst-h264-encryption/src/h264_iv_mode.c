@@ -0,0 +1,25 @@
+#include "h264_iv_mode.h"
+
+#include <gst/gst.h>
+
+GType gst_h264_iv_mode_get_type(void) {
+  static GType h264_iv_mode_type = 0;
+  static const GEnumValue iv_modes[] = {
+      {GST_H264_IV_MODE_ACCESS_UNIT, "New IV in every access unit",
+       "access-unit"},
+      {GST_H264_IV_MODE_GOP_COUNTER,
+       "New IV on keyframes, other pictures derive theirs from their count "
+       "since the keyframe",
+       "gop-counter"},
+      {GST_H264_IV_MODE_GOP_PTS,
+       "New IV on keyframes, other pictures derive theirs from their PTS "
+       "since the keyframe",
+       "gop-pts"},
+      {0, NULL, NULL}};
+  if (g_once_init_enter(&h264_iv_mode_type)) {
+    GType setup_value = g_enum_register_static("GstH264IvMode", iv_modes);
+    g_once_init_leave(&h264_iv_mode_type, setup_value);
+  }
+
+  return h264_iv_mode_type;
+}
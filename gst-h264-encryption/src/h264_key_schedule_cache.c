@@ -0,0 +1,169 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * Process-wide cache of expanded keys.
+ *
+ * Instances sharing a key share its GstH264KeySchedule, so that keys are
+ * expanded and held once per key rather than once per instance. Schedules
+ * no instance uses are kept for a while, in least recently used order, so
+ * that a stream starting again with the same key does not expand it again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "h264_key_schedule_cache.h"
+
+#include <string.h>
+
+// Unused schedules kept before the least recently used one is freed
+#define MAX_UNUSED_SCHEDULES 32
+
+G_LOCK_DEFINE_STATIC(key_schedule_cache);
+// GstH264KeySchedule by key
+static GHashTable *key_schedules = NULL;
+// Unused schedules, most recently released last
+static GQueue unused_schedules = G_QUEUE_INIT;
+
+/**
+ * Fingerprint of a key for lookups, FNV-1a. Keys are compared in full on
+ * lookup, so collisions only cost a comparison.
+ */
+static guint _key_hash(const guint8 *key) {
+  guint hash = 2166136261u;
+  for (guint i = 0; i < AES_KEYLEN; i++) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static guint _schedule_hash(gconstpointer schedule) {
+  return ((const GstH264KeySchedule *)schedule)->hash;
+}
+
+/**
+ * AES key expansion starts with the key itself, so the round keys are
+ * compared instead of keeping another copy of the key.
+ */
+static gboolean _schedule_equal(gconstpointer a, gconstpointer b) {
+  const GstH264KeySchedule *schedule_a = a;
+  const GstH264KeySchedule *schedule_b = b;
+  return schedule_a->hash == schedule_b->hash &&
+         memcmp(schedule_a->round_key, schedule_b->round_key, AES_KEYLEN) == 0;
+}
+
+/**
+ * Called with the cache lock held. Schedules in use leave the unused queue.
+ */
+static void _schedule_ref_locked(GstH264KeySchedule *schedule) {
+  if (schedule->ref_count++ == 0 && schedule->unused_link != NULL) {
+    g_queue_delete_link(&unused_schedules, schedule->unused_link);
+    schedule->unused_link = NULL;
+  }
+}
+
+static void _schedule_free(GstH264KeySchedule *schedule) {
+  memset(schedule, 0, sizeof(*schedule));
+  g_free(schedule);
+}
+
+/**
+ * Returns a reference to the schedule of the AES_KEYLEN bytes of key,
+ * expanding it if no instance used it recently.
+ */
+GstH264KeySchedule *gst_h264_key_schedule_cache_get(const guint8 *key) {
+  GstH264KeySchedule lookup;
+  GstH264KeySchedule *schedule;
+
+  memcpy(lookup.round_key, key, AES_KEYLEN);
+  lookup.hash = _key_hash(key);
+  G_LOCK(key_schedule_cache);
+  if (key_schedules == NULL) {
+    key_schedules = g_hash_table_new(_schedule_hash, _schedule_equal);
+  }
+  schedule = g_hash_table_lookup(key_schedules, &lookup);
+  if (schedule != NULL) {
+    _schedule_ref_locked(schedule);
+    G_UNLOCK(key_schedule_cache);
+    memset(&lookup, 0, sizeof(lookup));
+    return schedule;
+  }
+  G_UNLOCK(key_schedule_cache);
+  memset(&lookup, 0, sizeof(lookup));
+
+  // Expanded outside of the lock, another instance may add the key meanwhile
+  struct AES_ctx ctx;
+  GstH264KeySchedule *expanded = g_new0(GstH264KeySchedule, 1);
+  AES_init_ctx(&ctx, key);
+  memcpy(expanded->round_key, ctx.RoundKey, sizeof(expanded->round_key));
+  memset(&ctx, 0, sizeof(ctx));
+  expanded->hash = _key_hash(key);
+  expanded->ref_count = 1;
+  expanded->unused_link = NULL;
+  G_LOCK(key_schedule_cache);
+  schedule = g_hash_table_lookup(key_schedules, expanded);
+  if (schedule != NULL) {
+    _schedule_ref_locked(schedule);
+  } else {
+    g_hash_table_add(key_schedules, expanded);
+  }
+  G_UNLOCK(key_schedule_cache);
+  if (schedule != NULL) {
+    _schedule_free(expanded);
+    return schedule;
+  }
+  return expanded;
+}
+
+GstH264KeySchedule *gst_h264_key_schedule_ref(GstH264KeySchedule *schedule) {
+  G_LOCK(key_schedule_cache);
+  _schedule_ref_locked(schedule);
+  G_UNLOCK(key_schedule_cache);
+  return schedule;
+}
+
+/**
+ * Releases a reference taken with gst_h264_key_schedule_cache_get. The
+ * schedule is kept while unused until MAX_UNUSED_SCHEDULES more recently
+ * released ones are.
+ */
+void gst_h264_key_schedule_unref(GstH264KeySchedule *schedule) {
+  GstH264KeySchedule *evicted = NULL;
+  if (schedule == NULL) {
+    return;
+  }
+  G_LOCK(key_schedule_cache);
+  if (--schedule->ref_count == 0) {
+    g_queue_push_tail(&unused_schedules, schedule);
+    schedule->unused_link = unused_schedules.tail;
+    if (unused_schedules.length > MAX_UNUSED_SCHEDULES) {
+      evicted = g_queue_pop_head(&unused_schedules);
+      evicted->unused_link = NULL;
+      g_hash_table_remove(key_schedules, evicted);
+    }
+  }
+  G_UNLOCK(key_schedule_cache);
+  if (evicted != NULL) {
+    _schedule_free(evicted);
+  }
+}
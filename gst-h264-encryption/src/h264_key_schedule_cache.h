@@ -0,0 +1,52 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_H264_KEY_SCHEDULE_CACHE_H__
+#define __GST_H264_KEY_SCHEDULE_CACHE_H__
+
+#include <gst/gst.h>
+
+#include "ciphers/aes.h"
+
+G_BEGIN_DECLS
+
+/**
+ * Round keys of a key, shared by every element instance using the key.
+ * Never changed once expanded.
+ */
+typedef struct GstH264KeySchedule {
+  guint8 round_key[AES_keyExpSize];
+  /*< private >*/
+  guint hash;
+  gint ref_count;
+  // Link in the queue of unused schedules, NULL while in use
+  GList *unused_link;
+} GstH264KeySchedule;
+
+GstH264KeySchedule *gst_h264_key_schedule_cache_get(const guint8 *key);
+
+GstH264KeySchedule *gst_h264_key_schedule_ref(GstH264KeySchedule *schedule);
+
+void gst_h264_key_schedule_unref(GstH264KeySchedule *schedule);
+
+G_END_DECLS
+
+#endif /* __GST_H264_KEY_SCHEDULE_CACHE_H__ */
@@ -0,0 +1,93 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * Process-wide pool of NAL parsers for compact mode.
+ *
+ * A GstH264NalParser holds every possible SPS and PPS, which dominates the
+ * memory of an element instance. Compact instances lease a parser for each
+ * access unit instead of owning one, so the number of parsers follows the
+ * number of streaming threads rather than the number of instances.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "h264_nal_parser_pool.h"
+
+G_LOCK_DEFINE_STATIC(parser_pool);
+// Released leases, most recently released last
+static GQueue parser_pool = G_QUEUE_INIT;
+static guint64 next_owner = 1;
+
+/**
+ * Returns a new identifier for an instance leasing parsers. Unlike instance
+ * pointers, identifiers are never reused.
+ */
+guint64 gst_h264_nal_parser_pool_new_owner(void) {
+  G_LOCK(parser_pool);
+  guint64 owner = next_owner++;
+  G_UNLOCK(parser_pool);
+  return owner;
+}
+
+/**
+ * Leases a parser, preferring the one owner released last so that its
+ * parameter sets need not be parsed again. A parser released by another owner
+ * is reset first, so it never holds parameter sets that are not owner's.
+ * Check lease->owner to know whether the parser holds owner's parameter sets.
+ */
+GstH264NalParserLease *gst_h264_nal_parser_pool_lease(guint64 owner) {
+  GstH264NalParserLease *lease = NULL;
+  G_LOCK(parser_pool);
+  for (GList *l = parser_pool.tail; l != NULL; l = l->prev) {
+    if (((GstH264NalParserLease *)l->data)->owner == owner) {
+      lease = l->data;
+      g_queue_delete_link(&parser_pool, l);
+      break;
+    }
+  }
+  if (lease == NULL) {
+    // Least recently released parser is the least likely to be wanted back
+    lease = g_queue_pop_head(&parser_pool);
+  }
+  G_UNLOCK(parser_pool);
+  if (lease == NULL) {
+    lease = g_new(GstH264NalParserLease, 1);
+    lease->parser = gst_h264_nal_parser_new();
+    lease->owner = 0;
+  } else if (lease->owner != owner) {
+    // Parser has no way to forget parameter sets, so replace it
+    gst_h264_nal_parser_free(lease->parser);
+    lease->parser = gst_h264_nal_parser_new();
+    lease->owner = 0;
+  }
+  return lease;
+}
+
+void gst_h264_nal_parser_pool_release(GstH264NalParserLease *lease,
+                                      guint64 owner) {
+  lease->owner = owner;
+  G_LOCK(parser_pool);
+  g_queue_push_tail(&parser_pool, lease);
+  G_UNLOCK(parser_pool);
+}
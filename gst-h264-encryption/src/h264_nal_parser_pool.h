@@ -0,0 +1,49 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_H264_NAL_PARSER_POOL_H__
+#define __GST_H264_NAL_PARSER_POOL_H__
+
+#include <gst/codecparsers/gsth264parser.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/**
+ * NAL parser shared by element instances, leased for one access unit at a
+ * time. owner is the instance whose parameter sets the parser holds, 0 if it
+ * holds none.
+ */
+typedef struct GstH264NalParserLease {
+  GstH264NalParser *parser;
+  guint64 owner;
+} GstH264NalParserLease;
+
+guint64 gst_h264_nal_parser_pool_new_owner(void);
+
+GstH264NalParserLease *gst_h264_nal_parser_pool_lease(guint64 owner);
+
+void gst_h264_nal_parser_pool_release(GstH264NalParserLease *lease,
+                                      guint64 owner);
+
+G_END_DECLS
+
+#endif /* __GST_H264_NAL_PARSER_POOL_H__ */
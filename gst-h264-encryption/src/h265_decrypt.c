@@ -0,0 +1,98 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-h265decrypt
+ *
+ * Decrypts H265 streams encrypted by h265encrypt, as h264decrypt does for
+ * H264 ones. byte-stream, hvc1 and hev1 stream formats are supported, with au
+ * or nal alignment.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 filesrc location=encrypted.h265 ! h265decrypt
+ * key=01020304050607080910111213141516 ! avdec_h265 ! autovideosink
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/base/base.h>
+#include <gst/gst.h>
+
+#include "h264_decrypt.h"
+#include "h264_encryption_base.h"
+#include "h265_decrypt.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_h265_decrypt_debug);
+#define GST_CAT_DEFAULT gst_h265_decrypt_debug
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
+    "sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS("video/x-h265,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,hvc1,hev1};"
+                    "video/x-h265,alignment=(string)none,"
+                    "stream-format=(string)byte-stream"));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
+    "src", GST_PAD_SRC, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS("video/x-h265,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,hvc1,hev1}"));
+
+#define gst_h265_decrypt_parent_class parent_class
+G_DEFINE_TYPE(GstH265Decrypt, gst_h265_decrypt, GST_TYPE_H264_DECRYPT);
+GST_ELEMENT_REGISTER_DEFINE(h265decrypt, "h265decrypt", GST_RANK_NONE,
+                            GST_TYPE_H265_DECRYPT);
+
+/* GObject vmethod implementations */
+
+/* initialize the h265decrypt's class */
+static void gst_h265_decrypt_class_init(GstH265DecryptClass *klass) {
+  GstElementClass *gstelement_class = (GstElementClass *)klass;
+  GstH264EncryptionBaseClass *gsth264encryptionbase_class =
+      (GstH264EncryptionBaseClass *)klass;
+
+  // The base creates an H265 parser and walks NAL units as H265 ones
+  gsth264encryptionbase_class->codec = GST_H264_ENCRYPTION_CODEC_H265;
+
+  gst_element_class_set_details_simple(
+      gstelement_class, "h265decrypt", "Codec/Encryption/Video",
+      "Decrypts H265 streams encrypted by h265encrypt.",
+      "Oguzhan Oztaskin <oguzhanoztaskin@gmail.com>");
+
+  // Templates of h264decrypt are replaced by the H265 ones
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&src_template));
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&sink_template));
+
+  GST_DEBUG_CATEGORY_INIT(gst_h265_decrypt_debug, "h265decrypt", 0,
+                          "h265decrypt general logs");
+}
+
+/* initialize the new element
+ * initialize instance structure
+ */
+static void gst_h265_decrypt_init(GstH265Decrypt *self) {}
@@ -0,0 +1,100 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-h265encrypt
+ *
+ * Encrypts the slices of H265 streams as h264encrypt does for H264 ones,
+ * keeping VPS, SPS, PPS and slice segment headers in clear. The IV SEI is a
+ * prefix SEI with the same payload as the H264 one. byte-stream, hvc1 and hev1
+ * stream formats are supported, with au or nal alignment.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 videotestsrc ! x265enc ! h265encrypt
+ * key=01020304050607080910111213141516 ! h265decrypt
+ * key=01020304050607080910111213141516 ! avdec_h265 ! autovideosink
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/base/base.h>
+#include <gst/gst.h>
+
+#include "h264_encrypt.h"
+#include "h264_encryption_base.h"
+#include "h265_encrypt.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_h265_encrypt_debug);
+#define GST_CAT_DEFAULT gst_h265_encrypt_debug
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
+    "sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS("video/x-h265,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,hvc1,hev1};"
+                    "video/x-h265,alignment=(string)none,"
+                    "stream-format=(string)byte-stream"));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
+    "src", GST_PAD_SRC, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS("video/x-h265,alignment=(string){au,nal},"
+                    "stream-format=(string){byte-stream,hvc1,hev1}"));
+
+#define gst_h265_encrypt_parent_class parent_class
+G_DEFINE_TYPE(GstH265Encrypt, gst_h265_encrypt, GST_TYPE_H264_ENCRYPT);
+GST_ELEMENT_REGISTER_DEFINE(h265encrypt, "h265encrypt", GST_RANK_NONE,
+                            GST_TYPE_H265_ENCRYPT);
+
+/* GObject vmethod implementations */
+
+/* initialize the h265encrypt's class */
+static void gst_h265_encrypt_class_init(GstH265EncryptClass *klass) {
+  GstElementClass *gstelement_class = (GstElementClass *)klass;
+  GstH264EncryptionBaseClass *gsth264encryptionbase_class =
+      (GstH264EncryptionBaseClass *)klass;
+
+  // The base creates an H265 parser and walks NAL units as H265 ones
+  gsth264encryptionbase_class->codec = GST_H264_ENCRYPTION_CODEC_H265;
+
+  gst_element_class_set_details_simple(
+      gstelement_class, "h265encrypt", "Codec/Encryption/Video",
+      "Encrypts H265 streams. You must use h265decrypt to decrypt.",
+      "Oguzhan Oztaskin <oguzhanoztaskin@gmail.com>");
+
+  // Templates of h264encrypt are replaced by the H265 ones
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&src_template));
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&sink_template));
+
+  GST_DEBUG_CATEGORY_INIT(gst_h265_encrypt_debug, "h265encrypt", 0,
+                          "h265encrypt general logs");
+}
+
+/* initialize the new element
+ * initialize instance structure
+ */
+static void gst_h265_encrypt_init(GstH265Encrypt *self) {}
@@ -0,0 +1,43 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2020 Niels De Graef <niels.degraef@gmail.com>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_H265_ENCRYPT_H__
+#define __GST_H265_ENCRYPT_H__
+
+#include <gst/gst.h>
+
+#include "h264_encrypt.h"
+
+G_BEGIN_DECLS
+
+GST_ELEMENT_REGISTER_DECLARE(h265encrypt)
+#define GST_TYPE_H265_ENCRYPT (gst_h265_encrypt_get_type())
+G_DECLARE_FINAL_TYPE(GstH265Encrypt, gst_h265_encrypt, GST, H265_ENCRYPT,
+                     GstH264Encrypt)
+
+struct _GstH265Encrypt {
+  GstH264Encrypt h264encrypt;
+};
+
+G_END_DECLS
+
+#endif /* __GST_H265_ENCRYPT_H__ */
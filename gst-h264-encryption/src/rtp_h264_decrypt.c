@@ -0,0 +1,333 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-rtph264decrypt
+ *
+ * Decrypts RTP H264 streams encrypted by rtph264encrypt, or by h264encrypt
+ * before payloading, in their packets. Single NAL unit, STAP-A and FU-A
+ * packets are supported. The IV SEI is removed, along with its packet if
+ * nothing else is left in it, and sequence numbers are shifted accordingly.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 udpsrc caps=application/x-rtp,encoding-name=H264 !
+ * rtph264decrypt key=01020304050607080910111213141516 ! rtph264depay !
+ * avdec_h264 ! autovideosink
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/base/base.h>
+#include <gst/codecparsers/gsth264parser.h>
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+#include <string.h>
+
+#include "ciphers/aes.h"
+#include "h264_encryption_base.h"
+#include "h264_encryption_base_private.h"
+#include "h264_encryption_types.h"
+#include "rtp_h264_decrypt.h"
+#include "rtp_h264_encryption.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_rtp_h264_decrypt_debug);
+#define GST_CAT_DEFAULT gst_rtp_h264_decrypt_debug
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
+    "sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS(RTP_H264_CAPS));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
+    "src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS(RTP_H264_CAPS));
+
+#define gst_rtp_h264_decrypt_parent_class parent_class
+G_DEFINE_TYPE(GstRtpH264Decrypt, gst_rtp_h264_decrypt,
+              GST_TYPE_H264_ENCRYPTION_BASE);
+GST_ELEMENT_REGISTER_DEFINE(rtph264decrypt, "rtph264decrypt", GST_RANK_NONE,
+                            GST_TYPE_RTP_H264_DECRYPT);
+
+static void gst_rtp_h264_decrypt_finalize(GObject *object);
+static void gst_rtp_h264_decrypt_enter_base_transform(
+    GstH264EncryptionBase *encryption_base);
+static gboolean gst_rtp_h264_decrypt_set_caps(GstBaseTransform *trans,
+                                              GstCaps *incaps,
+                                              GstCaps *outcaps);
+static GstFlowReturn gst_rtp_h264_decrypt_prepare_output_buffer(
+    GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf);
+static GstFlowReturn gst_rtp_h264_decrypt_transform(GstBaseTransform *trans,
+                                                    GstBuffer *inbuf,
+                                                    GstBuffer *outbuf);
+static gboolean gst_rtp_h264_decrypt_process_nal(
+    GstH264EncryptionBase *encryption_base, guint8 nal_header,
+    const guint8 *data, gsize size, gboolean first, gboolean last,
+    GstMapInfo *dest_map_info, size_t *dest_offset, gboolean *keep);
+
+/* GObject vmethod implementations */
+
+/* initialize the rtph264decrypt's class */
+static void gst_rtp_h264_decrypt_class_init(GstRtpH264DecryptClass *klass) {
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+  GstH264EncryptionBaseClass *gsth264encryptionbase_class;
+
+  gobject_class = (GObjectClass *)klass;
+  gstelement_class = (GstElementClass *)klass;
+  gsth264encryptionbase_class = (GstH264EncryptionBaseClass *)klass;
+
+  gsth264encryptionbase_class->enter_base_transform =
+      gst_rtp_h264_decrypt_enter_base_transform;
+  gobject_class->finalize = gst_rtp_h264_decrypt_finalize;
+
+  gst_element_class_set_details_simple(
+      gstelement_class, "rtph264decrypt", "Codec/Encryption/Video/Network/RTP",
+      "Decrypts RTP H264 packets encrypted by rtph264encrypt or h264encrypt",
+      "Oguzhan Oztaskin <oguzhanoztaskin@gmail.com>");
+
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&src_template));
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&sink_template));
+
+  GST_BASE_TRANSFORM_CLASS(klass)->set_caps =
+      GST_DEBUG_FUNCPTR(gst_rtp_h264_decrypt_set_caps);
+  GST_BASE_TRANSFORM_CLASS(klass)->prepare_output_buffer =
+      GST_DEBUG_FUNCPTR(gst_rtp_h264_decrypt_prepare_output_buffer);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform =
+      GST_DEBUG_FUNCPTR(gst_rtp_h264_decrypt_transform);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform_ip = NULL;
+
+  GST_DEBUG_CATEGORY_INIT(gst_rtp_h264_decrypt_debug, "rtph264decrypt", 0,
+                          "rtph264decrypt general logs");
+}
+
+/* initialize the new element
+ * initialize instance structure
+ */
+static void gst_rtp_h264_decrypt_init(GstRtpH264Decrypt *self) {
+  memset(&self->packet_state, 0, sizeof(self->packet_state));
+  self->in_slice = FALSE;
+  self->scratch = g_byte_array_new();
+  self->found_iv_sei = FALSE;
+  self->has_timestamp = FALSE;
+  self->timestamp = 0;
+  self->seen_iv_sei = FALSE;
+  self->warned_missing_iv = FALSE;
+}
+
+static void gst_rtp_h264_decrypt_finalize(GObject *object) {
+  GstRtpH264Decrypt *self = GST_RTP_H264_DECRYPT(object);
+  g_byte_array_unref(self->scratch);
+  self->scratch = NULL;
+  G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+/**
+ * The IV SEI is tracked across packets, so there is nothing to reset when a
+ * NAL unit is parsed.
+ */
+static void gst_rtp_h264_decrypt_enter_base_transform(
+    GstH264EncryptionBase *encryption_base) {
+  UNUSED(encryption_base);
+}
+
+/* GstBaseTransform vmethod implementations */
+
+/**
+ * SPS and PPS that are only in the caps are parsed here.
+ */
+static gboolean gst_rtp_h264_decrypt_set_caps(GstBaseTransform *trans,
+                                              GstCaps *incaps,
+                                              GstCaps *outcaps) {
+  GstRtpH264Decrypt *self = GST_RTP_H264_DECRYPT(trans);
+  if (!GST_BASE_TRANSFORM_CLASS(parent_class)
+           ->set_caps(trans, incaps, outcaps)) {
+    return FALSE;
+  }
+  memset(&self->packet_state, 0, sizeof(self->packet_state));
+  self->in_slice = FALSE;
+  self->found_iv_sei = FALSE;
+  self->has_timestamp = FALSE;
+  self->seen_iv_sei = FALSE;
+  gst_rtp_h264_encryption_parse_sprop_parameter_sets(
+      GST_H264_ENCRYPTION_BASE(trans), self->scratch,
+      gst_caps_get_structure(incaps, 0));
+  return TRUE;
+}
+
+static GstFlowReturn gst_rtp_h264_decrypt_prepare_output_buffer(
+    GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf) {
+  // Decrypted slices are never larger, except for the block a fragment may
+  // carry over from the previous packet
+  return gst_h264_encryption_base_allocate_output_buffer(
+      GST_H264_ENCRYPTION_BASE(trans), input,
+      gst_buffer_get_size(input) + 2 * AES_BLOCKLEN, outbuf);
+}
+
+/**
+ * Every picture needs its own IV SEI, so the IV of the previous picture is
+ * forgotten when the RTP timestamp changes. Slices of a picture whose IV SEI
+ * was lost are then let through instead of being decrypted with a wrong IV.
+ */
+static void gst_rtp_h264_decrypt_check_timestamp(GstRtpH264Decrypt *self,
+                                                 GstBuffer *inbuf) {
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  if (!gst_rtp_buffer_map(inbuf, GST_MAP_READ, &rtp)) {
+    return;
+  }
+  guint32 timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+  gst_rtp_buffer_unmap(&rtp);
+  if (self->has_timestamp && timestamp == self->timestamp) {
+    return;
+  }
+  self->found_iv_sei = FALSE;
+  self->warned_missing_iv = FALSE;
+  self->has_timestamp = TRUE;
+  self->timestamp = timestamp;
+}
+
+static GstFlowReturn gst_rtp_h264_decrypt_transform(GstBaseTransform *trans,
+                                                    GstBuffer *inbuf,
+                                                    GstBuffer *outbuf) {
+  GstRtpH264Decrypt *self = GST_RTP_H264_DECRYPT(trans);
+  gst_rtp_h264_decrypt_check_timestamp(self, inbuf);
+  return gst_rtp_h264_encryption_write_packet(
+      GST_H264_ENCRYPTION_BASE(trans), inbuf, outbuf,
+      gst_rtp_h264_decrypt_process_nal, &self->packet_state);
+}
+
+/**
+ * Takes the IV, flags and key of the IV SEI whose size bytes, after the NAL
+ * unit header, are at data. Returns FALSE if it is not an IV SEI.
+ */
+static gboolean gst_rtp_h264_decrypt_use_iv_sei(GstRtpH264Decrypt *self,
+                                                guint8 nal_header,
+                                                const guint8 *data,
+                                                gsize size) {
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(self));
+  guint8 flags, key_id;
+
+  if (!_read_iv_sei(GST_H264_ENCRYPTION_CODEC_H264, &nal_header, data, size,
+                    utils->iv, &flags, &key_id)) {
+    return FALSE;
+  }
+  if (!gst_h264_encryption_base_select_key(GST_H264_ENCRYPTION_BASE(self),
+                                           key_id)) {
+    // Slices are left as they are until an IV SEI names a known key
+    GST_WARNING_OBJECT(self, "Key %u is not in the keyring", key_id);
+    self->found_iv_sei = FALSE;
+    return TRUE;
+  }
+  memcpy(utils->ctx.Iv, utils->iv, AES_BLOCKLEN);
+  utils->slice_iv = (flags & GST_H264_ENCRYPT_IV_SEI_FLAG_SLICE_IV) != 0;
+  if (G_UNLIKELY(flags & GST_H264_ENCRYPT_IV_SEI_FLAGS_GOP)) {
+    GST_WARNING_OBJECT(self,
+                       "Pictures derive their IV from the GOP, which is not "
+                       "supported. Decrypt with h264decrypt after "
+                       "depayloading instead.");
+  }
+  self->found_iv_sei = TRUE;
+  self->seen_iv_sei = TRUE;
+  GST_DEBUG_OBJECT(self, "IV is found, flags 0x%02x", flags);
+  return TRUE;
+}
+
+/**
+ * Decrypts slices fragment by fragment, once an IV SEI is seen, and removes
+ * IV SEI. Other NAL units are copied.
+ */
+static gboolean gst_rtp_h264_decrypt_process_nal(
+    GstH264EncryptionBase *encryption_base, guint8 nal_header,
+    const guint8 *data, gsize size, gboolean first, gboolean last,
+    GstMapInfo *dest_map_info, size_t *dest_offset, gboolean *keep) {
+  GstRtpH264Decrypt *self = GST_RTP_H264_DECRYPT(encryption_base);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  guint8 type = nal_header & 0x1f;
+
+  if (!first) {
+    if (self->in_slice) {
+      return gst_rtp_h264_slice_cipher_process(&self->cipher, utils, data,
+                                               size, last, dest_map_info,
+                                               dest_offset);
+    }
+    return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, data,
+                                        size);
+  }
+
+  self->in_slice = FALSE;
+  if (IS_SLICE_NALU(type) && !self->found_iv_sei && self->seen_iv_sei &&
+      !self->warned_missing_iv) {
+    GST_WARNING_OBJECT(self,
+                       "Picture of RTP timestamp %u has no IV SEI, its "
+                       "slices are left as they are",
+                       self->timestamp);
+    self->warned_missing_iv = TRUE;
+  }
+  if (IS_SLICE_NALU(type) && self->found_iv_sei) {
+    gsize payload_offset;
+    guint first_mb_in_slice;
+    if (!gst_rtp_h264_encryption_parse_nal(encryption_base, self->scratch,
+                                           nal_header, data, size,
+                                           &payload_offset,
+                                           &first_mb_in_slice)) {
+      GST_ERROR_OBJECT(self, "Unable to parse slice header");
+      return FALSE;
+    }
+    if (G_UNLIKELY(payload_offset > size)) {
+      GST_ERROR_OBJECT(self, "Slice header does not fit in the packet");
+      return FALSE;
+    }
+    if (utils->slice_iv) {
+      gst_h264_encryption_base_set_slice_iv(encryption_base,
+                                            first_mb_in_slice);
+    }
+    if (!gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, data,
+                                      payload_offset)) {
+      return FALSE;
+    }
+    gst_rtp_h264_slice_cipher_init(&self->cipher, FALSE);
+    self->in_slice = TRUE;
+    return gst_rtp_h264_slice_cipher_process(
+        &self->cipher, utils, &data[payload_offset], size - payload_offset,
+        last, dest_map_info, dest_offset);
+  }
+  if (last && keep != NULL) {
+    if (type == GST_H264_NAL_SEI &&
+        gst_rtp_h264_decrypt_use_iv_sei(self, nal_header, data, size)) {
+      *keep = FALSE;
+      return TRUE;
+    }
+    if (type == GST_H264_NAL_SPS || type == GST_H264_NAL_PPS) {
+      gsize payload_offset;
+      guint first_mb_in_slice;
+      gst_rtp_h264_encryption_parse_nal(encryption_base, self->scratch,
+                                        nal_header, data, size,
+                                        &payload_offset, &first_mb_in_slice);
+    }
+  }
+  return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, data, size);
+}
@@ -0,0 +1,60 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2020 Niels De Graef <niels.degraef@gmail.com>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTP_H264_DECRYPT_H__
+#define __GST_RTP_H264_DECRYPT_H__
+
+#include <gst/gst.h>
+
+#include "h264_encryption_base.h"
+#include "rtp_h264_encryption.h"
+
+G_BEGIN_DECLS
+
+GST_ELEMENT_REGISTER_DECLARE(rtph264decrypt)
+#define GST_TYPE_RTP_H264_DECRYPT (gst_rtp_h264_decrypt_get_type())
+G_DECLARE_FINAL_TYPE(GstRtpH264Decrypt, gst_rtp_h264_decrypt, GST,
+                     RTP_H264_DECRYPT, GstH264EncryptionBase)
+
+struct _GstRtpH264Decrypt {
+  GstH264EncryptionBase encryption_base;
+
+  GstRtpH264PacketState packet_state;
+  // Cipher of the slice being written, which may span several FU-A
+  GstRtpH264SliceCipher cipher;
+  gboolean in_slice;
+  // Start code prefixed copy of the NAL unit being parsed
+  GByteArray *scratch;
+  // The picture of the RTP timestamp has an IV SEI, slices before it are
+  // let through as they are. Reset by every new timestamp.
+  gboolean found_iv_sei;
+  gboolean has_timestamp;
+  guint32 timestamp;
+  // Some picture had an IV SEI, so pictures without one are warned about,
+  // once each
+  gboolean seen_iv_sei;
+  gboolean warned_missing_iv;
+};
+
+G_END_DECLS
+
+#endif /* __GST_RTP_H264_DECRYPT_H__ */
@@ -0,0 +1,330 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-rtph264encrypt
+ *
+ * Encrypts the slices of RTP H264 streams in their packets, for streams that
+ * are payloaded before they reach the encryptor. Single NAL unit, STAP-A and
+ * FU-A packets are supported. RTP and NAL unit headers, and slice headers,
+ * are kept in clear, so the stream can still be routed and depayloaded.
+ *
+ * Every slice has its own IV derived from the IV SEI of its picture, which
+ * is sent in a packet of its own before the first slice of the picture.
+ * Sequence numbers are shifted accordingly.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 videotestsrc ! x264enc ! rtph264pay ! rtph264encrypt
+ * key=01020304050607080910111213141516 ! udpsink
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/base/base.h>
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+#include <string.h>
+
+#include "ciphers/aes.h"
+#include "h264_encrypt.h"
+#include "h264_encryption_base.h"
+#include "h264_encryption_base_private.h"
+#include "h264_encryption_types.h"
+#include "rtp_h264_encrypt.h"
+#include "rtp_h264_encryption.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_rtp_h264_encrypt_debug);
+#define GST_CAT_DEFAULT gst_rtp_h264_encrypt_debug
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
+    "sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS(RTP_H264_CAPS));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
+    "src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS(RTP_H264_CAPS));
+
+#define gst_rtp_h264_encrypt_parent_class parent_class
+G_DEFINE_TYPE(GstRtpH264Encrypt, gst_rtp_h264_encrypt, GST_TYPE_H264_ENCRYPT);
+GST_ELEMENT_REGISTER_DEFINE(rtph264encrypt, "rtph264encrypt", GST_RANK_NONE,
+                            GST_TYPE_RTP_H264_ENCRYPT);
+
+static void gst_rtp_h264_encrypt_finalize(GObject *object);
+static gboolean gst_rtp_h264_encrypt_set_caps(GstBaseTransform *trans,
+                                              GstCaps *incaps,
+                                              GstCaps *outcaps);
+static GstFlowReturn gst_rtp_h264_encrypt_prepare_output_buffer(
+    GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf);
+static GstFlowReturn gst_rtp_h264_encrypt_transform(GstBaseTransform *trans,
+                                                    GstBuffer *inbuf,
+                                                    GstBuffer *outbuf);
+static gboolean gst_rtp_h264_encrypt_process_nal(
+    GstH264EncryptionBase *encryption_base, guint8 nal_header,
+    const guint8 *data, gsize size, gboolean first, gboolean last,
+    GstMapInfo *dest_map_info, size_t *dest_offset, gboolean *keep);
+
+/* GObject vmethod implementations */
+
+/* initialize the rtph264encrypt's class */
+static void gst_rtp_h264_encrypt_class_init(GstRtpH264EncryptClass *klass) {
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = (GObjectClass *)klass;
+  gstelement_class = (GstElementClass *)klass;
+
+  gobject_class->finalize = gst_rtp_h264_encrypt_finalize;
+
+  gst_element_class_set_details_simple(
+      gstelement_class, "rtph264encrypt", "Codec/Encryption/Video/Network/RTP",
+      "Encrypts RTP H264 packets. You must use rtph264decrypt or h264decrypt "
+      "to decrypt.",
+      "Oguzhan Oztaskin <oguzhanoztaskin@gmail.com>");
+
+  // Templates of h264encrypt are replaced by the RTP ones
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&src_template));
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&sink_template));
+
+  GST_BASE_TRANSFORM_CLASS(klass)->set_caps =
+      GST_DEBUG_FUNCPTR(gst_rtp_h264_encrypt_set_caps);
+  GST_BASE_TRANSFORM_CLASS(klass)->prepare_output_buffer =
+      GST_DEBUG_FUNCPTR(gst_rtp_h264_encrypt_prepare_output_buffer);
+  GST_BASE_TRANSFORM_CLASS(klass)->transform =
+      GST_DEBUG_FUNCPTR(gst_rtp_h264_encrypt_transform);
+  // Packets always change size, so they are never encrypted in place
+  GST_BASE_TRANSFORM_CLASS(klass)->transform_ip = NULL;
+  GST_BASE_TRANSFORM_CLASS(klass)->propose_allocation = NULL;
+
+  GST_DEBUG_CATEGORY_INIT(gst_rtp_h264_encrypt_debug, "rtph264encrypt", 0,
+                          "rtph264encrypt general logs");
+}
+
+/* initialize the new element
+ * initialize instance structure
+ */
+static void gst_rtp_h264_encrypt_init(GstRtpH264Encrypt *self) {
+  memset(&self->packet_state, 0, sizeof(self->packet_state));
+  self->in_slice = FALSE;
+  self->scratch = g_byte_array_new();
+  self->input = NULL;
+  self->push_ret = GST_FLOW_OK;
+}
+
+static void gst_rtp_h264_encrypt_finalize(GObject *object) {
+  GstRtpH264Encrypt *self = GST_RTP_H264_ENCRYPT(object);
+  g_byte_array_unref(self->scratch);
+  self->scratch = NULL;
+  G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+/* GstBaseTransform vmethod implementations */
+
+/**
+ * Slices of a packetized stream are not seen as access units, so they always
+ * have their own IV. SPS and PPS that are only in the caps are parsed here.
+ */
+static gboolean gst_rtp_h264_encrypt_set_caps(GstBaseTransform *trans,
+                                              GstCaps *incaps,
+                                              GstCaps *outcaps) {
+  GstRtpH264Encrypt *self = GST_RTP_H264_ENCRYPT(trans);
+  GstH264EncryptionBase *encryption_base = GST_H264_ENCRYPTION_BASE(trans);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  if (!GST_BASE_TRANSFORM_CLASS(parent_class)
+           ->set_caps(trans, incaps, outcaps)) {
+    return FALSE;
+  }
+  utils->slice_iv = TRUE;
+  memset(&self->packet_state, 0, sizeof(self->packet_state));
+  self->in_slice = FALSE;
+  gst_rtp_h264_encryption_parse_sprop_parameter_sets(
+      encryption_base, self->scratch, gst_caps_get_structure(incaps, 0));
+  return TRUE;
+}
+
+static GstFlowReturn gst_rtp_h264_encrypt_prepare_output_buffer(
+    GstBaseTransform *trans, GstBuffer *input, GstBuffer **outbuf) {
+  gsize input_size = gst_buffer_get_size(input);
+  // Each slice grows by at most a block of padding, the end marker and one
+  // emulation prevention byte for every two bytes
+  return gst_h264_encryption_base_allocate_output_buffer(
+      GST_H264_ENCRYPTION_BASE(trans), input, input_size * 2 + 64, outbuf);
+}
+
+static GstFlowReturn gst_rtp_h264_encrypt_transform(GstBaseTransform *trans,
+                                                    GstBuffer *inbuf,
+                                                    GstBuffer *outbuf) {
+  GstRtpH264Encrypt *self = GST_RTP_H264_ENCRYPT(trans);
+  self->input = inbuf;
+  self->push_ret = GST_FLOW_OK;
+  GstFlowReturn ret = gst_rtp_h264_encryption_write_packet(
+      GST_H264_ENCRYPTION_BASE(trans), inbuf, outbuf,
+      gst_rtp_h264_encrypt_process_nal, &self->packet_state);
+  self->input = NULL;
+  // Pushing the IV SEI packet may fail for reasons other than errors
+  if (ret == GST_FLOW_ERROR && self->push_ret != GST_FLOW_OK) {
+    return self->push_ret;
+  }
+  return ret;
+}
+
+/**
+ * Sends an IV SEI with a new IV in a packet of its own, right before the
+ * packet being transformed, which takes the next sequence number. Every slice
+ * has its own IV, so GOP IV modes are refused.
+ */
+static gboolean gst_rtp_h264_encrypt_push_iv_sei(GstRtpH264Encrypt *self) {
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(self);
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(self));
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  GstMapInfo map_info;
+  guint8 sei[IV_SEI_MAX_SIZE];
+
+  if (G_UNLIKELY(h264encrypt->iv_mode != GST_H264_IV_MODE_ACCESS_UNIT)) {
+    GST_ERROR_OBJECT(self, "Only iv-mode=access-unit is supported on RTP");
+    return FALSE;
+  }
+  if (!gst_h264_encrypt_select_key(h264encrypt) ||
+      !gst_h264_encrypt_get_random_iv(h264encrypt, utils->iv, AES_BLOCKLEN)) {
+    return FALSE;
+  }
+  size_t sei_size = gst_h264_encrypt_fill_iv_sei(
+      sei, GST_H264_ENCRYPTION_CODEC_H264, NULL, 0, 0, utils->iv,
+      GST_H264_ENCRYPT_IV_SEI_FLAG_SLICE_IV, utils->key_id);
+
+  if (G_UNLIKELY(!gst_rtp_buffer_map(self->input, GST_MAP_READ, &rtp))) {
+    GST_ERROR_OBJECT(self, "Unable to map RTP packet for read!");
+    return FALSE;
+  }
+  guint header_size = gst_rtp_buffer_get_header_len(&rtp);
+  guint16 seqnum = gst_rtp_buffer_get_seq(&rtp);
+  gst_rtp_buffer_unmap(&rtp);
+
+  GstBuffer *packet = gst_buffer_new_allocate(NULL, header_size + sei_size,
+                                              NULL);
+  gst_buffer_copy_into(packet, self->input, GST_BUFFER_COPY_METADATA, 0, -1);
+  GST_BUFFER_FLAG_UNSET(packet, GST_BUFFER_FLAG_MARKER);
+  if (G_UNLIKELY(!gst_buffer_map(packet, &map_info, GST_MAP_WRITE))) {
+    GST_ERROR_OBJECT(self, "Unable to map IV SEI packet for write!");
+    gst_buffer_unref(packet);
+    return FALSE;
+  }
+  gst_buffer_extract(self->input, 0, map_info.data, header_size);
+  memcpy(&map_info.data[header_size], sei, sei_size);
+  // Without padding and marker, as the picture goes on
+  map_info.data[0] &= ~0x20;
+  map_info.data[1] &= ~0x80;
+  GST_WRITE_UINT16_BE(&map_info.data[2],
+                      (guint16)(seqnum + self->packet_state.seqnum_offset));
+  gst_buffer_unmap(packet, &map_info);
+  self->packet_state.seqnum_offset++;
+
+  GST_LOG_OBJECT(self, "Pushing IV SEI before packet %u", seqnum);
+  self->push_ret =
+      gst_h264_encryption_base_push(GST_H264_ENCRYPTION_BASE(self), packet);
+  return self->push_ret == GST_FLOW_OK;
+}
+
+/**
+ * Encrypts slices as h264encrypt does with slice IVs: the slice header is
+ * copied in clear and the rest is encrypted as it comes, fragment by
+ * fragment. Other NAL units are copied, after an IV SEI if they are the IV
+ * SEI of a previous encryptor.
+ */
+static gboolean gst_rtp_h264_encrypt_process_nal(
+    GstH264EncryptionBase *encryption_base, guint8 nal_header,
+    const guint8 *data, gsize size, gboolean first, gboolean last,
+    GstMapInfo *dest_map_info, size_t *dest_offset, gboolean *keep) {
+  UNUSED(keep);
+  GstRtpH264Encrypt *self = GST_RTP_H264_ENCRYPT(encryption_base);
+  GstH264Encrypt *h264encrypt = GST_H264_ENCRYPT(encryption_base);
+  GstH264EncryptionUtils *utils =
+      gst_h264_encryption_base_get_encryption_utils(encryption_base);
+  guint8 type = nal_header & 0x1f;
+
+  if (!first) {
+    if (self->in_slice) {
+      return gst_rtp_h264_slice_cipher_process(&self->cipher, utils, data,
+                                               size, last, dest_map_info,
+                                               dest_offset);
+    }
+    return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, data,
+                                        size);
+  }
+
+  self->in_slice = FALSE;
+  if (IS_SLICE_NALU(type)) {
+    gsize payload_offset;
+    guint first_mb_in_slice;
+    if (!gst_rtp_h264_encryption_parse_nal(encryption_base, self->scratch,
+                                           nal_header, data, size,
+                                           &payload_offset,
+                                           &first_mb_in_slice)) {
+      GST_ERROR_OBJECT(self, "Unable to parse slice header");
+      return FALSE;
+    }
+    if (G_UNLIKELY(payload_offset > size)) {
+      GST_ERROR_OBJECT(self, "Slice header does not fit in the packet");
+      return FALSE;
+    }
+    if (first_mb_in_slice == 0 && !h264encrypt->inserted_sei &&
+        !gst_rtp_h264_encrypt_push_iv_sei(self)) {
+      return FALSE;
+    }
+    h264encrypt->inserted_sei = FALSE;
+    gst_h264_encryption_base_set_slice_iv(encryption_base, first_mb_in_slice);
+    if (!gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, data,
+                                      payload_offset)) {
+      return FALSE;
+    }
+    gst_rtp_h264_slice_cipher_init(&self->cipher, TRUE);
+    self->in_slice = TRUE;
+    return gst_rtp_h264_slice_cipher_process(
+        &self->cipher, utils, &data[payload_offset], size - payload_offset,
+        last, dest_map_info, dest_offset);
+  }
+  if (last) {
+    guint extra_size;
+    if (type == GST_H264_NAL_SPS || type == GST_H264_NAL_PPS) {
+      gsize payload_offset;
+      guint first_mb_in_slice;
+      gst_rtp_h264_encryption_parse_nal(encryption_base, self->scratch,
+                                        nal_header, data, size,
+                                        &payload_offset, &first_mb_in_slice);
+    } else if (type == GST_H264_NAL_SEI && !h264encrypt->inserted_sei &&
+               _is_iv_sei(GST_H264_ENCRYPTION_CODEC_H264, data - 1, size + 1,
+                          &extra_size)) {
+      // Our IV SEI goes first, so that the decryptor finds it
+      if (!gst_rtp_h264_encrypt_push_iv_sei(self)) {
+        return FALSE;
+      }
+      h264encrypt->inserted_sei = TRUE;
+    }
+  }
+  return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, data, size);
+}
@@ -0,0 +1,55 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2020 Niels De Graef <niels.degraef@gmail.com>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTP_H264_ENCRYPT_H__
+#define __GST_RTP_H264_ENCRYPT_H__
+
+#include <gst/gst.h>
+
+#include "h264_encrypt.h"
+#include "rtp_h264_encryption.h"
+
+G_BEGIN_DECLS
+
+GST_ELEMENT_REGISTER_DECLARE(rtph264encrypt)
+#define GST_TYPE_RTP_H264_ENCRYPT (gst_rtp_h264_encrypt_get_type())
+G_DECLARE_FINAL_TYPE(GstRtpH264Encrypt, gst_rtp_h264_encrypt, GST,
+                     RTP_H264_ENCRYPT, GstH264Encrypt)
+
+struct _GstRtpH264Encrypt {
+  GstH264Encrypt h264encrypt;
+
+  GstRtpH264PacketState packet_state;
+  // Cipher of the slice being written, which may span several FU-A
+  GstRtpH264SliceCipher cipher;
+  gboolean in_slice;
+  // Start code prefixed copy of the NAL unit being parsed
+  GByteArray *scratch;
+  // Packet being transformed, whose header the IV SEI packets copy
+  GstBuffer *input;
+  // Result of pushing the last IV SEI packet
+  GstFlowReturn push_ret;
+};
+
+G_END_DECLS
+
+#endif /* __GST_RTP_H264_ENCRYPT_H__ */
@@ -0,0 +1,442 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * Packet processing shared by rtph264encrypt and rtph264decrypt.
+ *
+ * NAL units are processed inside RFC 6184 single NAL unit packets, STAP-A and
+ * FU-A payloads, one packet at a time. RTP and NAL unit headers stay in clear
+ * and slices end up exactly as h264encrypt writes them, so that a stream can
+ * be encrypted before payloading and decrypted after it, or the other way
+ * around.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "rtp_h264_encryption.h"
+
+GST_DEBUG_CATEGORY_EXTERN(GST_H264_ENCRYPTION);
+#define GST_CAT_DEFAULT GST_H264_ENCRYPTION
+
+static const guint8 start_code[] = {0x00, 0x00, 0x00, 0x01};
+
+void gst_rtp_h264_slice_cipher_init(GstRtpH264SliceCipher *cipher,
+                                    gboolean encrypt) {
+  memset(cipher, 0, sizeof(*cipher));
+  cipher->encrypt = encrypt;
+  cipher->state = 0xffffffff;
+}
+
+gboolean gst_rtp_h264_encryption_copy(GstMapInfo *dest_map_info,
+                                      size_t *dest_offset, const guint8 *data,
+                                      gsize size) {
+  if (G_UNLIKELY(*dest_offset + size > dest_map_info->maxsize)) {
+    GST_ERROR("Output packet is too small");
+    return FALSE;
+  }
+  memcpy(&dest_map_info->data[*dest_offset], data, size);
+  *dest_offset += size;
+  return TRUE;
+}
+
+/**
+ * Writes size bytes of data to dest with emulation prevention bytes.
+ * zero_count carries the number of preceding zero bytes between calls.
+ */
+static gboolean _write_escaped(const guint8 *data, gsize size,
+                               guint *zero_count, GstMapInfo *dest_map_info,
+                               size_t *dest_offset) {
+  // At most one emulation prevention byte for every two bytes
+  if (G_UNLIKELY(*dest_offset + size * 3 / 2 + 1 > dest_map_info->maxsize)) {
+    GST_ERROR("Not enough space for emulation prevention bytes");
+    return FALSE;
+  }
+  guint8 *dest = dest_map_info->data;
+  for (gsize i = 0; i < size; i++) {
+    if (*zero_count >= 2 && data[i] <= 0x03) {
+      dest[(*dest_offset)++] = 0x03;
+      *zero_count = 0;
+    }
+    dest[(*dest_offset)++] = data[i];
+    *zero_count = data[i] == 0 ? *zero_count + 1 : 0;
+  }
+  return TRUE;
+}
+
+static gboolean _encrypt_piece(GstRtpH264SliceCipher *cipher,
+                               GstH264EncryptionUtils *utils,
+                               const guint8 *data, gsize size, gboolean last,
+                               GstMapInfo *dest_map_info,
+                               size_t *dest_offset) {
+  while (size > 0) {
+    gsize n = MIN(size, AES_BLOCKLEN - cipher->block_size);
+    memcpy(&cipher->block[cipher->block_size], data, n);
+    cipher->block_size += n;
+    data += n;
+    size -= n;
+    if (cipher->block_size < AES_BLOCKLEN) {
+      break;
+    }
+    _encrypt_blocks(utils, cipher->block, AES_BLOCKLEN);
+    if (!_write_escaped(cipher->block, AES_BLOCKLEN, &cipher->zero_count,
+                        dest_map_info, dest_offset)) {
+      return FALSE;
+    }
+    cipher->block_size = 0;
+  }
+  if (!last) {
+    return TRUE;
+  }
+  // Padding fills the last block, or makes a block of its own
+  cipher->block[cipher->block_size] = 0x80;
+  memset(&cipher->block[cipher->block_size + 1], 0,
+         AES_BLOCKLEN - cipher->block_size - 1);
+  _encrypt_blocks(utils, cipher->block, AES_BLOCKLEN);
+  if (!_write_escaped(cipher->block, AES_BLOCKLEN, &cipher->zero_count,
+                      dest_map_info, dest_offset)) {
+    return FALSE;
+  }
+  static const guint8 end_marker = CIPHERTEXT_END_MARKER;
+  return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, &end_marker,
+                                      1);
+}
+
+static gboolean _decrypt_piece(GstRtpH264SliceCipher *cipher,
+                               GstH264EncryptionUtils *utils,
+                               const guint8 *data, gsize size, gboolean last,
+                               GstMapInfo *dest_map_info,
+                               size_t *dest_offset) {
+  if (last && size > 0) {
+    if (data[size - 1] == CIPHERTEXT_END_MARKER) {
+      size--;
+    } else {
+      GST_ERROR(
+          "Ciphertext end marker is not found. Last byte of the payload will "
+          "not be ignored.");
+    }
+  }
+  for (gsize i = 0; i < size; i++) {
+    cipher->state = (cipher->state << 8) | data[i];
+    if ((cipher->state & 0x00ffffff) == 0x00000003) {
+      // Skip emulation prevention byte and reset state
+      cipher->state = 0xffffffff;
+      continue;
+    }
+    cipher->block[cipher->block_size++] = data[i];
+    if (cipher->block_size < AES_BLOCKLEN) {
+      continue;
+    }
+    // The held block is not the last one, so it has no padding
+    if (cipher->has_held &&
+        !gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, cipher->held,
+                                      AES_BLOCKLEN)) {
+      return FALSE;
+    }
+    _decrypt_blocks(utils, cipher->block, AES_BLOCKLEN);
+    memcpy(cipher->held, cipher->block, AES_BLOCKLEN);
+    cipher->has_held = TRUE;
+    cipher->block_size = 0;
+  }
+  if (!last) {
+    return TRUE;
+  }
+  if (G_UNLIKELY(cipher->block_size != 0)) {
+    GST_ERROR("Encrypted block size is not a multiple of AES_BLOCKLEN (%d)",
+              AES_BLOCKLEN);
+    return FALSE;
+  }
+  if (!cipher->has_held) {
+    return TRUE;
+  }
+  gint padding_byte_count = _remove_padding(cipher->held, AES_BLOCKLEN);
+  if (G_UNLIKELY(padding_byte_count == 0)) {
+    GST_WARNING("Padding is not found, data is invalid.");
+  }
+  return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, cipher->held,
+                                      AES_BLOCKLEN - padding_byte_count);
+}
+
+/**
+ * Processes the next size bytes of the slice payload at data and writes what
+ * is ready of the result to dest. last is TRUE for the last piece, which
+ * flushes the carried bytes.
+ */
+gboolean gst_rtp_h264_slice_cipher_process(GstRtpH264SliceCipher *cipher,
+                                           GstH264EncryptionUtils *utils,
+                                           const guint8 *data, gsize size,
+                                           gboolean last,
+                                           GstMapInfo *dest_map_info,
+                                           size_t *dest_offset) {
+  if (cipher->encrypt) {
+    return _encrypt_piece(cipher, utils, data, size, last, dest_map_info,
+                          dest_offset);
+  }
+  return _decrypt_piece(cipher, utils, data, size, last, dest_map_info,
+                        dest_offset);
+}
+
+/**
+ * Parses the NAL unit with nal_header whose following size bytes are at data
+ * with the NAL parser of encryption_base, so that SPS and PPS are kept. For
+ * slices, sets payload_offset to the offset of the slice data in data and
+ * first_mb_in_slice. data only needs to hold the slice header, such as the
+ * first fragment of a FU-A does.
+ *
+ * The parser works on start code prefixed NAL units, so the NAL unit is
+ * copied after one into scratch first. RTP packets are small, so this is
+ * cheap next to the cipher.
+ */
+gboolean gst_rtp_h264_encryption_parse_nal(
+    GstH264EncryptionBase *encryption_base, GByteArray *scratch,
+    guint8 nal_header, const guint8 *data, gsize size, gsize *payload_offset,
+    guint *first_mb_in_slice) {
+  GstH264NalUnit nalu;
+  gboolean ret = FALSE;
+
+  g_byte_array_set_size(scratch, 0);
+  g_byte_array_append(scratch, start_code, sizeof(start_code));
+  g_byte_array_append(scratch, &nal_header, 1);
+  g_byte_array_append(scratch, data, size);
+  if (!gst_h264_encryption_base_begin_au(encryption_base, scratch->data,
+                                         scratch->len)) {
+    goto done;
+  }
+  if (!gst_h264_encryption_base_identify_nalu(encryption_base, scratch->data,
+                                              0, 0, &nalu)) {
+    goto done;
+  }
+  if (IS_SLICE_NALU(nalu.type)) {
+    gsize offset, payload_size;
+    if (!gst_h264_encryption_base_calculate_payload_offset_and_size(
+            encryption_base, &nalu, &offset, &payload_size,
+            first_mb_in_slice)) {
+      goto done;
+    }
+    *payload_offset = offset - sizeof(start_code) - 1;
+  }
+  ret = TRUE;
+
+done:
+  gst_h264_encryption_base_end_au(encryption_base);
+  return ret;
+}
+
+/**
+ * Parses the SPS and PPS of the sprop-parameter-sets field of RTP caps, if
+ * any, for streams that do not repeat them in band.
+ */
+void gst_rtp_h264_encryption_parse_sprop_parameter_sets(
+    GstH264EncryptionBase *encryption_base, GByteArray *scratch,
+    const GstStructure *structure) {
+  const gchar *sprop =
+      gst_structure_get_string(structure, "sprop-parameter-sets");
+  if (sprop == NULL) {
+    return;
+  }
+  gchar **parameter_sets = g_strsplit(sprop, ",", -1);
+  for (guint i = 0; parameter_sets[i] != NULL; i++) {
+    gsize size;
+    guchar *nal = g_base64_decode(parameter_sets[i], &size);
+    if (size > 0) {
+      g_byte_array_set_size(scratch, 0);
+      g_byte_array_append(scratch, start_code, sizeof(start_code));
+      g_byte_array_append(scratch, nal, size);
+      gst_h264_encryption_base_parse_parameter_set(
+          encryption_base, scratch->data, scratch->len);
+    }
+    g_free(nal);
+  }
+  g_strfreev(parameter_sets);
+}
+
+/**
+ * Writes the header of the whole NAL unit of size bytes at nal and lets
+ * process_nal write the rest, or nothing if it removes the NAL unit.
+ */
+static gboolean gst_rtp_h264_encryption_process_whole_nal(
+    GstH264EncryptionBase *encryption_base, const guint8 *nal, gsize size,
+    GstRtpH264NalFunc process_nal, GstMapInfo *dest_map_info,
+    size_t *dest_offset) {
+  size_t nal_offset = *dest_offset;
+  gboolean keep = TRUE;
+  if (!gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, nal, 1) ||
+      !process_nal(encryption_base, nal[0], &nal[1], size - 1, TRUE, TRUE,
+                   dest_map_info, dest_offset, &keep)) {
+    return FALSE;
+  }
+  if (!keep) {
+    *dest_offset = nal_offset;
+  }
+  return TRUE;
+}
+
+/**
+ * Writes the RTP payload of size bytes at payload to dest with process_nal
+ * applied to its NAL units. Writes nothing if no NAL unit is left, or for
+ * fragments of a FU-A whose first fragment was lost.
+ */
+gboolean gst_rtp_h264_encryption_process_payload(
+    GstH264EncryptionBase *encryption_base, const guint8 *payload, gsize size,
+    GstRtpH264NalFunc process_nal, GstRtpH264PacketState *state,
+    GstMapInfo *dest_map_info, size_t *dest_offset) {
+  if (size == 0) {
+    return TRUE;
+  }
+  guint8 type = payload[0] & 0x1f;
+  if (type >= GST_H264_NAL_SLICE && type < RTP_H264_STAP_A) {
+    state->in_fragment = FALSE;
+    return gst_rtp_h264_encryption_process_whole_nal(
+        encryption_base, payload, size, process_nal, dest_map_info,
+        dest_offset);
+  }
+  switch (type) {
+    case RTP_H264_STAP_A: {
+      state->in_fragment = FALSE;
+      size_t stap_offset = *dest_offset;
+      if (!gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, payload,
+                                        1)) {
+        return FALSE;
+      }
+      for (gsize i = 1; i + 2 <= size;) {
+        gsize nal_size = GST_READ_UINT16_BE(&payload[i]);
+        i += 2;
+        if (G_UNLIKELY(nal_size == 0 || i + nal_size > size)) {
+          GST_ERROR_OBJECT(encryption_base, "STAP-A is truncated");
+          return FALSE;
+        }
+        // The size is written once the NAL unit is
+        size_t size_offset = *dest_offset;
+        *dest_offset += 2;
+        if (!gst_rtp_h264_encryption_process_whole_nal(
+                encryption_base, &payload[i], nal_size, process_nal,
+                dest_map_info, dest_offset)) {
+          return FALSE;
+        }
+        gsize written = *dest_offset - size_offset - 2;
+        if (written == 0) {
+          *dest_offset = size_offset;
+        } else if (G_UNLIKELY(written > G_MAXUINT16)) {
+          GST_ERROR_OBJECT(encryption_base, "NAL unit too large for STAP-A");
+          return FALSE;
+        } else {
+          GST_WRITE_UINT16_BE(&dest_map_info->data[size_offset], written);
+        }
+        i += nal_size;
+      }
+      if (*dest_offset == stap_offset + 1) {
+        *dest_offset = stap_offset;
+      }
+      return TRUE;
+    }
+    case RTP_H264_FU_A: {
+      if (G_UNLIKELY(size < 2)) {
+        GST_ERROR_OBJECT(encryption_base, "FU-A is truncated");
+        return FALSE;
+      }
+      gboolean first = (payload[1] & 0x80) != 0;
+      gboolean last = (payload[1] & 0x40) != 0;
+      if (!first && !state->in_fragment) {
+        GST_DEBUG_OBJECT(encryption_base,
+                         "Dropping fragment whose first fragment is lost");
+        return TRUE;
+      }
+      state->in_fragment = !last;
+      guint8 nal_header = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+      return gst_rtp_h264_encryption_copy(dest_map_info, dest_offset, payload,
+                                          2) &&
+             process_nal(encryption_base, nal_header, &payload[2], size - 2,
+                         first, last, dest_map_info, dest_offset, NULL);
+    }
+    default:
+      GST_ERROR_OBJECT(encryption_base,
+                       "Unsupported RTP payload type %u, only single NAL "
+                       "unit, STAP-A and FU-A packets are",
+                       type);
+      return FALSE;
+  }
+}
+
+/**
+ * Writes the RTP packet inbuf to outbuf with process_nal applied to the NAL
+ * units of its payload. The RTP header is copied without the padding flag,
+ * as padding is dropped, and with the sequence number shifted by the packets
+ * inserted or removed so far.
+ *
+ * Returns GST_BASE_TRANSFORM_FLOW_DROPPED if nothing is left of the payload.
+ */
+GstFlowReturn gst_rtp_h264_encryption_write_packet(
+    GstH264EncryptionBase *encryption_base, GstBuffer *inbuf,
+    GstBuffer *outbuf, GstRtpH264NalFunc process_nal,
+    GstRtpH264PacketState *state) {
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  GstMapInfo map_info;
+
+  if (G_UNLIKELY(!gst_rtp_buffer_map(inbuf, GST_MAP_READ, &rtp))) {
+    GST_ERROR_OBJECT(encryption_base, "Unable to map RTP packet for read!");
+    return GST_FLOW_ERROR;
+  }
+  guint16 seqnum = gst_rtp_buffer_get_seq(&rtp);
+  guint header_size = gst_rtp_buffer_get_header_len(&rtp);
+  if (state->in_fragment && seqnum != state->next_seqnum) {
+    GST_DEBUG_OBJECT(encryption_base,
+                     "Packet lost, dropping the rest of the fragmented NAL "
+                     "unit");
+    state->in_fragment = FALSE;
+  }
+  state->next_seqnum = seqnum + 1;
+  if (G_UNLIKELY(!gst_buffer_map(outbuf, &map_info, GST_MAP_WRITE))) {
+    GST_ERROR_OBJECT(encryption_base, "Unable to map output buffer for write!");
+    gst_rtp_buffer_unmap(&rtp);
+    return GST_FLOW_ERROR;
+  }
+  size_t dest_offset = header_size;
+  gboolean ok =
+      header_size <= map_info.maxsize &&
+      gst_buffer_extract(inbuf, 0, map_info.data, header_size) ==
+          header_size &&
+      gst_rtp_h264_encryption_process_payload(
+          encryption_base, gst_rtp_buffer_get_payload(&rtp),
+          gst_rtp_buffer_get_payload_len(&rtp), process_nal, state, &map_info,
+          &dest_offset);
+  gst_rtp_buffer_unmap(&rtp);
+  if (ok) {
+    // Without padding, and after the packets inserted or removed before
+    map_info.data[0] &= ~0x20;
+    GST_WRITE_UINT16_BE(&map_info.data[2],
+                        (guint16)(seqnum + state->seqnum_offset));
+  }
+  gst_buffer_unmap(outbuf, &map_info);
+  if (G_UNLIKELY(!ok)) {
+    GST_ERROR_OBJECT(encryption_base, "Failed to process RTP packet %u",
+                     seqnum);
+    return GST_FLOW_ERROR;
+  }
+  if (dest_offset == header_size) {
+    state->seqnum_offset--;
+    return GST_BASE_TRANSFORM_FLOW_DROPPED;
+  }
+  gst_buffer_set_size(outbuf, dest_offset);
+  return GST_FLOW_OK;
+}
@@ -0,0 +1,121 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTP_H264_ENCRYPTION_H__
+#define __GST_RTP_H264_ENCRYPTION_H__
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+#include "ciphers/aes.h"
+#include "h264_encryption_base.h"
+#include "h264_encryption_base_private.h"
+
+G_BEGIN_DECLS
+
+// Payload types of RFC 6184 single NAL unit and non-interleaved modes
+#define RTP_H264_STAP_A 24
+#define RTP_H264_FU_A 28
+
+#define RTP_H264_CAPS                                            \
+  "application/x-rtp,media=(string)video,clock-rate=(int)90000," \
+  "encoding-name=(string)H264"
+
+/**
+ * Encrypts or decrypts the payload of one slice fed in pieces, such as the
+ * fragments of a FU-A, into the same format as h264encrypt: padded, escaped
+ * and followed by the end marker. Bytes that do not fill a cipher block yet
+ * are carried to the next piece, so output pieces are shifted by less than a
+ * block from the input ones and the NAL unit is never reassembled.
+ */
+typedef struct GstRtpH264SliceCipher {
+  gboolean encrypt;
+  guint8 block[AES_BLOCKLEN];
+  guint block_size;
+  // Decryption holds back the last block until it knows it is not padding
+  guint8 held[AES_BLOCKLEN];
+  gboolean has_held;
+  // Zero bytes written for escaping, or last bytes read for unescaping
+  guint zero_count;
+  guint32 state;
+} GstRtpH264SliceCipher;
+
+/**
+ * Packet level state of a RTP element, kept between packets.
+ */
+typedef struct GstRtpH264PacketState {
+  // A FU-A is open, its next fragments are expected
+  gboolean in_fragment;
+  // Added to input sequence numbers for the packets inserted or removed
+  guint16 seqnum_offset;
+  // Sequence number expected next, to notice lost fragments
+  guint16 next_seqnum;
+} GstRtpH264PacketState;
+
+/**
+ * Processes a NAL unit of a RTP payload, or a fragment of it, by writing
+ * what follows its header to dest. first and last tell which fragment this
+ * is and are both TRUE for whole NAL units, whose header is then right before
+ * data and which are removed from the output if keep is set to FALSE. keep is
+ * NULL for fragments.
+ */
+typedef gboolean (*GstRtpH264NalFunc)(GstH264EncryptionBase *encryption_base,
+                                      guint8 nal_header, const guint8 *data,
+                                      gsize size, gboolean first,
+                                      gboolean last, GstMapInfo *dest_map_info,
+                                      size_t *dest_offset, gboolean *keep);
+
+void gst_rtp_h264_slice_cipher_init(GstRtpH264SliceCipher *cipher,
+                                    gboolean encrypt);
+
+gboolean gst_rtp_h264_slice_cipher_process(GstRtpH264SliceCipher *cipher,
+                                           GstH264EncryptionUtils *utils,
+                                           const guint8 *data, gsize size,
+                                           gboolean last,
+                                           GstMapInfo *dest_map_info,
+                                           size_t *dest_offset);
+
+gboolean gst_rtp_h264_encryption_copy(GstMapInfo *dest_map_info,
+                                      size_t *dest_offset, const guint8 *data,
+                                      gsize size);
+
+gboolean gst_rtp_h264_encryption_parse_nal(
+    GstH264EncryptionBase *encryption_base, GByteArray *scratch,
+    guint8 nal_header, const guint8 *data, gsize size, gsize *payload_offset,
+    guint *first_mb_in_slice);
+
+void gst_rtp_h264_encryption_parse_sprop_parameter_sets(
+    GstH264EncryptionBase *encryption_base, GByteArray *scratch,
+    const GstStructure *structure);
+
+gboolean gst_rtp_h264_encryption_process_payload(
+    GstH264EncryptionBase *encryption_base, const guint8 *payload, gsize size,
+    GstRtpH264NalFunc process_nal, GstRtpH264PacketState *state,
+    GstMapInfo *dest_map_info, size_t *dest_offset);
+
+GstFlowReturn gst_rtp_h264_encryption_write_packet(
+    GstH264EncryptionBase *encryption_base, GstBuffer *inbuf,
+    GstBuffer *outbuf, GstRtpH264NalFunc process_nal,
+    GstRtpH264PacketState *state);
+
+G_END_DECLS
+
+#endif /* __GST_RTP_H264_ENCRYPTION_H__ */
@@ -0,0 +1,648 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-tsh264encrypt
+ *
+ * Encrypts the H264 stream of MPEG-TS in its PES packets, without demuxing
+ * and muxing again. The first H264 stream of the first program is found
+ * through the PAT and PMT, and its slices are encrypted as h264encrypt does
+ * with slice IVs, so tsdemux ! h264decrypt decrypts the output.
+ *
+ * Encrypted PES are larger, so they are spread over the original packets of
+ * the video PID, which keep their adaptation fields and thus PCRs, and over
+ * extra packets right after them. Packets of other PIDs and their order are
+ * not changed. Video continuity counters are renumbered.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 filesrc location=source.ts ! tsh264encrypt
+ * key=01234567012345670123456701234567 ! filesink location=encrypted.ts
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/base/base.h>
+#include <gst/gst.h>
+#include <string.h>
+
+#include "ciphers/aes.h"
+#include "h264_encrypt.h"
+#include "h264_encryption_base.h"
+#include "h264_encryption_base_private.h"
+#include "h264_encryption_types.h"
+#include "ts_h264_encrypt.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_ts_h264_encrypt_debug);
+#define GST_CAT_DEFAULT gst_ts_h264_encrypt_debug
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_PAT_PID 0
+#define TS_STREAM_TYPE_H264 0x1b
+#define TS_PID(ts) ((((ts)[1] & 0x1f) << 8) | (ts)[2])
+#define TS_HAS_PAYLOAD(ts) (((ts)[3] & 0x10) != 0)
+#define TS_HAS_ADAPTATION_FIELD(ts) (((ts)[3] & 0x20) != 0)
+#define TS_PAYLOAD_UNIT_START(ts) (((ts)[1] & 0x40) != 0)
+
+// 192 byte packets are refused, as inserted packets would need arrival
+// timestamps of their own
+#define TS_CAPS "video/mpegts,systemstream=(boolean)true,packetsize=(int)188"
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
+    "sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS(TS_CAPS));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
+    "src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS(TS_CAPS));
+
+#define gst_ts_h264_encrypt_parent_class parent_class
+G_DEFINE_TYPE(GstTsH264Encrypt, gst_ts_h264_encrypt, GST_TYPE_H264_ENCRYPT);
+GST_ELEMENT_REGISTER_DEFINE(tsh264encrypt, "tsh264encrypt", GST_RANK_NONE,
+                            GST_TYPE_TS_H264_ENCRYPT);
+
+static void gst_ts_h264_encrypt_finalize(GObject *object);
+static gboolean gst_ts_h264_encrypt_stop(GstBaseTransform *trans);
+static gboolean gst_ts_h264_encrypt_set_caps(GstBaseTransform *trans,
+                                             GstCaps *incaps,
+                                             GstCaps *outcaps);
+static gboolean gst_ts_h264_encrypt_sink_event(GstBaseTransform *trans,
+                                               GstEvent *event);
+static GstFlowReturn gst_ts_h264_encrypt_generate_output(
+    GstBaseTransform *trans, GstBuffer **outbuf);
+static void gst_ts_h264_encrypt_reset(GstTsH264Encrypt *self);
+static gboolean gst_ts_h264_encrypt_finish_pes(GstTsH264Encrypt *self);
+
+/* GObject vmethod implementations */
+
+/* initialize the tsh264encrypt's class */
+static void gst_ts_h264_encrypt_class_init(GstTsH264EncryptClass *klass) {
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = (GObjectClass *)klass;
+  gstelement_class = (GstElementClass *)klass;
+
+  gobject_class->finalize = gst_ts_h264_encrypt_finalize;
+
+  gst_element_class_set_details_simple(
+      gstelement_class, "tsh264encrypt", "Codec/Encryption/Video",
+      "Encrypts the H264 stream of MPEG-TS in place. You must use "
+      "h264decrypt after tsdemux to decrypt.",
+      "Oguzhan Oztaskin <oguzhanoztaskin@gmail.com>");
+
+  // Templates of h264encrypt are replaced by the MPEG-TS ones
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&src_template));
+  gst_element_class_add_pad_template(
+      gstelement_class, gst_static_pad_template_get(&sink_template));
+
+  GST_BASE_TRANSFORM_CLASS(klass)->stop =
+      GST_DEBUG_FUNCPTR(gst_ts_h264_encrypt_stop);
+  GST_BASE_TRANSFORM_CLASS(klass)->set_caps =
+      GST_DEBUG_FUNCPTR(gst_ts_h264_encrypt_set_caps);
+  GST_BASE_TRANSFORM_CLASS(klass)->sink_event =
+      GST_DEBUG_FUNCPTR(gst_ts_h264_encrypt_sink_event);
+  GST_BASE_TRANSFORM_CLASS(klass)->generate_output =
+      GST_DEBUG_FUNCPTR(gst_ts_h264_encrypt_generate_output);
+  GST_BASE_TRANSFORM_CLASS(klass)->propose_allocation = NULL;
+
+  GST_DEBUG_CATEGORY_INIT(gst_ts_h264_encrypt_debug, "tsh264encrypt", 0,
+                          "tsh264encrypt general logs");
+}
+
+/* initialize the new element
+ * initialize instance structure
+ */
+static void gst_ts_h264_encrypt_init(GstTsH264Encrypt *self) {
+  self->adapter = gst_adapter_new();
+  self->held = g_byte_array_new();
+  self->pes = g_byte_array_new();
+  self->encrypted_pes = g_byte_array_new();
+  self->out = g_byte_array_new();
+  self->input = NULL;
+  self->pes_input = NULL;
+  self->out_input = NULL;
+  gst_ts_h264_encrypt_reset(self);
+}
+
+static void gst_ts_h264_encrypt_finalize(GObject *object) {
+  GstTsH264Encrypt *self = GST_TS_H264_ENCRYPT(object);
+  g_object_unref(self->adapter);
+  g_byte_array_unref(self->held);
+  g_byte_array_unref(self->pes);
+  g_byte_array_unref(self->encrypted_pes);
+  g_byte_array_unref(self->out);
+  gst_clear_buffer(&self->pes_input);
+  gst_clear_buffer(&self->out_input);
+  G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+/**
+ * Forgets the stream: PIDs are looked up again and packets in progress are
+ * dropped.
+ */
+static void gst_ts_h264_encrypt_reset(GstTsH264Encrypt *self) {
+  gst_adapter_clear(self->adapter);
+  self->pmt_pid = -1;
+  self->video_pid = -1;
+  self->continuity_counter = -1;
+  self->in_pes = FALSE;
+  g_byte_array_set_size(self->held, 0);
+  g_byte_array_set_size(self->pes, 0);
+  g_byte_array_set_size(self->out, 0);
+  gst_clear_buffer(&self->pes_input);
+  gst_clear_buffer(&self->out_input);
+}
+
+/* GstBaseTransform vmethod implementations */
+
+static gboolean gst_ts_h264_encrypt_stop(GstBaseTransform *trans) {
+  gst_ts_h264_encrypt_reset(GST_TS_H264_ENCRYPT(trans));
+  return GST_BASE_TRANSFORM_CLASS(parent_class)->stop(trans);
+}
+
+/**
+ * PES boundaries need not be access unit boundaries, so slices always have
+ * their own IV.
+ */
+static gboolean gst_ts_h264_encrypt_set_caps(GstBaseTransform *trans,
+                                             GstCaps *incaps,
+                                             GstCaps *outcaps) {
+  GstH264EncryptionUtils *utils = gst_h264_encryption_base_get_encryption_utils(
+      GST_H264_ENCRYPTION_BASE(trans));
+  if (!GST_BASE_TRANSFORM_CLASS(parent_class)
+           ->set_caps(trans, incaps, outcaps)) {
+    return FALSE;
+  }
+  utils->slice_iv = TRUE;
+  return TRUE;
+}
+
+/**
+ * Returns the packets that are ready, if any, with the metadata of the input
+ * buffer that opened the first video PES among them, or of input if none.
+ */
+static GstBuffer *gst_ts_h264_encrypt_take_output(GstTsH264Encrypt *self,
+                                                  GstBuffer *input) {
+  guint size = self->out->len;
+  GstBuffer *metadata = self->out_input != NULL ? self->out_input : input;
+  if (size == 0) {
+    return NULL;
+  }
+  GstBuffer *outbuf =
+      gst_buffer_new_wrapped(g_byte_array_free(self->out, FALSE), size);
+  self->out = g_byte_array_new();
+  if (metadata != NULL) {
+    gst_buffer_copy_into(outbuf, metadata, GST_BUFFER_COPY_METADATA, 0, -1);
+  }
+  gst_clear_buffer(&self->out_input);
+  return outbuf;
+}
+
+static gboolean gst_ts_h264_encrypt_sink_event(GstBaseTransform *trans,
+                                               GstEvent *event) {
+  GstTsH264Encrypt *self = GST_TS_H264_ENCRYPT(trans);
+  switch (GST_EVENT_TYPE(event)) {
+    case GST_EVENT_EOS: {
+      // Last PES ends with the stream
+      gst_ts_h264_encrypt_finish_pes(self);
+      GstBuffer *outbuf = gst_ts_h264_encrypt_take_output(self, NULL);
+      if (outbuf != NULL) {
+        gst_pad_push(GST_BASE_TRANSFORM_SRC_PAD(trans), outbuf);
+      }
+    } break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_ts_h264_encrypt_reset(self);
+      break;
+    default:
+      break;
+  }
+  return GST_BASE_TRANSFORM_CLASS(parent_class)->sink_event(trans, event);
+}
+
+/**
+ * Returns the payload of the TS packet at ts and sets size, or NULL if it has
+ * none.
+ */
+static const guint8 *_ts_payload(const guint8 *ts, guint *size) {
+  guint offset = 4;
+  if (!TS_HAS_PAYLOAD(ts)) {
+    return NULL;
+  }
+  if (TS_HAS_ADAPTATION_FIELD(ts)) {
+    offset += 1 + ts[4];
+  }
+  if (offset >= TS_PACKET_SIZE) {
+    return NULL;
+  }
+  *size = TS_PACKET_SIZE - offset;
+  return &ts[offset];
+}
+
+/**
+ * Returns the section starting in the payload of a packet with the payload
+ * unit start indicator and sets size to the bytes following section_length,
+ * or NULL if the section is not of table_id or does not fit in the packet.
+ * Tables this element needs are small enough to fit.
+ */
+static const guint8 *_ts_section(const guint8 *payload, guint payload_size,
+                                 guint8 table_id, guint *size) {
+  guint pointer = payload[0];
+  if (1 + pointer + 3 > payload_size) {
+    return NULL;
+  }
+  const guint8 *section = &payload[1 + pointer];
+  *size = ((section[1] & 0x0f) << 8) | section[2];
+  if (section[0] != table_id || 1 + pointer + 3 + *size > payload_size ||
+      *size < 9) {
+    return NULL;
+  }
+  return section;
+}
+
+/**
+ * Takes the PMT PID of the first program of the PAT.
+ */
+static void gst_ts_h264_encrypt_parse_pat(GstTsH264Encrypt *self,
+                                          const guint8 *payload,
+                                          guint payload_size) {
+  guint size;
+  const guint8 *section = _ts_section(payload, payload_size, 0x00, &size);
+  if (section == NULL) {
+    return;
+  }
+  // Programs follow the fixed header and precede the CRC
+  for (guint i = 8; i + 4 <= 3 + size - 4; i += 4) {
+    guint program_number = GST_READ_UINT16_BE(&section[i]);
+    if (program_number != 0) {
+      gint pmt_pid = GST_READ_UINT16_BE(&section[i + 2]) & 0x1fff;
+      if (pmt_pid != self->pmt_pid) {
+        GST_DEBUG_OBJECT(self, "PMT PID is %d", pmt_pid);
+        self->pmt_pid = pmt_pid;
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * Takes the PID of the first H264 stream of the PMT.
+ */
+static void gst_ts_h264_encrypt_parse_pmt(GstTsH264Encrypt *self,
+                                          const guint8 *payload,
+                                          guint payload_size) {
+  guint size;
+  const guint8 *section = _ts_section(payload, payload_size, 0x02, &size);
+  if (section == NULL || size < 13) {
+    return;
+  }
+  guint end = 3 + size - 4;
+  guint i = 12 + (GST_READ_UINT16_BE(&section[10]) & 0x0fff);
+  while (i + 5 <= end) {
+    guint8 stream_type = section[i];
+    gint pid = GST_READ_UINT16_BE(&section[i + 1]) & 0x1fff;
+    if (stream_type == TS_STREAM_TYPE_H264) {
+      if (pid != self->video_pid) {
+        GST_INFO_OBJECT(self, "H264 stream PID is %d", pid);
+        // PES of the previous PID is complete
+        gst_ts_h264_encrypt_finish_pes(self);
+        self->video_pid = pid;
+        self->continuity_counter = -1;
+      }
+      return;
+    }
+    i += 5 + (GST_READ_UINT16_BE(&section[i + 3]) & 0x0fff);
+  }
+}
+
+/**
+ * Appends a packet of the video PID to out with the header of the packet at
+ * ts, and its adaptation field if keep_adaptation_field is set. As much of the size bytes at data as fits follows, and data and size
+ * are advanced past it. Adaptation field stuffing fills the rest.
+ */
+static void gst_ts_h264_encrypt_write_video_packet(
+    GstTsH264Encrypt *self, const guint8 *ts, gboolean keep_adaptation_field,
+    gboolean payload_unit_start, const guint8 **data, gsize *size) {
+  guint af_size = 0;  // Adaptation field with its length byte
+  if (keep_adaptation_field && TS_HAS_ADAPTATION_FIELD(ts)) {
+    af_size = MIN(1 + ts[4], TS_PACKET_SIZE - 4);
+  }
+  guint capacity = TS_PACKET_SIZE - 4 - af_size;
+  guint payload_size = MIN(*size, capacity);
+  guint af_total = af_size + capacity - payload_size;
+
+  guint offset = self->out->len;
+  g_byte_array_set_size(self->out, offset + TS_PACKET_SIZE);
+  guint8 *dest = &self->out->data[offset];
+  dest[0] = TS_SYNC_BYTE;
+  dest[1] = (ts[1] & ~0x40) | (payload_unit_start ? 0x40 : 0);
+  dest[2] = ts[2];
+  // Counter is only incremented by packets with payload
+  dest[3] = ts[3] & 0xc0;
+  if (payload_size > 0) {
+    dest[3] |= 0x10 | self->continuity_counter;
+    self->continuity_counter = (self->continuity_counter + 1) & 0x0f;
+  } else {
+    dest[3] |= (self->continuity_counter - 1) & 0x0f;
+  }
+  if (af_total > 0) {
+    guint written = 1;
+    dest[3] |= 0x20;
+    dest[4] = af_total - 1;
+    if (af_size > 1) {
+      memcpy(&dest[5], &ts[5], af_size - 1);
+      written = af_size;
+    } else if (af_total > 1) {
+      // No flags set
+      dest[5] = 0x00;
+      written = 2;
+    }
+    memset(&dest[4 + written], 0xff, af_total - written);
+  }
+  memcpy(&dest[4 + af_total], *data, payload_size);
+  *data += payload_size;
+  *size -= payload_size;
+}
+
+/**
+ * Writes the held packets to out with the size bytes of pes spread over the
+ * video packets that had payload, followed by extra video packets for what
+ * does not fit.
+ */
+static void gst_ts_h264_encrypt_write_held(GstTsH264Encrypt *self,
+                                           const guint8 *pes, gsize size) {
+  guint n_packets = self->held->len / TS_PACKET_SIZE;
+  guint last = 0;
+  for (guint i = 0; i < n_packets; i++) {
+    const guint8 *ts = &self->held->data[i * TS_PACKET_SIZE];
+    if (TS_PID(ts) == self->video_pid && TS_HAS_PAYLOAD(ts)) {
+      last = i;
+    }
+  }
+  gboolean first = TRUE;
+  for (guint i = 0; i < n_packets; i++) {
+    const guint8 *ts = &self->held->data[i * TS_PACKET_SIZE];
+    if (TS_PID(ts) != self->video_pid) {
+      g_byte_array_append(self->out, ts, TS_PACKET_SIZE);
+    } else if (!TS_HAS_PAYLOAD(ts)) {
+      // Adaptation field only, such as PCR, repeats the last counter
+      g_byte_array_append(self->out, ts, TS_PACKET_SIZE);
+      guint8 *dest = &self->out->data[self->out->len - TS_PACKET_SIZE + 3];
+      *dest = (*dest & 0xf0) | ((self->continuity_counter - 1) & 0x0f);
+    } else {
+      gst_ts_h264_encrypt_write_video_packet(self, ts, TRUE, first, &pes,
+                                             &size);
+      first = FALSE;
+      while (i == last && size > 0) {
+        gst_ts_h264_encrypt_write_video_packet(self, ts, FALSE, FALSE, &pes,
+                                               &size);
+      }
+    }
+  }
+  g_byte_array_set_size(self->held, 0);
+  if (self->out_input == NULL) {
+    self->out_input = g_steal_pointer(&self->pes_input);
+  }
+  gst_clear_buffer(&self->pes_input);
+}
+
+/**
+ * Drops the collected video PES and writes out the held packets of other
+ * PIDs.
+ */
+static void gst_ts_h264_encrypt_drop_pes(GstTsH264Encrypt *self) {
+  for (guint i = 0; i < self->held->len; i += TS_PACKET_SIZE) {
+    const guint8 *ts = &self->held->data[i];
+    if (TS_PID(ts) != self->video_pid) {
+      g_byte_array_append(self->out, ts, TS_PACKET_SIZE);
+    }
+  }
+  g_byte_array_set_size(self->held, 0);
+  g_byte_array_set_size(self->pes, 0);
+  gst_clear_buffer(&self->pes_input);
+  self->in_pes = FALSE;
+}
+
+/**
+ * Encrypts the elementary stream of the collected video PES into
+ * encrypted_pes, after the PES header with its length updated. Returns FALSE
+ * if the PES is not a clear video PES, which is then let through as is.
+ */
+static gboolean gst_ts_h264_encrypt_encrypt_pes(GstTsH264Encrypt *self,
+                                                GstFlowReturn *ret) {
+  const guint8 *pes = self->pes->data;
+  gsize size = self->pes->len;
+  GstMapInfo map_info;
+  *ret = GST_FLOW_OK;
+  // Start code, video stream id, length, not scrambled, header length
+  if (size < 9 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01 ||
+      (pes[3] & 0xf0) != 0xe0 || (pes[6] & 0x30) != 0 ||
+      9 + pes[8] > size) {
+    GST_WARNING_OBJECT(self, "Not a clear video PES, passing it through");
+    return FALSE;
+  }
+  gsize header_size = 9 + pes[8];
+  gsize es_size = size - header_size;
+  GstBuffer *es = gst_buffer_new_wrapped_full(
+      GST_MEMORY_FLAG_READONLY, (gpointer)&pes[header_size], es_size, 0,
+      es_size, NULL, NULL);
+  // Each slice grows by at most a block of padding, the end marker and one
+  // emulation prevention byte for every two bytes
+  GstBuffer *encrypted = gst_buffer_new_allocate(NULL, es_size * 2 + 64, NULL);
+  *ret = GST_BASE_TRANSFORM_CLASS(parent_class)
+             ->transform(GST_BASE_TRANSFORM(self), es, encrypted);
+  if (*ret == GST_FLOW_OK &&
+      !gst_buffer_map(encrypted, &map_info, GST_MAP_READ)) {
+    GST_ERROR_OBJECT(self, "Unable to map encrypted PES for read!");
+    *ret = GST_FLOW_ERROR;
+  }
+  if (*ret != GST_FLOW_OK) {
+    gst_buffer_unref(encrypted);
+    gst_buffer_unref(es);
+    return FALSE;
+  }
+  g_byte_array_set_size(self->encrypted_pes, 0);
+  g_byte_array_append(self->encrypted_pes, pes, header_size);
+  g_byte_array_append(self->encrypted_pes, map_info.data, map_info.size);
+  gst_buffer_unmap(encrypted, &map_info);
+  gst_buffer_unref(encrypted);
+  gst_buffer_unref(es);
+  // Unbounded video PES stay so, too long ones become unbounded
+  if (GST_READ_UINT16_BE(&pes[4]) != 0) {
+    gsize length = self->encrypted_pes->len - 6;
+    GST_WRITE_UINT16_BE(&self->encrypted_pes->data[4],
+                        length <= G_MAXUINT16 ? length : 0);
+  }
+  return TRUE;
+}
+
+/**
+ * Encrypts the collected video PES, if any, and writes it out with the
+ * packets held since it started.
+ */
+static gboolean gst_ts_h264_encrypt_finish_pes(GstTsH264Encrypt *self) {
+  GstFlowReturn ret;
+  if (!self->in_pes) {
+    return TRUE;
+  }
+  if (gst_ts_h264_encrypt_encrypt_pes(self, &ret)) {
+    gst_ts_h264_encrypt_write_held(self, self->encrypted_pes->data,
+                                   self->encrypted_pes->len);
+  } else if (ret == GST_FLOW_OK) {
+    gst_ts_h264_encrypt_write_held(self, self->pes->data, self->pes->len);
+  } else {
+    GST_ERROR_OBJECT(self, "Failed to encrypt video PES");
+    gst_ts_h264_encrypt_drop_pes(self);
+    return FALSE;
+  }
+  g_byte_array_set_size(self->pes, 0);
+  self->in_pes = FALSE;
+  return TRUE;
+}
+
+/**
+ * Whether the size bytes at pes, the start of a clear video PES, tell that
+ * it starts with a whole NAL unit: its data_alignment_indicator is set and
+ * its elementary stream starts with a start code, as far as it is in size.
+ * The PES before it then ends with a whole NAL unit too. PES that are not
+ * clear video PES are let through by gst_ts_h264_encrypt_encrypt_pes anyway,
+ * so they are not checked.
+ */
+static gboolean _ts_pes_is_aligned(const guint8 *pes, guint size) {
+  if (size < 9 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01 ||
+      (pes[3] & 0xf0) != 0xe0 || (pes[6] & 0x30) != 0) {
+    return TRUE;
+  }
+  if ((pes[6] & 0x04) == 0) {
+    return FALSE;
+  }
+  guint es = 9 + pes[8];
+  if (es + 3 > size) {
+    return TRUE;
+  }
+  return pes[es] == 0x00 && pes[es + 1] == 0x00 &&
+         (pes[es + 2] == 0x01 ||
+          (pes[es + 2] == 0x00 && (es + 4 > size || pes[es + 3] == 0x01)));
+}
+
+/**
+ * Routes the packet at ts: PSI is parsed on the way, packets are held while a
+ * video PES is collected and video payload is collected.
+ */
+static gboolean gst_ts_h264_encrypt_process_packet(GstTsH264Encrypt *self,
+                                                   const guint8 *ts) {
+  gint pid = TS_PID(ts);
+  guint payload_size = 0;
+  const guint8 *payload = _ts_payload(ts, &payload_size);
+
+  if (payload != NULL && TS_PAYLOAD_UNIT_START(ts)) {
+    if (pid == TS_PAT_PID) {
+      gst_ts_h264_encrypt_parse_pat(self, payload, payload_size);
+    } else if (pid == self->pmt_pid) {
+      gst_ts_h264_encrypt_parse_pmt(self, payload, payload_size);
+    }
+  }
+  if (pid != self->video_pid || payload == NULL) {
+    g_byte_array_append(self->in_pes ? self->held : self->out, ts,
+                        TS_PACKET_SIZE);
+    return TRUE;
+  }
+  if (TS_PAYLOAD_UNIT_START(ts)) {
+    // Slices split over PES would be encrypted in parts, and the parts after
+    // the first one would have no start code to be found by
+    if (!_ts_pes_is_aligned(payload, payload_size)) {
+      GST_ERROR_OBJECT(self,
+                       "Video PES does not start with a NAL unit, only PES "
+                       "with data_alignment_indicator set are supported");
+      gst_ts_h264_encrypt_drop_pes(self);
+      return FALSE;
+    }
+    if (!gst_ts_h264_encrypt_finish_pes(self)) {
+      return FALSE;
+    }
+    if (self->continuity_counter < 0) {
+      // Counting goes on from the first PES on
+      self->continuity_counter = ts[3] & 0x0f;
+    }
+    self->in_pes = TRUE;
+    gst_buffer_replace(&self->pes_input, self->input);
+  } else if (!self->in_pes) {
+    // Rest of a PES whose start was not seen, never let through in clear
+    GST_DEBUG_OBJECT(self, "Dropping video packet of an unknown PES");
+    return TRUE;
+  }
+  g_byte_array_append(self->held, ts, TS_PACKET_SIZE);
+  g_byte_array_append(self->pes, payload, payload_size);
+  return TRUE;
+}
+
+/**
+ * Splits queued input into packets and returns the packets that are ready,
+ * if any. Packets are held from the start of a video PES until its end, ie.
+ * until the next video PES starts.
+ */
+static GstFlowReturn gst_ts_h264_encrypt_generate_output(
+    GstBaseTransform *trans, GstBuffer **outbuf) {
+  GstTsH264Encrypt *self = GST_TS_H264_ENCRYPT(trans);
+  GstBuffer *input = trans->queued_buf;
+
+  *outbuf = NULL;
+  if (input == NULL) {
+    return GST_FLOW_OK;
+  }
+  trans->queued_buf = NULL;
+  if (GST_BUFFER_IS_DISCONT(input) && self->in_pes) {
+    // Encrypting a partial PES could fail, and letting it through would
+    // leak it in clear
+    GST_DEBUG_OBJECT(self, "Discontinuity, dropping the partial video PES");
+    gst_ts_h264_encrypt_drop_pes(self);
+  }
+  self->input = gst_buffer_ref(input);
+  gst_adapter_push(self->adapter, input);
+  while (gst_adapter_available(self->adapter) >= TS_PACKET_SIZE) {
+    const guint8 *ts = gst_adapter_map(self->adapter, TS_PACKET_SIZE);
+    if (G_UNLIKELY(ts[0] != TS_SYNC_BYTE)) {
+      gst_adapter_unmap(self->adapter);
+      gssize sync = gst_adapter_masked_scan_uint32(
+          self->adapter, 0xff000000, TS_SYNC_BYTE << 24, 1,
+          gst_adapter_available(self->adapter) - 1);
+      gsize skip = sync >= 0 ? sync : gst_adapter_available(self->adapter);
+      GST_WARNING_OBJECT(self, "Lost sync, skipping %ld bytes", skip);
+      gst_adapter_flush(self->adapter, skip);
+      continue;
+    }
+    gboolean processed = gst_ts_h264_encrypt_process_packet(self, ts);
+    gst_adapter_unmap(self->adapter);
+    gst_adapter_flush(self->adapter, TS_PACKET_SIZE);
+    if (!processed) {
+      gst_clear_buffer(&self->input);
+      return GST_FLOW_ERROR;
+    }
+  }
+  *outbuf = gst_ts_h264_encrypt_take_output(self, self->input);
+  gst_clear_buffer(&self->input);
+  return GST_FLOW_OK;
+}
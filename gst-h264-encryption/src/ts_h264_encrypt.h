@@ -0,0 +1,68 @@
+/*
+ * GStreamer
+ * Copyright (C) 2006 Stefan Kost <ensonic@users.sf.net>
+ * Copyright (C) 2020 Niels De Graef <niels.degraef@gmail.com>
+ * Copyright (C) 2024 root <<user@hostname.org>>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_TS_H264_ENCRYPT_H__
+#define __GST_TS_H264_ENCRYPT_H__
+
+#include <gst/base/gstadapter.h>
+#include <gst/gst.h>
+
+#include "h264_encrypt.h"
+
+G_BEGIN_DECLS
+
+GST_ELEMENT_REGISTER_DECLARE(tsh264encrypt)
+#define GST_TYPE_TS_H264_ENCRYPT (gst_ts_h264_encrypt_get_type())
+G_DECLARE_FINAL_TYPE(GstTsH264Encrypt, gst_ts_h264_encrypt, GST,
+                     TS_H264_ENCRYPT, GstH264Encrypt)
+
+struct _GstTsH264Encrypt {
+  GstH264Encrypt h264encrypt;
+
+  // Input not split into packets yet
+  GstAdapter *adapter;
+  // PIDs of the program map table and of the H264 stream, -1 until known
+  gint pmt_pid;
+  gint video_pid;
+  // Continuity counter of the next video packet with payload, -1 until the
+  // first video PES
+  gint continuity_counter;
+  // A video PES is being collected, from its first packet on
+  gboolean in_pes;
+  // Packets of all PIDs since the video PES started, in input order
+  GByteArray *held;
+  // Video PES collected so far, and the encrypted one
+  GByteArray *pes;
+  GByteArray *encrypted_pes;
+  // Input buffer being split into packets, the one that opened the video
+  // PES being collected, and the one whose metadata out takes, which opened
+  // the first PES written to it
+  GstBuffer *input;
+  GstBuffer *pes_input;
+  GstBuffer *out_input;
+  // Packets ready to be pushed
+  GByteArray *out;
+};
+
+G_END_DECLS
+
+#endif /* __GST_TS_H264_ENCRYPT_H__ */